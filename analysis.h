@@ -0,0 +1,477 @@
+// Control-flow analysis over decoded 8086 code. Like disasm.h, this works
+// only on memory the caller provides and does no I/O.
+#ifndef ANALYSIS_H
+#define ANALYSIS_H
+
+#include <algorithm>
+#include <vector>
+#include "disasm.h"
+
+enum class FlowKind : uint8_t
+{
+    Next,       // execution continues with the following instruction
+    Jump,       // unconditional transfer to a known target
+    CondJump,   // transfer to a known target or fall through
+    Call,       // call to a known target, returns to the next instruction
+    CallOther,  // indirect or far call: falls through, target unknown here
+    Stop        // return, indirect or far jump: nothing known follows
+};
+
+inline FlowKind flowKind(const DecodedInsn &insn)
+{
+    switch (insn.mnemonic)
+    {
+    case Mnemonic::Jo:
+    case Mnemonic::Jno:
+    case Mnemonic::Jb:
+    case Mnemonic::Jnb:
+    case Mnemonic::Je:
+    case Mnemonic::Jne:
+    case Mnemonic::Jbe:
+    case Mnemonic::Jnbe:
+    case Mnemonic::Js:
+    case Mnemonic::Jns:
+    case Mnemonic::Jp:
+    case Mnemonic::Jnp:
+    case Mnemonic::Jl:
+    case Mnemonic::Jnl:
+    case Mnemonic::Jle:
+    case Mnemonic::Jnle:
+    case Mnemonic::Loopne:
+    case Mnemonic::Loope:
+    case Mnemonic::Loop:
+    case Mnemonic::Jcxz:
+        return FlowKind::CondJump;
+    case Mnemonic::Jmp:
+        return insn.op[0].kind == OperandKind::Rel ? FlowKind::Jump : FlowKind::Stop;
+    case Mnemonic::Call:
+        return insn.op[0].kind == OperandKind::Rel ? FlowKind::Call : FlowKind::CallOther;
+    case Mnemonic::CallFar:
+        return FlowKind::CallOther;
+    case Mnemonic::JmpFar:
+    case Mnemonic::Ret:
+    case Mnemonic::Retf:
+    case Mnemonic::Iret:
+        return FlowKind::Stop;
+    default:
+        return FlowKind::Next;
+    }
+}
+
+// Image offset a relative branch lands on, or -1 if insn has none.
+inline long branchTarget(const DecodedInsn &insn)
+{
+    if (insn.op[0].kind != OperandKind::Rel)
+    {
+        return -1;
+    }
+    return (long)insn.offset + insn.length + (int16_t)insn.imm;
+}
+
+// Image offset a far JMP/CALL ptr16:16 lands on, or -1. relocs are the
+// ascending image offsets of the segment words a loader fixes up (see
+// loader.h); only a relocated segment is relative to the image; an
+// absolute one points outside it.
+inline long farTarget(const DecodedInsn &insn, const std::vector<uint32_t> &relocs)
+{
+    if (insn.op[0].kind != OperandKind::Far ||
+        !std::binary_search(relocs.begin(), relocs.end(), insn.offset + insn.length - 2))
+    {
+        return -1;
+    }
+    return (long)insn.seg * 16 + insn.imm;
+}
+
+// Length-only decode for passes that need nothing but instruction starts
+// and branch targets: returns insnLength(p, n, status) and sets *target as
+// branchTarget would for the instruction at image offset `offset`.
+inline size_t scanInsn(const uint8_t *p, size_t n, size_t offset, long *target, DecodeStatus *status)
+{
+    size_t len = insnLength(p, n, status);
+    *target = -1;
+    if (*status != DecodeStatus::Ok)
+    {
+        return len;
+    }
+    size_t i = 0;
+    while (i < len && (lengthTable.flags[p[i]] & LenPrefix))
+    {
+        i++;
+    }
+    if (i == len)
+    {
+        return len; // Mnemonic::Prefix
+    }
+    // A relative branch has nothing after its displacement.
+    OperandSpec s = opcodeTable.spec[p[i]].op[0];
+    if (s == OperandSpec::Jb)
+    {
+        *target = (long)(offset + len) + (int8_t)p[len - 1];
+    }
+    else if (s == OperandSpec::Jw)
+    {
+        *target = (long)(offset + len) + (int16_t)(p[len - 2] | p[len - 1] << 8);
+    }
+    return len;
+}
+
+// First pass of a labelled listing of [lo, hi): collects the targets of
+// relative branches and where instructions start. Only targets that start
+// an instruction become labels, since a label is printed on a line of its
+// own; a branch into the middle of one keeps its displacement.
+struct LabelPass
+{
+    size_t lo;
+    size_t hi;
+    std::vector<uint64_t> starts; // bit per byte of [lo, hi)
+    TargetSet targets;
+
+public:
+    LabelPass(size_t lo, size_t hi) : lo(lo), hi(hi), starts((hi - lo + 63) / 64) {}
+
+    void Start(size_t off)
+    {
+        if (off >= lo && off < hi)
+        {
+            starts[(off - lo) >> 6] |= uint64_t(1) << ((off - lo) & 63);
+        }
+    }
+
+    void Target(long target)
+    {
+        if (target >= 0 && (size_t)target >= lo && (size_t)target < hi)
+        {
+            targets.Insert(target);
+        }
+    }
+
+    void Add(const DecodedInsn &insn)
+    {
+        Start(insn.offset);
+        Target(branchTarget(insn));
+    }
+
+    // Adds the targets that turned out to start instructions to labels.
+    void Finish(TargetSet &labels) const
+    {
+        labels.Reserve(targets.Size());
+        for (uint32_t t : targets.slots)
+        {
+            if (t != TargetSet::EmptySlot && (starts[(t - lo) >> 6] >> ((t - lo) & 63) & 1))
+            {
+                labels.Insert(t);
+            }
+        }
+    }
+};
+
+enum class XrefKind : uint8_t
+{
+    Jump,     // JMP to a relative target
+    CondJump, // Jcc, LOOP and JCXZ
+    Call,     // CALL to a relative target
+    Data      // direct [disp16] memory operand
+};
+
+constexpr const char *xrefKindNames[] = {"jump", "cond", "call", "data"};
+
+struct Xref
+{
+    uint32_t from; // offset of the referencing instruction
+    XrefKind kind;
+};
+
+// Who references what: built from decoded instructions as a sweep goes,
+// then frozen into compressed sparse rows. Targets are kept once each in
+// ascending order, and the refs of targets[i] are refs[first[i],
+// first[i + 1]), ordered by where they come from, so looking up one target
+// is a binary search. Branch targets are image offsets; data targets are
+// the 16-bit addresses the operands name.
+struct XrefIndex
+{
+    struct Edge
+    {
+        uint32_t target;
+        Xref ref;
+    };
+
+    std::vector<uint32_t> targets;
+    std::vector<uint32_t> first; // targets.size() + 1 entries once finished
+    std::vector<Xref> refs;
+    std::vector<Edge> edges; // collected until Finish
+    const std::vector<uint32_t> *relocs = nullptr; // to resolve far branches
+
+public:
+    void Add(const DecodedInsn &insn)
+    {
+        FlowKind flow = flowKind(insn);
+        long target = branchTarget(insn);
+        if (target < 0 && relocs && (target = farTarget(insn, *relocs)) >= 0)
+        {
+            flow = insn.mnemonic == Mnemonic::CallFar ? FlowKind::Call : FlowKind::Jump;
+        }
+        if (target >= 0 && target <= (long)UINT32_MAX)
+        {
+            XrefKind kind = flow == FlowKind::Call ? XrefKind::Call
+                          : flow == FlowKind::CondJump ? XrefKind::CondJump : XrefKind::Jump;
+            edges.push_back(Edge{(uint32_t)target, Xref{insn.offset, kind}});
+            return;
+        }
+        for (const Operand &op : insn.op)
+        {
+            if (op.kind == OperandKind::Direct || (op.kind == OperandKind::ModRm && (insn.modrm & 0xC7) == 0x06))
+            {
+                edges.push_back(Edge{(uint16_t)insn.disp, Xref{insn.offset, XrefKind::Data}});
+            }
+        }
+    }
+
+    // Builds the rows from what was added; Add is not called afterwards.
+    void Finish()
+    {
+        std::sort(edges.begin(), edges.end(), [](const Edge &a, const Edge &b)
+        {
+            return a.target != b.target ? a.target < b.target : a.ref.from < b.ref.from;
+        });
+        refs.reserve(edges.size());
+        for (const Edge &e : edges)
+        {
+            if (targets.empty() || targets.back() != e.target)
+            {
+                targets.push_back(e.target);
+                first.push_back(refs.size());
+            }
+            refs.push_back(e.ref);
+        }
+        first.push_back(refs.size());
+        edges = std::vector<Edge>();
+    }
+
+    // The refs to target, or nullptr and *count 0 if there are none.
+    const Xref *Find(uint32_t target, size_t *count) const
+    {
+        auto it = std::lower_bound(targets.begin(), targets.end(), target);
+        if (it == targets.end() || *it != target)
+        {
+            *count = 0;
+            return nullptr;
+        }
+        size_t i = it - targets.begin();
+        *count = first[i + 1] - first[i];
+        return refs.data() + first[i];
+    }
+};
+
+// Recursive-traversal disassembly: starting from entry points, decodes only
+// what control flow can reach, following jump, loop and call targets from a
+// worklist. A bitmap of instruction starts stops every path that reaches
+// an instruction already decoded, so each one is decoded once. A path into
+// the middle of a known instruction (a jump into its operand bytes, say) is
+// followed too; what it decodes overlaps the other and is counted.
+// Given the relocations of a loaded image it follows far jumps and calls
+// into the image too.
+struct RecursiveTraversal
+{
+    const uint8_t *image;
+    size_t size;
+    std::vector<uint64_t> covered; // bytes of decoded instructions
+    std::vector<uint64_t> starts;  // their first bytes
+    std::vector<size_t> worklist;
+    std::vector<DecodedInsn> insns;
+    size_t invalid;  // paths that ran into bytes that do not decode
+    size_t overlaps; // instructions sharing bytes with one decoded before
+    const std::vector<uint32_t> *relocs = nullptr;
+
+public:
+    RecursiveTraversal(const uint8_t *image, size_t size)
+        : image(image), size(size), covered((size + 63) / 64), starts((size + 63) / 64), invalid(0), overlaps(0) {}
+
+    bool IsCovered(size_t off) const
+    {
+        return covered[off >> 6] >> (off & 63) & 1;
+    }
+
+    bool IsStart(size_t off) const
+    {
+        return starts[off >> 6] >> (off & 63) & 1;
+    }
+
+    // Marks [off, off + len) decoded; returns true if any of it already was.
+    bool Cover(size_t off, size_t len)
+    {
+        bool overlap = false;
+        for (size_t i = off; i < off + len; i++)
+        {
+            overlap |= IsCovered(i);
+            covered[i >> 6] |= uint64_t(1) << (i & 63);
+        }
+        starts[off >> 6] |= uint64_t(1) << (off & 63);
+        return overlap;
+    }
+
+    void AddEntry(long off)
+    {
+        if (off >= 0 && (size_t)off < size && !IsStart(off))
+        {
+            worklist.push_back(off);
+        }
+    }
+
+    void Run()
+    {
+        while (!worklist.empty())
+        {
+            size_t pc = worklist.back();
+            worklist.pop_back();
+            while (pc < size && !IsStart(pc))
+            {
+                DecodedInsn insn;
+                if (decodeInsn(image + pc, size - pc, &insn) != DecodeStatus::Ok)
+                {
+                    invalid++;
+                    break;
+                }
+                insn.offset = pc;
+                overlaps += Cover(pc, insn.length);
+                insns.push_back(insn);
+
+                FlowKind kind = flowKind(insn);
+                if (kind == FlowKind::Jump || kind == FlowKind::CondJump || kind == FlowKind::Call)
+                {
+                    AddEntry(branchTarget(insn));
+                }
+                else if (relocs && (kind == FlowKind::CallOther || kind == FlowKind::Stop))
+                {
+                    AddEntry(farTarget(insn, *relocs));
+                }
+                if (kind == FlowKind::Jump || kind == FlowKind::Stop)
+                {
+                    break;
+                }
+                pc += insn.length;
+            }
+        }
+        std::sort(insns.begin(), insns.end(),
+                  [](const DecodedInsn &a, const DecodedInsn &b) { return a.offset < b.offset; });
+    }
+};
+
+// A straight-line run of instructions entered only at its first one.
+struct BasicBlock
+{
+    uint32_t start; // offset of the first instruction
+    uint32_t end;   // offset just past the last instruction
+    uint32_t firstInsn; // index into BlockStore::insns
+    uint32_t insnCount;
+    int32_t succ[2]; // successor block indices, -1 if none
+};
+
+// Basic blocks over a set of decoded instructions, sorted by start offset,
+// with successors stored with each block. Instructions may overlap (code
+// that jumps into the middle of another instruction): a block follows each
+// instruction to the one at its end, so two overlapping runs form separate
+// blocks, and a block's range can share bytes with another's.
+struct BlockStore
+{
+    std::vector<DecodedInsn> insns; // grouped by block, each in offset order
+    std::vector<BasicBlock> blocks;
+    size_t overlaps; // instructions that start inside an earlier one
+
+public:
+    // insns must be sorted by offset, at most one per offset.
+    explicit BlockStore(std::vector<DecodedInsn> sorted) : overlaps(0)
+    {
+        size_t n = sorted.size();
+        auto indexOf = [&sorted](long off) -> long {
+            auto it = std::lower_bound(sorted.begin(), sorted.end(), off,
+                                       [](const DecodedInsn &a, long o) { return (long)a.offset < o; });
+            return it != sorted.end() && (long)it->offset == off ? it - sorted.begin() : -1;
+        };
+
+        // Leaders: every branch target, everything after a branch, and
+        // anything not entered from exactly one instruction ending at it.
+        std::vector<uint8_t> entered(n, 0);
+        std::vector<bool> leader(n, false);
+        uint32_t reach = 0;
+        for (size_t i = 0; i < n; i++)
+        {
+            const DecodedInsn &insn = sorted[i];
+            overlaps += insn.offset < reach;
+            reach = std::max(reach, insn.offset + insn.length);
+            FlowKind kind = flowKind(insn);
+            if (kind == FlowKind::Jump || kind == FlowKind::CondJump || kind == FlowKind::Call)
+            {
+                long t = indexOf(branchTarget(insn));
+                if (t >= 0)
+                {
+                    leader[t] = true;
+                }
+            }
+            long next = indexOf(insn.offset + insn.length);
+            if (next >= 0)
+            {
+                entered[next] = std::min(entered[next] + 1, 2);
+                if (kind == FlowKind::Jump || kind == FlowKind::CondJump || kind == FlowKind::Stop)
+                {
+                    leader[next] = true;
+                }
+            }
+        }
+
+        // Each block takes its leader and the instructions after it, up to
+        // the next leader or a gap.
+        insns.reserve(n);
+        for (size_t i = 0; i < n; i++)
+        {
+            if (!leader[i] && entered[i] == 1)
+            {
+                continue;
+            }
+            BasicBlock b{sorted[i].offset, 0, (uint32_t)insns.size(), 0, {-1, -1}};
+            for (long k = i; k >= 0 && (k == (long)i || (!leader[k] && entered[k] == 1));)
+            {
+                insns.push_back(sorted[k]);
+                b.insnCount++;
+                b.end = sorted[k].offset + sorted[k].length;
+                FlowKind kind = flowKind(sorted[k]);
+                k = kind == FlowKind::Jump || kind == FlowKind::CondJump || kind == FlowKind::Stop ? -1 : indexOf(b.end);
+            }
+            blocks.push_back(b);
+        }
+
+        for (BasicBlock &b : blocks)
+        {
+            const DecodedInsn &last = insns[b.firstInsn + b.insnCount - 1];
+            FlowKind kind = flowKind(last);
+            int k = 0;
+            if (kind == FlowKind::Jump || kind == FlowKind::CondJump)
+            {
+                b.succ[k] = Find(branchTarget(last));
+                k += b.succ[k] >= 0;
+            }
+            if (kind != FlowKind::Jump && kind != FlowKind::Stop)
+            {
+                b.succ[k] = Find(b.end);
+            }
+        }
+    }
+
+    // Index of the block that starts at offset, or -1.
+    int32_t Find(long offset) const
+    {
+        auto it = std::lower_bound(blocks.begin(), blocks.end(), offset,
+                                   [](const BasicBlock &b, long o) { return (long)b.start < o; });
+        if (it == blocks.end() || (long)it->start != offset)
+        {
+            return -1;
+        }
+        return it - blocks.begin();
+    }
+
+    const BasicBlock &Block(int32_t i) const
+    {
+        return blocks[i];
+    }
+};
+
+#endif
@@ -0,0 +1,170 @@
+// Synthetic 8086 code for benchmarking the decoder. The corpus is built
+// from opcodeTable, so every instruction it contains decodes, and a given
+// seed always yields the same bytes.
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <vector>
+#include "disasm.h"
+
+// xorshift64*: small, fast and identical on every platform, unlike the
+// <random> distributions.
+struct BenchRng
+{
+    uint64_t state;
+
+public:
+    explicit BenchRng(uint64_t seed) : state(seed ? seed : 0x9E3779B97F4A7C15ull) {}
+
+    uint64_t Next()
+    {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return state * 0x2545F4914F6CDD1Dull;
+    }
+
+    uint32_t Below(uint32_t n)
+    {
+        return (uint32_t)((Next() >> 32) % n);
+    }
+};
+
+struct CorpusGenerator
+{
+    // Opcode classes the corpus mixes, with their share of instructions in
+    // percent. The mix leans on ModRM forms like real code does.
+    enum Class
+    {
+        ClassModRm,     // register/memory operand, any mod
+        ClassImmediate, // immediate operand without ModRM
+        ClassBranch,    // relative and far jumps, calls, loops
+        ClassPrefixed,  // segment, REP or LOCK prefix before a ModRM/string insn
+        ClassPlain,     // one-byte instructions
+        ClassCount
+    };
+    static constexpr unsigned weights[ClassCount] = {45, 20, 15, 5, 15};
+
+    std::vector<uint8_t> opcodes[ClassCount];
+    std::vector<uint8_t> prefixes;
+    BenchRng rng;
+
+public:
+    explicit CorpusGenerator(uint64_t seed) : rng(seed)
+    {
+        for (int b = 0; b < 256; b++)
+        {
+            const OpcodeSpec &s = opcodeTable.spec[b];
+            if (s.flags & SpecPrefix)
+            {
+                prefixes.push_back(b);
+                continue;
+            }
+            if (s.mnemonic == Mnemonic::Invalid && !(s.flags & SpecGroup))
+            {
+                continue;
+            }
+            opcodes[classOf(s)].push_back(b);
+        }
+    }
+
+    // Appends whole instructions to out, size bytes of them.
+    void Generate(size_t size, std::vector<uint8_t> &out)
+    {
+        out.reserve(out.size() + size);
+        size_t end = out.size() + size;
+        while (out.size() < end)
+        {
+            Append(out, end - out.size());
+        }
+    }
+
+private:
+    static bool isBranch(OperandSpec s)
+    {
+        return s == OperandSpec::Jb || s == OperandSpec::Jw || s == OperandSpec::Ap;
+    }
+
+    static bool isImmediate(OperandSpec s)
+    {
+        return s == OperandSpec::Ib || s == OperandSpec::Iw || s == OperandSpec::Ibs ||
+               s == OperandSpec::Ob || s == OperandSpec::Ow || s == OperandSpec::Base;
+    }
+
+    static Class classOf(const OpcodeSpec &s)
+    {
+        if (s.flags & SpecModRm)
+        {
+            return ClassModRm;
+        }
+        if (isBranch(s.op[0]))
+        {
+            return ClassBranch;
+        }
+        if (isImmediate(s.op[0]) || isImmediate(s.op[1]))
+        {
+            return ClassImmediate;
+        }
+        return ClassPlain;
+    }
+
+    Class pickClass()
+    {
+        uint32_t r = rng.Below(100);
+        for (int c = 0; c < ClassCount; c++)
+        {
+            if (r < weights[c])
+            {
+                return (Class)c;
+            }
+            r -= weights[c];
+        }
+        return ClassPlain;
+    }
+
+    // Draws candidate encodings of the chosen class until one decodes; only
+    // group opcodes with an undefined ModRM reg field ever need a retry. One
+    // longer than room is dropped for a new class, so the corpus ends on a
+    // whole instruction at its requested size.
+    void Append(std::vector<uint8_t> &out, size_t room)
+    {
+        Class c = pickClass();
+        for (;;)
+        {
+            uint8_t bytes[8];
+            size_t n = 0;
+            if (c == ClassPrefixed)
+            {
+                bytes[n++] = prefixes[rng.Below(prefixes.size())];
+                const std::vector<uint8_t> &ops = opcodes[rng.Below(2) ? ClassModRm : ClassPlain];
+                bytes[n++] = ops[rng.Below(ops.size())];
+            }
+            else
+            {
+                bytes[n++] = opcodes[c][rng.Below(opcodes[c].size())];
+            }
+            uint64_t r = rng.Next();
+            while (n < sizeof(bytes))
+            {
+                bytes[n++] = (uint8_t)r;
+                r >>= 8;
+            }
+
+            DecodedInsn insn;
+            if (decodeInsn(bytes, sizeof(bytes), &insn) == DecodeStatus::Ok)
+            {
+                if (insn.length <= room)
+                {
+                    out.insert(out.end(), bytes, bytes + insn.length);
+                    return;
+                }
+                c = pickClass();
+            }
+        }
+    }
+};
+
+static_assert(sizeof(CorpusGenerator::weights) / sizeof(unsigned) == CorpusGenerator::ClassCount,
+              "one weight per class");
+
+#endif
@@ -0,0 +1,44 @@
+// Out-of-line definitions of the libdisasm entry points declared in
+// disasm.h. Built into libdisasm.a / libdisasm.so by the Makefile.
+#include "disasm.h"
+
+size_t decode(const uint8_t *p, size_t n, DecodedInsn *out)
+{
+    if (decodeInsn(p, n, out) != DecodeStatus::Ok)
+    {
+        return 0;
+    }
+    return out->length;
+}
+
+size_t formatInsn(const DecodedInsn *insn, char *buf, size_t len)
+{
+    if (len < InsnFormatter::MaxLine)
+    {
+        return 0;
+    }
+    InsnFormatter f;
+    return f.Format(*insn, buf);
+}
+
+size_t formatInsn(const DecodedInsn *insn, char *buf, size_t len, Syntax syntax)
+{
+    if (len < InsnFormatter::MaxLine)
+    {
+        return 0;
+    }
+    switch (syntax)
+    {
+    case Syntax::Nasm:
+        return NasmFormatter().Format(*insn, buf);
+    case Syntax::Att:
+        return AttFormatter().Format(*insn, buf);
+    default:
+        return InsnFormatter().Format(*insn, buf);
+    }
+}
+
+size_t decodeLength(const uint8_t *p, size_t n)
+{
+    return insnLength(p, n);
+}
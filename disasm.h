@@ -0,0 +1,1802 @@
+// 8086 instruction decoder and text formatter.
+//
+// Everything here works on memory the caller provides: no file or console
+// I/O, no exit/abort on bad input, and no mutable global state. The types
+// and inline functions can be used directly by including this header; the
+// entry points at the bottom are also compiled into libdisasm (disasm.cpp)
+// for programs that would rather link against a library.
+#ifndef DISASM_H
+#define DISASM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include "profile.h"
+
+enum Mod
+{
+    Displacement0,
+    Displacement8,
+    Displacement16,
+    RegisterMode
+};
+
+inline const char *getRegNameWclear(uint8_t r)
+{
+    switch (r)
+    {
+    case 0:
+        return "AL";
+    case 5:
+        return "CH";
+    case 1:
+        return "CL";
+    case 6:
+        return "DH";
+    case 2:
+        return "DL";
+    case 7:
+        return "BH";
+    case 3:
+        return "BL";
+    case 4:
+        return "AH";
+    default:
+        return "??";
+    }
+}
+
+inline const char *getRegNameWset(uint8_t r)
+{
+    r &= 0b111;
+    switch (r)
+    {
+    case 0:
+        return "AX";
+    case 3:
+        return "BX";
+    case 2:
+        return "DX";
+    case 6:
+        return "SI";
+    case 4:
+        return "SP";
+    case 5:
+        return "Bp";
+    case 7:
+        return "Di";
+    case 1:
+        return "Cx";
+    default:
+        return "??";
+    }
+}
+
+inline const char *getRegName(uint8_t r, int wset)
+{
+    if (wset)
+    {
+        return getRegNameWset(r);
+    }
+    return getRegNameWclear(r);
+}
+
+// Text of each ModRM memory form in the original listing, split around the
+// displacement: head, then the displacement (if any) and "]". Built once at
+// compile time so a memory operand is a copy plus at most one number.
+// Kept as the original helpers printed them: disp8 unsigned, and rm 6 with
+// a displacement reading "[BX + d]".
+enum class FragmentDisp : uint8_t
+{
+    None,
+    Signed, // int16, "%d"
+    Byte    // uint8, "%u"
+};
+
+struct ModRmFragment
+{
+    char head[12]; // NUL-padded, so it can be copied whole
+    uint8_t length;
+    FragmentDisp disp;
+};
+
+struct ModRmFragments
+{
+    ModRmFragment form[3][8]; // by mod (memory forms only) and rm
+};
+
+constexpr ModRmFragments BuildModRmFragments()
+{
+    const char *bases[] = {"BX + SI", "BX + DI", "BP + SI", "BP + DI", "SI", "DI", "", "BX"};
+    ModRmFragments t{};
+    for (int mod = 0; mod < 3; mod++)
+    {
+        for (int rm = 0; rm < 8; rm++)
+        {
+            ModRmFragment &f = t.form[mod][rm];
+            // With a displacement, rm 6 is [BP + d]; the original printed BX.
+            const char *parts[] = {"[", mod != 0 && rm == 6 ? "BX" : bases[rm],
+                                   mod == 0 ? (rm == 6 ? "" : "]") : " + "};
+            for (const char *part : parts)
+            {
+                for (; *part; part++)
+                {
+                    f.head[f.length++] = *part;
+                }
+            }
+            f.disp = mod == 1 ? FragmentDisp::Byte : mod == 2 || rm == 6 ? FragmentDisp::Signed : FragmentDisp::None;
+        }
+    }
+    return t;
+}
+
+constexpr ModRmFragments modRmFragments = BuildModRmFragments();
+
+typedef struct
+{
+    uint32_t rm : 3;
+    uint32_t reg : 3;
+    Mod mod : 2;
+} __attribute__((packed))
+Byte2;
+
+inline const char *getSegReg(uint8_t s)
+{
+    switch (s & 0b11)
+    {
+    case 0:
+        return "ES";
+        break;
+    case 1:
+        return "CS";
+        break;
+    case 2:
+        return "SS";
+        break;
+    case 3:
+        return "DS";
+        break;
+    }
+    return "??";
+}
+
+enum class Mnemonic : uint8_t
+{
+    Invalid,
+    Add,
+    Or,
+    Adc,
+    Sbb,
+    And,
+    Sub,
+    Xor,
+    Cmp,
+    Daa,
+    Das,
+    Aaa,
+    Aas,
+    Inc,
+    Dec,
+    Push,
+    Pop,
+    Jo,
+    Jno,
+    Jb,
+    Jnb,
+    Je,
+    Jne,
+    Jbe,
+    Jnbe,
+    Js,
+    Jns,
+    Jp,
+    Jnp,
+    Jl,
+    Jnl,
+    Jle,
+    Jnle,
+    Test,
+    Xchg,
+    Mov,
+    Lea,
+    Nop,
+    Cbw,
+    Cwd,
+    Call,
+    CallFar,
+    Wait,
+    Pushf,
+    Popf,
+    Sahf,
+    Lahf,
+    Movs,
+    Cmps,
+    Stos,
+    Lods,
+    Scas,
+    Ret,
+    Retf,
+    Les,
+    Lds,
+    Int,
+    Into,
+    Iret,
+    Rol,
+    Ror,
+    Rcl,
+    Rcr,
+    Shl,
+    Shr,
+    Sar,
+    Aam,
+    Aad,
+    Xlat,
+    Loopne,
+    Loope,
+    Loop,
+    Jcxz,
+    In,
+    Out,
+    Jmp,
+    JmpFar,
+    Hlt,
+    Cmc,
+    Not,
+    Neg,
+    Mul,
+    Imul,
+    Div,
+    Idiv,
+    Clc,
+    Stc,
+    Cli,
+    Sti,
+    Cld,
+    Std,
+    Prefix, // prefixes alone: the byte after them repeats one of their kinds
+    Count
+};
+
+// Text printed for each mnemonic. Far transfers share the near spelling.
+constexpr const char *mnemonicNames[] = {
+    "(bad)", "ADD", "OR", "ADC", "SBB", "AND", "SUB", "XOR", "CMP",
+    "DAA", "DAS", "AAA", "AAS", "INC", "DEC", "PUSH", "POP",
+    "JO", "JNO", "JB", "JNB", "JE", "JNE", "JBE", "JNBE",
+    "JS", "JNS", "JP", "JNP", "JL", "JNL", "JLE", "JNLE",
+    "TEST", "XCHG", "MOV", "LEA", "NOP", "CBW", "CWD", "CALL", "CALL",
+    "WAIT", "PUSHF", "POPF", "SAHF", "LAHF",
+    "MOVS", "CMPS", "STOS", "LODS", "SCARS", "RET", "RET", "LES", "LDS",
+    "INT", "INTO", "IRET", "ROL", "ROR", "RCL", "RCR", "SHL", "SHR", "SAR",
+    "AAM", "AAD", "XLAT", "LOOPNE", "LOOPE", "LOOP", "JCXZ", "IN", "OUT",
+    "JMP", "JMP", "HLT", "CMC", "NOT", "NEG", "MUL", "IMUL", "DIV", "IDIV",
+    "CLC", "STC", "CLI", "STI", "CLD", "STD", "(prefix)"};
+
+static_assert(sizeof(mnemonicNames) / sizeof(mnemonicNames[0]) == (size_t)Mnemonic::Count,
+              "mnemonicNames out of sync with Mnemonic");
+
+enum class OperandKind : uint8_t
+{
+    None,
+    Reg,    // register fixed by the opcode byte (AX, CL, DX, ...)
+    ModReg, // register selected by the ModRM reg field
+    ModRm,  // ModRM r/m operand: register or memory, see DecodedInsn::modrm
+    Seg,    // segment register
+    Direct, // [disp] memory operand without ModRM (MOV AL, [addr])
+    Imm,    // immediate value in DecodedInsn::imm
+    Rel,    // signed branch displacement in DecodedInsn::imm
+    Far     // segment:offset pointer in DecodedInsn::seg / DecodedInsn::imm
+};
+
+struct Operand
+{
+    OperandKind kind;
+    uint8_t size; // 1 or 2 bytes
+    uint8_t reg;  // register number (Reg, ModReg, Seg) or r/m field (ModRm)
+};
+
+enum Prefix : uint8_t
+{
+    PrefixES = 1 << 0,
+    PrefixCS = 1 << 1,
+    PrefixSS = 1 << 2,
+    PrefixDS = 1 << 3,
+    PrefixLock = 1 << 4,
+    PrefixRepne = 1 << 5,
+    PrefixRep = 1 << 6,
+    PrefixSegment = PrefixES | PrefixCS | PrefixSS | PrefixDS
+};
+
+// An instruction takes at most one prefix of each kind: a segment override,
+// LOCK, and REP or REPNE. A second one of a kind ends the instruction
+// before it, so a run of prefixes decodes as one Mnemonic::Prefix record
+// per repeat, each line printed as the original listing printed it.
+constexpr int MaxPrefixes = 3;
+
+constexpr uint8_t prefixKind(uint8_t prefix)
+{
+    return prefix & PrefixSegment ? PrefixSegment : prefix & (PrefixRep | PrefixRepne) ? PrefixRep | PrefixRepne : prefix;
+}
+
+// DecodedInsn::prefixOrder: the kinds of its prefixes in the order they
+// were read, two bits each with the first in the low bits.
+enum PrefixSlot : uint8_t
+{
+    SlotSegment = 1,
+    SlotLock,
+    SlotRep // REP or REPNE, whichever of the Prefix bits is set
+};
+
+constexpr uint8_t prefixSlot(uint8_t prefix)
+{
+    return prefix & PrefixSegment ? SlotSegment : prefix & PrefixLock ? SlotLock : SlotRep;
+}
+
+enum InsnFlags : uint8_t
+{
+    FlagByte = 1 << 0, // print an explicit "byte" size keyword
+    FlagWord = 1 << 1,     // print an explicit "word" size keyword
+    FlagTruncated = 1 << 2 // Invalid record: the input ended mid-instruction
+};
+
+// One decoded instruction. Prefix bytes are folded into the instruction
+// they apply to, so offset/length cover the prefixes as well; there are at
+// most MaxPrefixes of them.
+struct DecodedInsn
+{
+    uint32_t offset;
+    uint8_t length;
+    uint8_t opcode; // first byte after any prefixes
+    uint8_t modrm;
+    uint8_t prefixes;    // Prefix bits
+    uint8_t prefixOrder; // PrefixSlot values in byte order
+    Mnemonic mnemonic;
+    uint8_t flags; // InsnFlags bits
+    Operand op[2];
+    int16_t disp;  // ModRM displacement or Direct address
+    uint16_t imm;  // immediate, branch displacement or far offset
+    uint16_t seg;  // far pointer segment
+};
+
+// The longest instruction: opcode, ModRM, disp16 and imm16 after its prefixes.
+constexpr size_t MaxInsnLength = MaxPrefixes + 6;
+static_assert(MaxInsnLength <= UINT8_MAX, "DecodedInsn::length too narrow");
+
+// How an opcode table row encodes each of its operands.
+enum class OperandSpec : uint8_t
+{
+    None,
+    Eb,  // ModRM r/m, byte
+    Ew,  // ModRM r/m, word
+    Gb,  // ModRM reg, byte register
+    Gw,  // ModRM reg, word register
+    Sw,  // ModRM reg, segment register
+    Zb,  // byte register in the low three opcode bits
+    Zw,  // word register in the low three opcode bits
+    Ib,  // immediate byte
+    Iw,  // immediate word
+    Ibs, // immediate byte sign-extended to a word
+    Jb,  // 8-bit relative branch
+    Jw,  // 16-bit relative branch
+    Ap,  // far pointer, offset then segment
+    Ob,  // direct byte address
+    Ow,  // direct word address
+    One, // the constant 1 (shift count)
+    Three, // the constant 3 (INT 3)
+    Base,  // AAM/AAD base byte: consumed, not printed
+    AL,
+    CL,
+    AX,
+    DX,
+    ES,
+    CS,
+    SS,
+    DS,
+    Inherit // group rows: take the operand from the opcode row
+};
+
+enum OpcodeFlags : uint8_t
+{
+    SpecModRm = 1 << 0,   // a ModRM byte follows the opcode
+    SpecPrefix = 1 << 1,  // prefix byte; OpcodeSpec::group holds its Prefix bit
+    SpecKeyword = 1 << 2, // print a byte/word keyword chosen by opcode bit 0
+    SpecGroup = 1 << 3    // ModRM reg selects the row in groupTable[group]
+};
+
+struct OpcodeSpec
+{
+    Mnemonic mnemonic;
+    uint8_t flags;
+    OperandSpec op[2];
+    uint8_t group;
+};
+
+// A declarative row covering the first bytes first..last.
+struct OpcodeRow
+{
+    uint8_t first;
+    uint8_t last;
+    OpcodeSpec spec;
+};
+
+enum OpcodeGroup : uint8_t
+{
+    GroupNone,
+    Group1,    // 80, 81, 83: immediate arithmetic
+    Group1Alt, // 82: immediate arithmetic, logic ops not encodable
+    Group2,    // D0-D3: shifts and rotates
+    Group3,    // F6, F7: TEST/NOT/NEG/MUL/IMUL/DIV/IDIV
+    Group4,    // FE: INC/DEC byte
+    Group5,    // FF: INC/DEC/CALL/JMP/PUSH word
+    GroupPop,  // 8F: POP r/m
+    GroupMov,  // C6, C7: MOV r/m, imm
+    GroupCount
+};
+
+#define ROW(first, last, mn, flags, a, b, group) \
+    {first, last, {Mnemonic::mn, flags, {OperandSpec::a, OperandSpec::b}, group}}
+#define OP(byte, mn, a, b) ROW(byte, byte, mn, 0, a, b, GroupNone)
+#define OPM(byte, mn, a, b) ROW(byte, byte, mn, SpecModRm, a, b, GroupNone)
+#define GRP(byte, group, a, b) ROW(byte, byte, Invalid, SpecModRm | SpecGroup, a, b, group)
+#define PFX(byte, prefix) ROW(byte, byte, Invalid, SpecPrefix, None, None, prefix)
+
+// Every first byte the decoder understands. Bytes not listed here decode
+// as Mnemonic::Invalid.
+constexpr OpcodeRow opcodeRows[] = {
+    OPM(0x00, Add, Eb, Gb), OPM(0x01, Add, Ew, Gw), OPM(0x02, Add, Gb, Eb), OPM(0x03, Add, Gw, Ew),
+    OP(0x04, Add, AL, Ib), OP(0x05, Add, AX, Iw), OP(0x06, Push, ES, None), OP(0x07, Pop, ES, None),
+    OPM(0x08, Or, Eb, Gb), OPM(0x09, Or, Ew, Gw), OPM(0x0A, Or, Gb, Eb), OPM(0x0B, Or, Gw, Ew),
+    OP(0x0C, Or, AL, Ib), OP(0x0D, Or, AX, Iw), OP(0x0E, Push, CS, None),
+    OPM(0x10, Adc, Eb, Gb), OPM(0x11, Adc, Ew, Gw), OPM(0x12, Adc, Gb, Eb), OPM(0x13, Adc, Gw, Ew),
+    OP(0x14, Adc, AL, Ib), OP(0x15, Adc, AX, Iw), OP(0x16, Push, SS, None), OP(0x17, Pop, SS, None),
+    OPM(0x18, Sbb, Eb, Gb), OPM(0x19, Sbb, Ew, Gw), OPM(0x1A, Sbb, Gb, Eb), OPM(0x1B, Sbb, Gw, Ew),
+    OP(0x1C, Sbb, AL, Ib), OP(0x1D, Sbb, AX, Iw), OP(0x1E, Push, DS, None), OP(0x1F, Pop, DS, None),
+    OPM(0x20, And, Eb, Gb), OPM(0x21, And, Ew, Gw), OPM(0x22, And, Gb, Eb), OPM(0x23, And, Gw, Ew),
+    OP(0x24, And, AL, Ib), OP(0x25, And, AX, Iw), PFX(0x26, PrefixES), OP(0x27, Daa, None, None),
+    OPM(0x28, Sub, Eb, Gb), OPM(0x29, Sub, Ew, Gw), OPM(0x2A, Sub, Gb, Eb), OPM(0x2B, Sub, Gw, Ew),
+    OP(0x2C, Sub, AL, Ib), OP(0x2D, Sub, AX, Iw), PFX(0x2E, PrefixCS), OP(0x2F, Das, None, None),
+    OPM(0x30, Xor, Eb, Gb), OPM(0x31, Xor, Ew, Gw), OPM(0x32, Xor, Gb, Eb), OPM(0x33, Xor, Gw, Ew),
+    OP(0x34, Xor, AL, Ib), OP(0x35, Xor, AX, Iw), PFX(0x36, PrefixSS), OP(0x37, Aaa, None, None),
+    OPM(0x38, Cmp, Eb, Gb), OPM(0x39, Cmp, Ew, Gw), OPM(0x3A, Cmp, Gb, Eb), OPM(0x3B, Cmp, Gw, Ew),
+    OP(0x3C, Cmp, AL, Ib), OP(0x3D, Cmp, AX, Iw), PFX(0x3E, PrefixDS), OP(0x3F, Aas, None, None),
+    ROW(0x40, 0x47, Inc, 0, Zw, None, GroupNone),
+    ROW(0x48, 0x4F, Dec, 0, Zw, None, GroupNone),
+    ROW(0x50, 0x57, Push, 0, Zw, None, GroupNone),
+    ROW(0x58, 0x5F, Pop, 0, Zw, None, GroupNone),
+    OP(0x70, Jo, Jb, None), OP(0x71, Jno, Jb, None), OP(0x72, Jb, Jb, None), OP(0x73, Jnb, Jb, None),
+    OP(0x74, Je, Jb, None), OP(0x75, Jne, Jb, None), OP(0x76, Jbe, Jb, None), OP(0x77, Jnbe, Jb, None),
+    OP(0x78, Js, Jb, None), OP(0x79, Jns, Jb, None), OP(0x7A, Jp, Jb, None), OP(0x7B, Jnp, Jb, None),
+    OP(0x7C, Jl, Jb, None), OP(0x7D, Jnl, Jb, None), OP(0x7E, Jle, Jb, None), OP(0x7F, Jnle, Jb, None),
+    GRP(0x80, Group1, Eb, Ib), GRP(0x81, Group1, Ew, Iw), GRP(0x82, Group1Alt, Eb, Ib), GRP(0x83, Group1, Ew, Ibs),
+    OPM(0x84, Test, Eb, Gb), OPM(0x85, Test, Ew, Gw), OPM(0x86, Xchg, Eb, Gb), OPM(0x87, Xchg, Ew, Gw),
+    OPM(0x88, Mov, Eb, Gb), OPM(0x89, Mov, Ew, Gw), OPM(0x8A, Mov, Gb, Eb), OPM(0x8B, Mov, Gw, Ew),
+    OPM(0x8C, Mov, Ew, Sw), OPM(0x8D, Lea, Gw, Ew), OPM(0x8E, Mov, Sw, Ew), GRP(0x8F, GroupPop, Ew, None),
+    OP(0x90, Nop, None, None),
+    ROW(0x91, 0x97, Xchg, 0, AX, Zw, GroupNone),
+    OP(0x98, Cbw, None, None), OP(0x99, Cwd, None, None), OP(0x9A, CallFar, Ap, None), OP(0x9B, Wait, None, None),
+    OP(0x9C, Pushf, None, None), OP(0x9D, Popf, None, None), OP(0x9E, Sahf, None, None), OP(0x9F, Lahf, None, None),
+    OP(0xA0, Mov, AL, Ob), OP(0xA1, Mov, AX, Ow), OP(0xA2, Mov, Ob, AL), OP(0xA3, Mov, Ow, AX),
+    ROW(0xA4, 0xA5, Movs, SpecKeyword, None, None, GroupNone),
+    ROW(0xA6, 0xA7, Cmps, SpecKeyword, None, None, GroupNone),
+    OP(0xA8, Test, AL, Ib), OP(0xA9, Test, AX, Iw),
+    ROW(0xAA, 0xAB, Stos, SpecKeyword, None, None, GroupNone),
+    ROW(0xAC, 0xAD, Lods, SpecKeyword, None, None, GroupNone),
+    ROW(0xAE, 0xAF, Scas, SpecKeyword, None, None, GroupNone),
+    ROW(0xB0, 0xB7, Mov, 0, Zb, Ib, GroupNone),
+    ROW(0xB8, 0xBF, Mov, 0, Zw, Iw, GroupNone),
+    OP(0xC2, Ret, Iw, None), OP(0xC3, Ret, None, None),
+    OPM(0xC4, Les, Gw, Ew), OPM(0xC5, Lds, Gw, Ew), GRP(0xC6, GroupMov, Eb, Ib), GRP(0xC7, GroupMov, Ew, Iw),
+    OP(0xCA, Retf, Iw, None), OP(0xCB, Retf, None, None),
+    OP(0xCC, Int, Three, None), OP(0xCD, Int, Ib, None), OP(0xCE, Into, None, None), OP(0xCF, Iret, None, None),
+    GRP(0xD0, Group2, Eb, One), GRP(0xD1, Group2, Ew, One), GRP(0xD2, Group2, Eb, CL), GRP(0xD3, Group2, Ew, CL),
+    OP(0xD4, Aam, Base, None), OP(0xD5, Aad, Base, None), OP(0xD7, Xlat, None, None),
+    OP(0xE0, Loopne, Jb, None), OP(0xE1, Loope, Jb, None), OP(0xE2, Loop, Jb, None), OP(0xE3, Jcxz, Jb, None),
+    OP(0xE4, In, AL, Ib), OP(0xE5, In, AX, Ib), OP(0xE6, Out, Ib, AL), OP(0xE7, Out, Ib, AX),
+    OP(0xE8, Call, Jw, None), OP(0xE9, Jmp, Jw, None), OP(0xEA, JmpFar, Ap, None), OP(0xEB, Jmp, Jb, None),
+    OP(0xEC, In, AL, DX), OP(0xED, In, AX, DX), OP(0xEE, Out, DX, AL), OP(0xEF, Out, DX, AX),
+    PFX(0xF0, PrefixLock), PFX(0xF2, PrefixRepne), PFX(0xF3, PrefixRep),
+    OP(0xF4, Hlt, None, None), OP(0xF5, Cmc, None, None), GRP(0xF6, Group3, Eb, Ib), GRP(0xF7, Group3, Ew, Iw),
+    OP(0xF8, Clc, None, None), OP(0xF9, Stc, None, None), OP(0xFA, Cli, None, None), OP(0xFB, Sti, None, None),
+    OP(0xFC, Cld, None, None), OP(0xFD, Std, None, None), GRP(0xFE, Group4, Eb, None), GRP(0xFF, Group5, Ew, None),
+};
+
+#define GROW(mn, flags, a, b) {Mnemonic::mn, flags, {OperandSpec::a, OperandSpec::b}, GroupNone}
+#define GINH(mn) GROW(mn, 0, Inherit, Inherit)
+#define GBAD GROW(Invalid, 0, None, None)
+
+// ModRM reg extensions, indexed by OpcodeGroup and then the reg field.
+constexpr OpcodeSpec groupTable[GroupCount][8] = {
+    {GBAD, GBAD, GBAD, GBAD, GBAD, GBAD, GBAD, GBAD},
+    {GINH(Add), GINH(Or), GINH(Adc), GINH(Sbb), GINH(And), GINH(Sub), GINH(Xor), GINH(Cmp)},
+    {GINH(Add), GBAD, GINH(Adc), GINH(Sbb), GBAD, GINH(Sub), GBAD, GINH(Cmp)},
+    {GINH(Rol), GINH(Ror), GINH(Rcl), GINH(Rcr), GINH(Shl), GINH(Shr), GBAD, GINH(Sar)},
+    {GINH(Test), GBAD, GROW(Not, SpecKeyword, Inherit, None), GROW(Neg, SpecKeyword, Inherit, None),
+     GROW(Mul, SpecKeyword, Inherit, None), GROW(Imul, SpecKeyword, Inherit, None),
+     GROW(Div, SpecKeyword, Inherit, None), GROW(Idiv, SpecKeyword, Inherit, None)},
+    {GINH(Inc), GINH(Dec), GBAD, GBAD, GBAD, GBAD, GBAD, GBAD},
+    {GINH(Inc), GINH(Dec), GINH(Call), GINH(CallFar), GINH(Jmp), GINH(JmpFar), GINH(Push), GBAD},
+    {GINH(Pop), GBAD, GBAD, GBAD, GBAD, GBAD, GBAD, GBAD},
+    {GINH(Mov), GBAD, GBAD, GBAD, GBAD, GBAD, GBAD, GBAD},
+};
+
+#undef GBAD
+#undef GINH
+#undef GROW
+#undef PFX
+#undef GRP
+#undef OPM
+#undef OP
+#undef ROW
+
+struct OpcodeTable
+{
+    OpcodeSpec spec[256];
+};
+
+// Expands opcodeRows into one entry per first byte at compile time.
+constexpr OpcodeTable BuildOpcodeTable()
+{
+    OpcodeTable t{};
+    for (const OpcodeRow &row : opcodeRows)
+    {
+        for (int b = row.first; b <= row.last; b++)
+        {
+            t.spec[b] = row.spec;
+        }
+    }
+    return t;
+}
+
+constexpr OpcodeTable opcodeTable = BuildOpcodeTable();
+
+static_assert(opcodeTable.spec[0x0F].mnemonic == Mnemonic::Invalid, "POP CS is not an 8086 instruction");
+static_assert(opcodeTable.spec[0xB3].op[0] == OperandSpec::Zb, "MOV BL, imm8 expands from its row");
+
+enum class DecodeStatus : uint8_t
+{
+    Ok,
+    Invalid,  // the bytes are not an 8086 instruction
+    Truncated // the buffer ends before the instruction does
+};
+
+// Bounds-checked reads over an instruction byte stream. Reading past the
+// end sets eof and yields zeros so a decode can finish and then report
+// truncation.
+struct ByteCursor
+{
+    const uint8_t *p;
+    size_t n;
+    size_t pos;
+    bool eof;
+
+public:
+    ByteCursor(const uint8_t *p, size_t n) : p(p), n(n), pos(0), eof(false) {}
+
+    uint8_t ReadByte()
+    {
+        if (pos >= n)
+        {
+            eof = true;
+            return 0;
+        }
+        return p[pos++];
+    }
+
+    int8_t ReadSignedByte()
+    {
+        return static_cast<int8_t>(ReadByte());
+    }
+
+    uint16_t ReadWord()
+    {
+        uint8_t lo = ReadByte();
+        return lo | (ReadByte() << 8);
+    }
+};
+
+// Reads the ModRM byte and whatever displacement its mod/rm call for.
+inline void readModRm(ByteCursor &in, DecodedInsn *insn)
+{
+    insn->modrm = in.ReadByte();
+    const Byte2 *b2 = reinterpret_cast<const Byte2 *>(&insn->modrm);
+    if (b2->mod == Mod::Displacement0 && b2->rm == 6)
+    {
+        insn->disp = (int16_t)in.ReadWord();
+    }
+    else if (b2->mod == Mod::Displacement8)
+    {
+        insn->disp = in.ReadSignedByte();
+    }
+    else if (b2->mod == Mod::Displacement16)
+    {
+        insn->disp = (int16_t)in.ReadWord();
+    }
+}
+
+// Turns one operand spec into an Operand, reading any bytes it owns.
+// Returns false for encodings the 8086 does not define.
+inline bool readOperand(ByteCursor &in, DecodedInsn *insn, OperandSpec spec, Operand *op)
+{
+    uint8_t modReg = (insn->modrm >> 3) & 0b111;
+    switch (spec)
+    {
+    case OperandSpec::None:
+    case OperandSpec::Inherit:
+        *op = Operand{OperandKind::None, 0, 0};
+        break;
+    case OperandSpec::Eb:
+    case OperandSpec::Ew:
+        *op = Operand{OperandKind::ModRm, uint8_t(spec == OperandSpec::Ew ? 2 : 1), uint8_t(insn->modrm & 0b111)};
+        break;
+    case OperandSpec::Gb:
+    case OperandSpec::Gw:
+        *op = Operand{OperandKind::ModReg, uint8_t(spec == OperandSpec::Gw ? 2 : 1), modReg};
+        break;
+    case OperandSpec::Sw:
+        if (modReg & 0b100)
+        {
+            return false;
+        }
+        *op = Operand{OperandKind::Seg, 2, modReg};
+        break;
+    case OperandSpec::Zb:
+    case OperandSpec::Zw:
+        *op = Operand{OperandKind::Reg, uint8_t(spec == OperandSpec::Zw ? 2 : 1), uint8_t(insn->opcode & 0b111)};
+        break;
+    case OperandSpec::Ib:
+        insn->imm = in.ReadByte();
+        *op = Operand{OperandKind::Imm, 1, 0};
+        break;
+    case OperandSpec::Ibs:
+        insn->imm = in.ReadSignedByte();
+        *op = Operand{OperandKind::Imm, 1, 0};
+        break;
+    case OperandSpec::Iw:
+        insn->imm = in.ReadWord();
+        *op = Operand{OperandKind::Imm, 2, 0};
+        break;
+    case OperandSpec::Jb:
+        insn->imm = in.ReadSignedByte();
+        *op = Operand{OperandKind::Rel, 1, 0};
+        break;
+    case OperandSpec::Jw:
+        insn->imm = in.ReadWord();
+        *op = Operand{OperandKind::Rel, 2, 0};
+        break;
+    case OperandSpec::Ap:
+        insn->imm = in.ReadWord();
+        insn->seg = in.ReadWord();
+        *op = Operand{OperandKind::Far, 4, 0};
+        break;
+    case OperandSpec::Ob:
+    case OperandSpec::Ow:
+        insn->disp = (int16_t)in.ReadWord();
+        *op = Operand{OperandKind::Direct, uint8_t(spec == OperandSpec::Ow ? 2 : 1), 0};
+        break;
+    case OperandSpec::One:
+    case OperandSpec::Three:
+        insn->imm = spec == OperandSpec::One ? 1 : 3;
+        *op = Operand{OperandKind::Imm, 1, 0};
+        break;
+    case OperandSpec::Base:
+        insn->imm = in.ReadByte();
+        *op = Operand{OperandKind::None, 0, 0};
+        break;
+    case OperandSpec::AL:
+    case OperandSpec::CL:
+        *op = Operand{OperandKind::Reg, 1, uint8_t(spec == OperandSpec::CL ? 1 : 0)};
+        break;
+    case OperandSpec::AX:
+    case OperandSpec::DX:
+        *op = Operand{OperandKind::Reg, 2, uint8_t(spec == OperandSpec::DX ? 2 : 0)};
+        break;
+    case OperandSpec::ES:
+    case OperandSpec::CS:
+    case OperandSpec::SS:
+    case OperandSpec::DS:
+        *op = Operand{OperandKind::Seg, 2, uint8_t((int)spec - (int)OperandSpec::ES)};
+        break;
+    }
+    return true;
+}
+
+// Decodes the instruction at p[0..n). insn->offset is left at zero for the
+// caller to fill in; insn->length covers any prefixes.
+inline DecodeStatus decodeInsn(const uint8_t *p, size_t n, DecodedInsn *insn)
+{
+    DISASM_PROFILE_SCOPE(ProfileDecode);
+    memset(insn, 0, sizeof(*insn));
+    ByteCursor in(p, n);
+
+    uint8_t byte = in.ReadByte();
+    const OpcodeSpec *spec = &opcodeTable.spec[byte];
+    uint8_t kinds = 0;
+    while (spec->flags & SpecPrefix)
+    {
+        if (kinds & prefixKind(spec->group))
+        {
+            insn->mnemonic = Mnemonic::Prefix;
+            insn->length = in.pos - 1;
+            return DecodeStatus::Ok;
+        }
+        kinds |= prefixKind(spec->group);
+        insn->prefixes |= spec->group;
+        insn->prefixOrder |= prefixSlot(spec->group) << 2 * (in.pos - 1);
+        byte = in.ReadByte();
+        spec = &opcodeTable.spec[byte];
+    }
+    insn->opcode = byte;
+
+    if (spec->flags & SpecModRm)
+    {
+        readModRm(in, insn);
+    }
+
+    const OpcodeSpec *row = spec;
+    if (spec->flags & SpecGroup)
+    {
+        row = &groupTable[spec->group][(insn->modrm >> 3) & 0b111];
+    }
+    insn->mnemonic = row->mnemonic;
+    if (row->flags & SpecKeyword)
+    {
+        insn->flags = (byte & 1) ? FlagWord : FlagByte;
+    }
+
+    bool valid = insn->mnemonic != Mnemonic::Invalid;
+    for (int i = 0; i < 2 && valid; i++)
+    {
+        OperandSpec s = row->op[i] == OperandSpec::Inherit ? spec->op[i] : row->op[i];
+        valid = readOperand(in, insn, s, &insn->op[i]);
+    }
+    insn->length = in.pos;
+    if (in.eof)
+    {
+        return DecodeStatus::Truncated;
+    }
+    return valid ? DecodeStatus::Ok : DecodeStatus::Invalid;
+}
+
+enum LengthFlags : uint8_t
+{
+    LenPrefix = 1 << 0, // prefix byte, the instruction continues after it
+    LenModRm = 1 << 1   // a ModRM byte (and maybe a displacement) follows
+};
+
+// Byte counts the length decoder needs, derived from opcodeTable and
+// groupTable so both decoders always agree.
+struct LengthTable
+{
+    uint8_t flags[256];
+    uint8_t immBytes[256][8];  // bytes after opcode/ModRM/disp, per ModRM reg; Invalid if undefined
+    uint8_t dispBytes[256];    // displacement bytes implied by each ModRM byte
+    static constexpr uint8_t Invalid = 0xFF;
+};
+
+constexpr uint8_t OperandSpecBytes(OperandSpec s)
+{
+    switch (s)
+    {
+    case OperandSpec::Ib:
+    case OperandSpec::Ibs:
+    case OperandSpec::Jb:
+    case OperandSpec::Base:
+        return 1;
+    case OperandSpec::Iw:
+    case OperandSpec::Jw:
+    case OperandSpec::Ob:
+    case OperandSpec::Ow:
+        return 2;
+    case OperandSpec::Ap:
+        return 4;
+    default:
+        return 0;
+    }
+}
+
+constexpr LengthTable BuildLengthTable()
+{
+    LengthTable t{};
+    for (int b = 0; b < 256; b++)
+    {
+        const OpcodeSpec &spec = opcodeTable.spec[b];
+        t.flags[b] = (spec.flags & SpecPrefix ? LenPrefix : 0) | (spec.flags & SpecModRm ? LenModRm : 0);
+        for (int reg = 0; reg < 8; reg++)
+        {
+            const OpcodeSpec &row = spec.flags & SpecGroup ? groupTable[spec.group][reg] : spec;
+            uint8_t bytes = 0;
+            bool valid = row.mnemonic != Mnemonic::Invalid || (spec.flags & SpecPrefix);
+            for (int i = 0; i < 2; i++)
+            {
+                OperandSpec s = row.op[i] == OperandSpec::Inherit ? spec.op[i] : row.op[i];
+                bytes += OperandSpecBytes(s);
+                if (s == OperandSpec::Sw && (reg & 0b100))
+                {
+                    valid = false;
+                }
+            }
+            t.immBytes[b][reg] = valid ? bytes : LengthTable::Invalid;
+        }
+
+        uint8_t mod = b >> 6, rm = b & 0b111;
+        t.dispBytes[b] = mod == Mod::Displacement8 ? 1 : mod == Mod::Displacement16 || (mod == Mod::Displacement0 && rm == 6) ? 2 : 0;
+    }
+    return t;
+}
+
+constexpr LengthTable lengthTable = BuildLengthTable();
+
+// Returns the length of the instruction at p[0..n) without decoding its
+// operands, or 0 if it is invalid or runs past n. When status is given it
+// receives the same verdict decodeInsn would return.
+inline size_t insnLength(const uint8_t *p, size_t n, DecodeStatus *status = nullptr)
+{
+    DISASM_PROFILE_SCOPE(ProfileDecode);
+    DecodeStatus st = DecodeStatus::Truncated;
+    size_t i = 0;
+    uint8_t kinds = 0;
+    while (i < n && (lengthTable.flags[p[i]] & LenPrefix))
+    {
+        uint8_t kind = prefixKind(opcodeTable.spec[p[i]].group);
+        if (kinds & kind)
+        {
+            // A Mnemonic::Prefix record, as decodeInsn makes.
+            if (status)
+            {
+                *status = DecodeStatus::Ok;
+            }
+            return i;
+        }
+        kinds |= kind;
+        i++;
+    }
+    if (i < n)
+    {
+        uint8_t op = p[i++];
+        uint8_t reg = 0;
+        if (lengthTable.flags[op] & LenModRm)
+        {
+            // One past n means the ModRM byte itself is missing.
+            uint8_t modrm = i < n ? p[i] : 0;
+            reg = (modrm >> 3) & 0b111;
+            i += i < n ? 1 + lengthTable.dispBytes[modrm] : 1;
+        }
+        uint8_t imm = lengthTable.immBytes[op][reg];
+        if (i > n)
+        {
+            st = DecodeStatus::Truncated;
+        }
+        else if (imm == LengthTable::Invalid)
+        {
+            st = DecodeStatus::Invalid;
+        }
+        else if (i + imm <= n)
+        {
+            i += imm;
+            st = DecodeStatus::Ok;
+        }
+    }
+    if (status)
+    {
+        *status = st;
+    }
+    return st == DecodeStatus::Ok ? i : 0;
+}
+
+// Image offsets that branches land on, so a listing can label them. Open
+// addressing with linear probing over one flat array: no allocation per
+// entry, and a lookup that misses (the common case, asked once for every
+// instruction) usually stops at the first slot. Only offset >> GroupBits is
+// hashed and the low bits pick a slot within the group, so the lookups of
+// a sweep, which come in offset order, walk the same few cache lines.
+struct TargetSet
+{
+    static constexpr uint32_t EmptySlot = 0xFFFFFFFF;
+    static constexpr unsigned GroupBits = 3;
+
+    std::vector<uint32_t> slots; // power-of-two size, at most half full
+    size_t count;
+    unsigned shift; // 32 - log2(number of groups)
+
+public:
+    TargetSet() : slots(16, EmptySlot), count(0), shift(32 - (4 - GroupBits)) {}
+
+    size_t Size() const { return count; }
+
+    // Sizes the table for n keys. Copying one set into another in slot order
+    // needs this: into a smaller table, the keys arrive sorted by the new
+    // slot they want and pile up in a single cluster.
+    void Reserve(size_t n)
+    {
+        while (n * 2 > slots.size())
+        {
+            Grow();
+        }
+    }
+
+    void Insert(uint32_t key)
+    {
+        if ((count + 1) * 2 > slots.size())
+        {
+            Grow();
+        }
+        size_t mask = slots.size() - 1;
+        for (size_t i = Slot(key);; i = (i + 1) & mask)
+        {
+            if (slots[i] == key)
+            {
+                return;
+            }
+            if (slots[i] == EmptySlot)
+            {
+                slots[i] = key;
+                count++;
+                return;
+            }
+        }
+    }
+
+    bool Contains(uint32_t key) const
+    {
+        size_t mask = slots.size() - 1;
+        for (size_t i = Slot(key); slots[i] != EmptySlot; i = (i + 1) & mask)
+        {
+            if (slots[i] == key)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    // Fibonacci hashing: branch targets cluster, the top bits of the
+    // product spread the groups over the table.
+    size_t Slot(uint32_t key) const
+    {
+        size_t group = (uint32_t)((key >> GroupBits) * 0x9E3779B9u) >> shift;
+        return group << GroupBits | (key & ((1u << GroupBits) - 1));
+    }
+
+    void Grow()
+    {
+        std::vector<uint32_t> old(slots.size() * 2, EmptySlot);
+        old.swap(slots);
+        shift--;
+        count = 0;
+        for (uint32_t key : old)
+        {
+            if (key != EmptySlot)
+            {
+                Insert(key);
+            }
+        }
+    }
+};
+
+// Output syntaxes. Each is a policy of static functions that BasicFormatter
+// is instantiated with, so choosing a syntax costs nothing per operand.
+
+enum class Syntax : uint8_t
+{
+    Intel, // the original listing format, kept byte for byte
+    Nasm,  // assembles with nasm back to the same instructions
+    Att    // GNU as AT&T syntax
+};
+
+inline char *appendText(char *out, const char *s)
+{
+    while (*s)
+    {
+        *out++ = *s++;
+    }
+    return out;
+}
+
+// "00".."99", so decimal numbers are written two digits at a time.
+struct DigitPairs
+{
+    char text[200];
+};
+
+constexpr DigitPairs BuildDigitPairs()
+{
+    DigitPairs t{};
+    for (int i = 0; i < 100; i++)
+    {
+        t.text[2 * i] = '0' + i / 10;
+        t.text[2 * i + 1] = '0' + i % 10;
+    }
+    return t;
+}
+
+constexpr DigitPairs digitPairs = BuildDigitPairs();
+
+// Number writers for the formatter's hot path, in place of sprintf: they
+// write straight into out and return the end, without a terminating NUL.
+
+// "%u"
+inline char *appendUnsigned(char *out, uint32_t v)
+{
+    int digits = 1;
+    for (uint32_t x = v; x >= 10; x /= 10)
+    {
+        digits++;
+    }
+    char *end = out + digits;
+    char *p = end;
+    while (v >= 100)
+    {
+        p -= 2;
+        memcpy(p, digitPairs.text + 2 * (v % 100), 2);
+        v /= 100;
+    }
+    if (v >= 10)
+    {
+        memcpy(p - 2, digitPairs.text + 2 * v, 2);
+    }
+    else
+    {
+        p[-1] = '0' + v;
+    }
+    return end;
+}
+
+// "%d"
+inline char *appendDecimal(char *out, int32_t v)
+{
+    if (v < 0)
+    {
+        *out++ = '-';
+        return appendUnsigned(out, 0u - (uint32_t)v);
+    }
+    return appendUnsigned(out, v);
+}
+
+// "%+d"
+inline char *appendSignedDecimal(char *out, int32_t v)
+{
+    if (v >= 0)
+    {
+        *out++ = '+';
+    }
+    return appendDecimal(out, v);
+}
+
+// "%X"
+inline char *appendHex(char *out, uint32_t v)
+{
+    int digits = v ? (35 - __builtin_clz(v)) / 4 : 1;
+    for (int i = digits - 1; i >= 0; i--)
+    {
+        *out++ = "0123456789ABCDEF"[(v >> (i * 4)) & 0xF];
+    }
+    return out;
+}
+
+// Name of the label at an image offset, "label_%04X" in every syntax.
+// Written by hand: a labelled listing prints one for most branches.
+inline char *appendLabel(char *out, uint32_t target)
+{
+    out = appendText(out, "label_");
+    int digits = 4;
+    while (digits < 8 && target >> (digits * 4))
+    {
+        digits++;
+    }
+    for (int i = digits - 1; i >= 0; i--)
+    {
+        *out++ = "0123456789ABCDEF"[(target >> (i * 4)) & 0xF];
+    }
+    return out;
+}
+
+// Correct lower-case spellings, for the syntaxes that get assembled.
+constexpr const char *asmMnemonicNames[] = {
+    "(bad)", "add", "or", "adc", "sbb", "and", "sub", "xor", "cmp",
+    "daa", "das", "aaa", "aas", "inc", "dec", "push", "pop",
+    "jo", "jno", "jb", "jnb", "je", "jne", "jbe", "jnbe",
+    "js", "jns", "jp", "jnp", "jl", "jnl", "jle", "jnle",
+    "test", "xchg", "mov", "lea", "nop", "cbw", "cwd", "call", "call",
+    "wait", "pushf", "popf", "sahf", "lahf",
+    "movs", "cmps", "stos", "lods", "scas", "ret", "retf", "les", "lds",
+    "int", "into", "iret", "rol", "ror", "rcl", "rcr", "shl", "shr", "sar",
+    "aam", "aad", "xlatb", "loopne", "loope", "loop", "jcxz", "in", "out",
+    "jmp", "jmp", "hlt", "cmc", "not", "neg", "mul", "imul", "div", "idiv",
+    "clc", "stc", "cli", "sti", "cld", "std", "(prefix)"};
+
+static_assert(sizeof(asmMnemonicNames) / sizeof(asmMnemonicNames[0]) == (size_t)Mnemonic::Count,
+              "asmMnemonicNames out of sync with Mnemonic");
+
+inline bool isMemoryOperand(const DecodedInsn &insn, const Operand &op)
+{
+    return op.kind == OperandKind::Direct || (op.kind == OperandKind::ModRm && (insn.modrm >> 6) != 3);
+}
+
+inline bool isStringInsn(Mnemonic m)
+{
+    return m == Mnemonic::Movs || m == Mnemonic::Cmps || m == Mnemonic::Stos || m == Mnemonic::Lods ||
+           m == Mnemonic::Scas;
+}
+
+// True when nothing but an explicit size tells an assembler whether a
+// memory operand is a byte or a word: no register operand fixes it, or
+// the only register is a shift count.
+inline bool needsSize(const DecodedInsn &insn)
+{
+    bool memory = false;
+    bool sizedByReg = false;
+    for (const Operand &op : insn.op)
+    {
+        if (isMemoryOperand(insn, op))
+        {
+            memory = true;
+        }
+        else if (op.kind == OperandKind::Reg || op.kind == OperandKind::ModReg || op.kind == OperandKind::ModRm ||
+                 op.kind == OperandKind::Seg)
+        {
+            sizedByReg = true;
+        }
+    }
+    bool shift = insn.mnemonic >= Mnemonic::Rol && insn.mnemonic <= Mnemonic::Sar;
+    bool far = insn.mnemonic == Mnemonic::CallFar || insn.mnemonic == Mnemonic::JmpFar;
+    return memory && !far && (!sizedByReg || shift);
+}
+
+// The original output: upper case with the historic spellings
+// ("Bp"/"Di"/"Cx" for ModRM registers, "SCARS", unsigned disp8, raw
+// displacements for branches) and prefixes on lines of their own.
+struct IntelSyntax
+{
+    static constexpr const char *preamble = "";
+    static constexpr const char *lineComment = "; ";
+    static constexpr const char *dataDirective = "db ";
+    static constexpr const char *comment = " ; ";
+    static constexpr bool elideInData = true; // "db 1, 2, ... ; (bad)"
+    static constexpr bool reversed = false;
+
+    // One line per prefix, in the order of the bytes.
+    static char *Prefixes(char *out, const DecodedInsn &insn)
+    {
+        static const char *segPrefixes[] = {"ES:\n", "CS:\n", "SS:\n", "DS:\n"};
+        for (uint8_t order = insn.prefixOrder; order; order >>= 2)
+        {
+            switch (order & 0b11)
+            {
+            case SlotSegment:
+                out = appendText(out, segPrefixes[__builtin_ctz(insn.prefixes & PrefixSegment)]);
+                break;
+            case SlotLock:
+                out = appendText(out, "LOCK\n");
+                break;
+            case SlotRep:
+                out = appendText(out, insn.prefixes & PrefixRepne ? "REPNE\n" : "REP\n");
+                break;
+            }
+        }
+        return out;
+    }
+
+    static char *Name(char *out, const DecodedInsn &insn)
+    {
+        out = appendText(out, mnemonicNames[(size_t)insn.mnemonic]);
+        if (insn.flags & FlagByte)
+        {
+            out = appendText(out, " byte");
+        }
+        else if (insn.flags & FlagWord)
+        {
+            out = appendText(out, " word");
+        }
+        return out;
+    }
+
+    static bool HidesOperands(const DecodedInsn &)
+    {
+        return false;
+    }
+
+    static char *Reg(char *out, uint8_t reg, uint8_t size)
+    {
+        static const char *byteRegs[] = {"AL", "CL", "DL", "BL", "AH", "CH", "DH", "BH"};
+        static const char *wordRegs[] = {"AX", "CX", "DX", "BX", "SP", "BP", "SI", "DI"};
+        return appendText(out, size == 2 ? wordRegs[reg & 0b111] : byteRegs[reg & 0b111]);
+    }
+
+    static char *ModReg(char *out, uint8_t reg, uint8_t size)
+    {
+        return appendText(out, getRegName(reg, size == 2));
+    }
+
+    static char *Seg(char *out, uint8_t reg)
+    {
+        return appendText(out, getSegReg(reg));
+    }
+
+    static char *Memory(char *out, const DecodedInsn &insn, const Operand &)
+    {
+        const ModRmFragment &f = modRmFragments.form[insn.modrm >> 6][insn.modrm & 0b111];
+        memcpy(out, f.head, sizeof(f.head));
+        out += f.length;
+        if (f.disp == FragmentDisp::None)
+        {
+            return out;
+        }
+        out = f.disp == FragmentDisp::Byte ? appendUnsigned(out, (uint8_t)insn.disp) : appendDecimal(out, insn.disp);
+        *out++ = ']';
+        return out;
+    }
+
+    static char *Direct(char *out, const DecodedInsn &insn, const Operand &)
+    {
+        *out++ = '[';
+        out = appendUnsigned(out, (uint16_t)insn.disp);
+        *out++ = ']';
+        return out;
+    }
+
+    static char *Imm(char *out, const DecodedInsn &insn, const Operand &op)
+    {
+        return appendUnsigned(out, op.size == 2 ? insn.imm : (uint8_t)insn.imm);
+    }
+
+    static char *Rel(char *out, const DecodedInsn &insn, const Operand &)
+    {
+        return appendDecimal(out, (int16_t)insn.imm);
+    }
+
+    static char *Label(char *out, const DecodedInsn &, const Operand &, uint32_t target)
+    {
+        return appendLabel(out, target);
+    }
+
+    static char *Far(char *out, const DecodedInsn &insn)
+    {
+        bool call = insn.mnemonic == Mnemonic::CallFar;
+        out = appendDecimal(appendText(out, call ? "disp[" : ""), (int16_t)insn.seg);
+        out = appendText(out, call ? "] seg[" : ":");
+        out = appendDecimal(out, (int16_t)insn.imm);
+        if (call)
+        {
+            *out++ = ']';
+        }
+        return out;
+    }
+};
+
+// Shared by the NASM and AT&T policies.
+struct AsmSyntaxBase
+{
+    static constexpr bool elideInData = false; // the byte list must assemble
+
+    static char *Hex(char *out, uint16_t v)
+    {
+        return v < 10 ? appendUnsigned(out, v) : appendHex(appendText(out, "0x"), v);
+    }
+
+    // Immediates of opcode 83 are sign-extended bytes; printing them
+    // signed keeps the assembler from picking the imm16 form.
+    static char *SignedHex(char *out, const DecodedInsn &insn, const Operand &op)
+    {
+        if (insn.opcode == 0x83 && (int16_t)insn.imm < 0)
+        {
+            *out++ = '-';
+            return Hex(out, -(int16_t)insn.imm);
+        }
+        return Hex(out, op.size == 2 ? insn.imm : (uint8_t)insn.imm);
+    }
+
+    // "es " style prefix words on the instruction line. A segment override
+    // is left to the memory operand when there is one. LOCK, and REP/REPNE
+    // on anything but a string instruction, end with detached instead of a
+    // space, for assemblers that refuse such prefixes on the same statement.
+    static char *PrefixWords(char *out, const DecodedInsn &insn, const char *detached)
+    {
+        const char *rep = isStringInsn(insn.mnemonic) ? " " : detached;
+        if (insn.prefixes & PrefixLock)
+        {
+            out = appendText(appendText(out, "lock"), detached);
+        }
+        if (insn.prefixes & PrefixRepne)
+        {
+            out = appendText(appendText(out, "repne"), rep);
+        }
+        if (insn.prefixes & PrefixRep)
+        {
+            out = appendText(appendText(out, "rep"), rep);
+        }
+        if ((insn.prefixes & PrefixSegment) && !isMemoryOperand(insn, insn.op[0]) && !isMemoryOperand(insn, insn.op[1]))
+        {
+            static const char *segWords[] = {"es", "cs", "ss", "ds"};
+            out = appendText(appendText(out, segWords[__builtin_ctz(insn.prefixes & PrefixSegment)]), rep);
+        }
+        return out;
+    }
+
+    // Offset from the start of this instruction to the branch target.
+    static int relativeTarget(const DecodedInsn &insn)
+    {
+        return insn.length + (int16_t)insn.imm;
+    }
+
+    static bool isInt3(const DecodedInsn &insn)
+    {
+        return insn.opcode == 0xCC;
+    }
+};
+
+struct NasmSyntax : AsmSyntaxBase
+{
+    static constexpr const char *preamble = "bits 16\n";
+    static constexpr const char *lineComment = "; ";
+    static constexpr const char *dataDirective = "db ";
+    static constexpr const char *comment = " ; ";
+    static constexpr bool reversed = false;
+
+    static char *Prefixes(char *out, const DecodedInsn &insn)
+    {
+        return PrefixWords(out, insn, " ");
+    }
+
+    static char *Name(char *out, const DecodedInsn &insn)
+    {
+        if (isInt3(insn))
+        {
+            return appendText(out, "int3");
+        }
+        out = appendText(out, asmMnemonicNames[(size_t)insn.mnemonic]);
+        if (isStringInsn(insn.mnemonic))
+        {
+            *out++ = (insn.opcode & 1) ? 'w' : 'b';
+        }
+        if ((insn.mnemonic == Mnemonic::Aam || insn.mnemonic == Mnemonic::Aad) && (insn.imm & 0xFF) != 10)
+        {
+            *out++ = ' ';
+            out = Hex(out, insn.imm & 0xFF);
+        }
+        return out;
+    }
+
+    static bool HidesOperands(const DecodedInsn &insn)
+    {
+        return isInt3(insn);
+    }
+
+    static char *Reg(char *out, uint8_t reg, uint8_t size)
+    {
+        static const char *byteRegs[] = {"al", "cl", "dl", "bl", "ah", "ch", "dh", "bh"};
+        static const char *wordRegs[] = {"ax", "cx", "dx", "bx", "sp", "bp", "si", "di"};
+        return appendText(out, size == 2 ? wordRegs[reg & 0b111] : byteRegs[reg & 0b111]);
+    }
+
+    static char *ModReg(char *out, uint8_t reg, uint8_t size)
+    {
+        return Reg(out, reg, size);
+    }
+
+    static char *Seg(char *out, uint8_t reg)
+    {
+        static const char *segRegs[] = {"es", "cs", "ss", "ds"};
+        return appendText(out, segRegs[reg & 0b11]);
+    }
+
+    static char *Open(char *out, const DecodedInsn &insn, const Operand &op)
+    {
+        if (insn.mnemonic == Mnemonic::CallFar || insn.mnemonic == Mnemonic::JmpFar)
+        {
+            out = appendText(out, "far ");
+        }
+        else if (needsSize(insn))
+        {
+            out = appendText(out, op.size == 2 ? "word " : "byte ");
+        }
+        *out++ = '[';
+        if (insn.prefixes & PrefixSegment)
+        {
+            out = Seg(out, __builtin_ctz(insn.prefixes & PrefixSegment));
+            *out++ = ':';
+        }
+        return out;
+    }
+
+    static char *Memory(char *out, const DecodedInsn &insn, const Operand &op)
+    {
+        static const char *bases[] = {"bx+si", "bx+di", "bp+si", "bp+di", "si", "di", "bp", "bx"};
+        uint8_t mod = insn.modrm >> 6;
+        uint8_t rm = insn.modrm & 0b111;
+        out = Open(out, insn, op);
+        if (mod == 0 && rm == 6)
+        {
+            out = Hex(out, (uint16_t)insn.disp);
+        }
+        else
+        {
+            out = appendText(out, bases[rm]);
+            if (mod != 0 && insn.disp)
+            {
+                *out++ = insn.disp < 0 ? '-' : '+';
+                out = Hex(out, insn.disp < 0 ? -insn.disp : insn.disp);
+            }
+        }
+        *out++ = ']';
+        return out;
+    }
+
+    static char *Direct(char *out, const DecodedInsn &insn, const Operand &op)
+    {
+        out = Open(out, insn, op);
+        out = Hex(out, (uint16_t)insn.disp);
+        *out++ = ']';
+        return out;
+    }
+
+    static char *Imm(char *out, const DecodedInsn &insn, const Operand &op)
+    {
+        return SignedHex(out, insn, op);
+    }
+
+    // JMP keeps its encoded size (short/near) so the text assembles to the
+    // same bytes.
+    static char *JumpSize(char *out, const DecodedInsn &insn, const Operand &op)
+    {
+        if (insn.mnemonic == Mnemonic::Jmp)
+        {
+            out = appendText(out, op.size == 1 ? "short " : "near ");
+        }
+        return out;
+    }
+
+    // Relative to "$" so the listing assembles without labels or an org.
+    static char *Rel(char *out, const DecodedInsn &insn, const Operand &op)
+    {
+        out = JumpSize(out, insn, op);
+        *out++ = '$';
+        return appendSignedDecimal(out, relativeTarget(insn));
+    }
+
+    static char *Label(char *out, const DecodedInsn &insn, const Operand &op, uint32_t target)
+    {
+        return appendLabel(JumpSize(out, insn, op), target);
+    }
+
+    static char *Far(char *out, const DecodedInsn &insn)
+    {
+        out = Hex(out, insn.seg);
+        *out++ = ':';
+        return Hex(out, insn.imm);
+    }
+};
+
+struct AttSyntax : AsmSyntaxBase
+{
+    static constexpr const char *preamble = ".code16\n";
+    static constexpr const char *lineComment = "# ";
+    static constexpr const char *dataDirective = ".byte ";
+    static constexpr const char *comment = " # ";
+    static constexpr bool reversed = true;
+
+    static char *Prefixes(char *out, const DecodedInsn &insn)
+    {
+        return PrefixWords(out, insn, "; ");
+    }
+
+    static char *Name(char *out, const DecodedInsn &insn)
+    {
+        if (isInt3(insn))
+        {
+            return appendText(out, "int3");
+        }
+        switch (insn.mnemonic)
+        {
+        case Mnemonic::Cbw:
+            return appendText(out, "cbtw");
+        case Mnemonic::Cwd:
+            return appendText(out, "cwtd");
+        case Mnemonic::Retf:
+            return appendText(out, "lret");
+        case Mnemonic::CallFar:
+            return appendText(out, "lcall");
+        case Mnemonic::JmpFar:
+            return appendText(out, "ljmp");
+        case Mnemonic::Xlat:
+            return appendText(out, "xlat");
+        default:
+            break;
+        }
+        out = appendText(out, asmMnemonicNames[(size_t)insn.mnemonic]);
+        if (isStringInsn(insn.mnemonic) || needsSize(insn))
+        {
+            *out++ = ((insn.opcode & 1) && insn.opcode != 0x82 && insn.opcode != 0xC6) ? 'w' : 'b';
+        }
+        if ((insn.mnemonic == Mnemonic::Aam || insn.mnemonic == Mnemonic::Aad) && (insn.imm & 0xFF) != 10)
+        {
+            out = appendText(out, " $");
+            out = Hex(out, insn.imm & 0xFF);
+        }
+        return out;
+    }
+
+    static bool HidesOperands(const DecodedInsn &insn)
+    {
+        return isInt3(insn);
+    }
+
+    static char *Reg(char *out, uint8_t reg, uint8_t size)
+    {
+        static const char *byteRegs[] = {"%al", "%cl", "%dl", "%bl", "%ah", "%ch", "%dh", "%bh"};
+        static const char *wordRegs[] = {"%ax", "%cx", "%dx", "%bx", "%sp", "%bp", "%si", "%di"};
+        return appendText(out, size == 2 ? wordRegs[reg & 0b111] : byteRegs[reg & 0b111]);
+    }
+
+    // Register operands of indirect near and far transfers take a '*'.
+    static bool indirect(const DecodedInsn &insn)
+    {
+        return insn.mnemonic == Mnemonic::Jmp || insn.mnemonic == Mnemonic::Call ||
+               insn.mnemonic == Mnemonic::JmpFar || insn.mnemonic == Mnemonic::CallFar;
+    }
+
+    static char *ModReg(char *out, uint8_t reg, uint8_t size)
+    {
+        return Reg(out, reg, size);
+    }
+
+    static char *Seg(char *out, uint8_t reg)
+    {
+        static const char *segRegs[] = {"%es", "%cs", "%ss", "%ds"};
+        return appendText(out, segRegs[reg & 0b11]);
+    }
+
+    static char *Open(char *out, const DecodedInsn &insn)
+    {
+        if (indirect(insn))
+        {
+            *out++ = '*';
+        }
+        if (insn.prefixes & PrefixSegment)
+        {
+            out = Seg(out, __builtin_ctz(insn.prefixes & PrefixSegment));
+            *out++ = ':';
+        }
+        return out;
+    }
+
+    static char *Memory(char *out, const DecodedInsn &insn, const Operand &)
+    {
+        static const char *bases[] = {"(%bx,%si)", "(%bx,%di)", "(%bp,%si)", "(%bp,%di)",
+                                      "(%si)", "(%di)", "(%bp)", "(%bx)"};
+        uint8_t mod = insn.modrm >> 6;
+        uint8_t rm = insn.modrm & 0b111;
+        out = Open(out, insn);
+        if (mod == 0 && rm == 6)
+        {
+            return Hex(out, (uint16_t)insn.disp);
+        }
+        if (mod != 0 && insn.disp)
+        {
+            if (insn.disp < 0)
+            {
+                *out++ = '-';
+            }
+            out = Hex(out, insn.disp < 0 ? -insn.disp : insn.disp);
+        }
+        return appendText(out, bases[rm]);
+    }
+
+    static char *Direct(char *out, const DecodedInsn &insn, const Operand &)
+    {
+        out = Open(out, insn);
+        return Hex(out, (uint16_t)insn.disp);
+    }
+
+    static char *Imm(char *out, const DecodedInsn &insn, const Operand &op)
+    {
+        *out++ = '$';
+        return SignedHex(out, insn, op);
+    }
+
+    static char *Rel(char *out, const DecodedInsn &insn, const Operand &)
+    {
+        *out++ = '.';
+        return appendSignedDecimal(out, relativeTarget(insn));
+    }
+
+    static char *Label(char *out, const DecodedInsn &, const Operand &, uint32_t target)
+    {
+        return appendLabel(out, target);
+    }
+
+    static char *Far(char *out, const DecodedInsn &insn)
+    {
+        *out++ = '$';
+        out = Hex(out, insn.seg);
+        out = appendText(out, ", $");
+        return Hex(out, insn.imm);
+    }
+};
+
+// Renders a DecodedInsn as one line of text (plus, in the Intel syntax, a
+// line per prefix). One instantiation per syntax policy.
+//
+// With labels set, an instruction that starts at one of them is preceded by
+// a "label_XXXX:" line, and relative branches to one name it instead of
+// printing a displacement. XXXX is the label's address: origin plus its
+// image offset.
+template <typename SyntaxPolicy>
+struct BasicFormatter
+{
+    using Policy = SyntaxPolicy;
+
+    static constexpr size_t MaxLine = 128;
+
+    static constexpr size_t MaxDbBytes = 16;
+
+    static constexpr size_t MaxLabelLine = 24;
+
+    const TargetSet *labels = nullptr;
+
+    // Address of image offset 0, which labels are named by: 100h for a .COM
+    // program.
+    uint32_t origin = 0;
+
+    // Space Format needs: MaxLine, plus the label line if labels are on.
+    size_t Room() const
+    {
+        return MaxLine + (labels ? MaxLabelLine : 0);
+    }
+
+    // Printed once before a listing; makes the text assemble as 16-bit code.
+    static constexpr const char *Preamble()
+    {
+        return Policy::preamble;
+    }
+
+    static char *Append(char *out, const char *s)
+    {
+        return appendText(out, s);
+    }
+
+    char *printOperand(char *out, const DecodedInsn &insn, const Operand &op) const
+    {
+        DISASM_PROFILE_SCOPE(ProfileOperands);
+        switch (op.kind)
+        {
+        case OperandKind::Reg:
+            return Policy::Reg(out, op.reg, op.size);
+        case OperandKind::ModReg:
+            return Policy::ModReg(out, op.reg, op.size);
+        case OperandKind::ModRm:
+            if ((insn.modrm >> 6) == 3)
+            {
+                return Policy::ModReg(out, op.reg, op.size);
+            }
+            return Policy::Memory(out, insn, op);
+        case OperandKind::Seg:
+            return Policy::Seg(out, op.reg);
+        case OperandKind::Direct:
+            return Policy::Direct(out, insn, op);
+        case OperandKind::Imm:
+            return Policy::Imm(out, insn, op);
+        case OperandKind::Rel:
+        {
+            long target = (long)insn.offset + insn.length + (int16_t)insn.imm;
+            if (labels && target >= 0 && target < TargetSet::EmptySlot && labels->Contains(target))
+            {
+                return Policy::Label(out, insn, op, origin + target);
+            }
+            return Policy::Rel(out, insn, op);
+        }
+        case OperandKind::Far:
+            return Policy::Far(out, insn);
+        case OperandKind::None:
+            break;
+        }
+        return out;
+    }
+
+    // Text for a Mnemonic::Invalid record: the skipped bytes as data when
+    // they are available, otherwise just "(bad)".
+    static char *printBad(char *out, const DecodedInsn &insn, const uint8_t *bytes)
+    {
+        if (!bytes)
+        {
+            return Append(out, mnemonicNames[(size_t)Mnemonic::Invalid]);
+        }
+        out = Append(out, Policy::dataDirective);
+        size_t n = insn.length < MaxDbBytes ? insn.length : MaxDbBytes;
+        for (size_t i = 0; i < n; i++)
+        {
+            out = appendUnsigned(Append(out, i ? ", " : ""), bytes[i]);
+        }
+        if (n < insn.length && Policy::elideInData)
+        {
+            out = Append(out, ", ...");
+        }
+        out = Append(out, Policy::comment);
+        out = Append(out, insn.flags & FlagTruncated ? "truncated" : "(bad)");
+        if (n < insn.length && !Policy::elideInData)
+        {
+            out = Append(appendUnsigned(Append(out, ", "), insn.length), " bytes");
+        }
+        return out;
+    }
+
+    // Writes the text for insn into out (at least Room() bytes) and returns
+    // the number of characters written, including the trailing newline.
+    // bytes, if given, points at the instruction's bytes in the image and is
+    // only used to show the data behind Invalid records.
+    size_t Format(const DecodedInsn &insn, char *out, const uint8_t *bytes = nullptr) const
+    {
+        DISASM_PROFILE_SCOPE(ProfileFormat);
+        char *p = out;
+        if (labels && labels->Contains(insn.offset))
+        {
+            p = appendLabel(p, origin + insn.offset);
+            p = Append(p, ":\n");
+        }
+        if (insn.mnemonic == Mnemonic::Invalid)
+        {
+            p = printBad(p, insn, bytes);
+            *p++ = '\n';
+            *p = 0;
+            return p - out;
+        }
+        p = Policy::Prefixes(p, insn);
+        if (insn.mnemonic == Mnemonic::Prefix)
+        {
+            // No instruction follows: drop what would separate it.
+            while (p > out && (p[-1] == '\n' || p[-1] == ' ' || p[-1] == ';'))
+            {
+                p--;
+            }
+            *p++ = '\n';
+            *p = 0;
+            return p - out;
+        }
+        p = Policy::Name(p, insn);
+        if (!Policy::HidesOperands(insn))
+        {
+            const Operand &first = insn.op[Policy::reversed ? 1 : 0];
+            const Operand &second = insn.op[Policy::reversed ? 0 : 1];
+            if (first.kind != OperandKind::None)
+            {
+                *p++ = ' ';
+                p = printOperand(p, insn, first);
+            }
+            if (second.kind != OperandKind::None)
+            {
+                p = Append(p, first.kind != OperandKind::None ? ", " : " ");
+                p = printOperand(p, insn, second);
+            }
+        }
+        *p++ = '\n';
+        *p = 0;
+        return p - out;
+    }
+};
+
+using InsnFormatter = BasicFormatter<IntelSyntax>;
+using NasmFormatter = BasicFormatter<NasmSyntax>;
+using AttFormatter = BasicFormatter<AttSyntax>;
+
+// Library entry points (libdisasm).
+
+// Decodes one instruction from p[0..n) into *out. Returns its length in
+// bytes, or 0 if the bytes are not a valid instruction or end before it
+// does. out->offset is 0; callers decoding a stream add their position.
+size_t decode(const uint8_t *p, size_t n, DecodedInsn *out);
+
+// Writes the text of *insn (NUL-terminated, prefixes on their own lines,
+// trailing newline) into buf. Returns the number of characters written,
+// or 0 if len is smaller than InsnFormatter::MaxLine.
+size_t formatInsn(const DecodedInsn *insn, char *buf, size_t len);
+
+// As above in the given syntax. NASM and AT&T text assumes the preamble
+// ("bits 16" / ".code16") and has prefixes on the instruction line.
+size_t formatInsn(const DecodedInsn *insn, char *buf, size_t len, Syntax syntax);
+
+// Returns the length of the instruction at p[0..n) without decoding its
+// operands, or 0 if the bytes are not a valid instruction or end early.
+size_t decodeLength(const uint8_t *p, size_t n);
+
+#endif
@@ -0,0 +1,998 @@
+// 8086 emulator built on the table decoder. Instructions are decoded once
+// per linear address and kept in a direct-mapped cache, so loops run from
+// already decoded DecodedInsn records; any write to memory that holds a
+// cached instruction drops it. Like disasm.h this does no I/O: text the
+// program prints through DOS/BIOS services collects in Cpu::output.
+#ifndef EMU_H
+#define EMU_H
+
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "disasm.h"
+
+enum CpuFlag : uint16_t
+{
+    CpuCarry = 1 << 0,
+    CpuParity = 1 << 2,
+    CpuAux = 1 << 4,
+    CpuZero = 1 << 6,
+    CpuSign = 1 << 7,
+    CpuTrap = 1 << 8,
+    CpuInterrupt = 1 << 9,
+    CpuDirection = 1 << 10,
+    CpuOverflow = 1 << 11
+};
+
+enum CpuReg : uint8_t
+{
+    RegAX,
+    RegCX,
+    RegDX,
+    RegBX,
+    RegSP,
+    RegBP,
+    RegSI,
+    RegDI
+};
+
+enum CpuSeg : uint8_t
+{
+    SegES,
+    SegCS,
+    SegSS,
+    SegDS
+};
+
+enum class StopReason : uint8_t
+{
+    Running,
+    Halt,        // HLT
+    Exit,        // INT 20h or INT 21h/4Ch
+    StepLimit,   // Run's step budget ran out
+    Invalid,     // bytes at CS:IP do not decode
+    Unsupported, // an interrupt with no handler, or an operand form the CPU cannot take
+    DivideError  // divide error with no handler installed
+};
+
+inline const char *stopReasonName(StopReason r)
+{
+    switch (r)
+    {
+    case StopReason::Running:
+        return "running";
+    case StopReason::Halt:
+        return "halted";
+    case StopReason::Exit:
+        return "exited";
+    case StopReason::StepLimit:
+        return "step limit";
+    case StopReason::Invalid:
+        return "invalid instruction";
+    case StopReason::Unsupported:
+        return "unsupported";
+    case StopReason::DivideError:
+        return "divide error";
+    }
+    return "??";
+}
+
+struct Cpu
+{
+    static constexpr uint32_t MemSize = 1 << 20;
+    static constexpr uint32_t CacheSize = 1 << 16;  // direct-mapped on the low address bits
+    static constexpr uint8_t MaxCachedLength = 8;   // longer (prefix-padded) insns are not cached
+    static constexpr uint32_t PageShift = 8;
+
+    struct CachedInsn
+    {
+        uint32_t addr; // linear address, or NoAddr
+        DecodedInsn insn;
+    };
+    static constexpr uint32_t NoAddr = 0xFFFFFFFF;
+
+    uint16_t regs[8];
+    uint16_t sregs[4];
+    uint16_t ip;
+    uint16_t flags;
+    std::vector<uint8_t> mem;
+    std::vector<CachedInsn> cache;
+    std::vector<uint8_t> codePages; // pages holding bytes of a cached insn
+    StopReason stop;
+    uint8_t exitCode;
+    std::string output;
+
+    uint64_t executed;
+    uint64_t cacheHits;
+    uint64_t cacheMisses;
+    uint64_t invalidations;
+
+public:
+    Cpu() : ip(0), flags(0x0002), mem(MemSize), cache(CacheSize, CachedInsn{NoAddr, {}}),
+            codePages(MemSize >> PageShift), stop(StopReason::Running), exitCode(0),
+            executed(0), cacheHits(0), cacheMisses(0), invalidations(0)
+    {
+        memset(regs, 0, sizeof(regs));
+        memset(sregs, 0, sizeof(sregs));
+    }
+
+    static uint32_t Linear(uint16_t seg, uint16_t off)
+    {
+        return (((uint32_t)seg << 4) + off) & (MemSize - 1);
+    }
+
+    // Copies image into memory at seg:off, bypassing the cache; for loaders.
+    void Load(uint16_t seg, uint16_t off, const uint8_t *image, size_t len)
+    {
+        uint32_t base = Linear(seg, off);
+        for (size_t i = 0; i < len; i++)
+        {
+            mem[(base + i) & (MemSize - 1)] = image[i];
+        }
+        for (CachedInsn &c : cache)
+        {
+            c.addr = NoAddr;
+        }
+    }
+
+    uint8_t Read8(uint16_t seg, uint16_t off) const
+    {
+        return mem[Linear(seg, off)];
+    }
+
+    // Words wrap within the segment, as on the 8086.
+    uint16_t Read16(uint16_t seg, uint16_t off) const
+    {
+        return Read8(seg, off) | (Read8(seg, off + 1) << 8);
+    }
+
+    void Write8(uint16_t seg, uint16_t off, uint8_t v)
+    {
+        uint32_t a = Linear(seg, off);
+        mem[a] = v;
+        if (codePages[a >> PageShift])
+        {
+            Invalidate(a);
+        }
+    }
+
+    void Write16(uint16_t seg, uint16_t off, uint16_t v)
+    {
+        Write8(seg, off, v & 0xFF);
+        Write8(seg, off + 1, v >> 8);
+    }
+
+    void Push(uint16_t v)
+    {
+        regs[RegSP] -= 2;
+        Write16(sregs[SegSS], regs[RegSP], v);
+    }
+
+    uint16_t Pop()
+    {
+        uint16_t v = Read16(sregs[SegSS], regs[RegSP]);
+        regs[RegSP] += 2;
+        return v;
+    }
+
+    // Executes up to maxSteps instructions (0: no limit) or until the
+    // program stops. Returns why it stopped.
+    StopReason Run(uint64_t maxSteps = 0)
+    {
+        stop = StopReason::Running;
+        for (uint64_t n = 0; stop == StopReason::Running; n++)
+        {
+            if (maxSteps && n == maxSteps)
+            {
+                stop = StopReason::StepLimit;
+                break;
+            }
+            Step();
+        }
+        return stop;
+    }
+
+    void Step()
+    {
+        const DecodedInsn *insn = Fetch();
+        if (!insn)
+        {
+            stop = StopReason::Invalid;
+            return;
+        }
+        ip += insn->length;
+        executed++;
+        Execute(*insn);
+    }
+
+private:
+    // The instruction at CS:IP, from the cache when possible.
+    const DecodedInsn *Fetch()
+    {
+        uint32_t a = Linear(sregs[SegCS], ip);
+        CachedInsn &c = cache[a & (CacheSize - 1)];
+        if (c.addr == a)
+        {
+            cacheHits++;
+            return &c.insn;
+        }
+        cacheMisses++;
+        if (decodeInsn(&mem[a], MemSize - a, &c.insn) != DecodeStatus::Ok)
+        {
+            c.addr = NoAddr;
+            return nullptr;
+        }
+        c.insn.offset = a;
+        if (c.insn.length <= MaxCachedLength)
+        {
+            c.addr = a;
+            codePages[a >> PageShift] = 1;
+            codePages[((a + c.insn.length - 1) & (MemSize - 1)) >> PageShift] = 1;
+        }
+        else
+        {
+            c.addr = NoAddr;
+        }
+        return &c.insn;
+    }
+
+    // Drops every cached instruction that covers linear address a. Only
+    // instructions starting at most MaxCachedLength - 1 bytes before a can.
+    void Invalidate(uint32_t a)
+    {
+        for (uint32_t k = 0; k < MaxCachedLength; k++)
+        {
+            uint32_t start = (a - k) & (MemSize - 1);
+            CachedInsn &c = cache[start & (CacheSize - 1)];
+            if (c.addr == start && k < c.insn.length)
+            {
+                c.addr = NoAddr;
+                invalidations++;
+            }
+        }
+    }
+
+    bool Flag(uint16_t f) const { return flags & f; }
+
+    void SetFlag(uint16_t f, bool on)
+    {
+        flags = on ? (flags | f) : (flags & ~f);
+    }
+
+    static uint16_t mask(uint8_t size) { return size == 1 ? 0xFF : 0xFFFF; }
+    static uint16_t signBit(uint8_t size) { return size == 1 ? 0x80 : 0x8000; }
+
+    void SetSzp(uint16_t r, uint8_t size)
+    {
+        r &= mask(size);
+        SetFlag(CpuZero, r == 0);
+        SetFlag(CpuSign, r & signBit(size));
+        SetFlag(CpuParity, !__builtin_parity(r & 0xFF));
+    }
+
+    uint8_t GetReg8(uint8_t r) const
+    {
+        return r < 4 ? regs[r] & 0xFF : regs[r - 4] >> 8;
+    }
+
+    void SetReg8(uint8_t r, uint8_t v)
+    {
+        if (r < 4)
+        {
+            regs[r] = (regs[r] & 0xFF00) | v;
+        }
+        else
+        {
+            regs[r - 4] = (regs[r - 4] & 0x00FF) | (v << 8);
+        }
+    }
+
+    // Segment for a memory operand: the override prefix, else def.
+    static uint8_t segmentOf(const DecodedInsn &insn, uint8_t def)
+    {
+        uint8_t p = insn.prefixes & PrefixSegment;
+        return p ? __builtin_ctz(p) : def;
+    }
+
+    bool IsMemory(const DecodedInsn &insn) const
+    {
+        return (insn.modrm >> 6) != 3;
+    }
+
+    // Offset part of a ModRM memory operand; *seg gets its segment.
+    uint16_t EffectiveAddress(const DecodedInsn &insn, uint8_t *seg) const
+    {
+        uint8_t mod = insn.modrm >> 6;
+        uint8_t rm = insn.modrm & 0b111;
+        uint16_t ea = 0;
+        uint8_t def = SegDS;
+        switch (rm)
+        {
+        case 0: ea = regs[RegBX] + regs[RegSI]; break;
+        case 1: ea = regs[RegBX] + regs[RegDI]; break;
+        case 2: ea = regs[RegBP] + regs[RegSI]; def = SegSS; break;
+        case 3: ea = regs[RegBP] + regs[RegDI]; def = SegSS; break;
+        case 4: ea = regs[RegSI]; break;
+        case 5: ea = regs[RegDI]; break;
+        case 6:
+            if (mod != 0)
+            {
+                ea = regs[RegBP];
+                def = SegSS;
+            }
+            break;
+        case 7: ea = regs[RegBX]; break;
+        }
+        *seg = segmentOf(insn, def);
+        return ea + insn.disp;
+    }
+
+    uint16_t Get(const DecodedInsn &insn, const Operand &op) const
+    {
+        uint8_t seg;
+        switch (op.kind)
+        {
+        case OperandKind::Reg:
+        case OperandKind::ModReg:
+            return op.size == 1 ? GetReg8(op.reg) : regs[op.reg];
+        case OperandKind::ModRm:
+            if (!IsMemory(insn))
+            {
+                return op.size == 1 ? GetReg8(op.reg) : regs[op.reg];
+            }
+            {
+                uint16_t off = EffectiveAddress(insn, &seg);
+                return op.size == 1 ? Read8(sregs[seg], off) : Read16(sregs[seg], off);
+            }
+        case OperandKind::Seg:
+            return sregs[op.reg];
+        case OperandKind::Direct:
+            seg = segmentOf(insn, SegDS);
+            return op.size == 1 ? Read8(sregs[seg], insn.disp) : Read16(sregs[seg], insn.disp);
+        case OperandKind::Imm:
+            return insn.imm;
+        default:
+            return 0;
+        }
+    }
+
+    void Set(const DecodedInsn &insn, const Operand &op, uint16_t v)
+    {
+        uint8_t seg;
+        switch (op.kind)
+        {
+        case OperandKind::Reg:
+        case OperandKind::ModReg:
+            break;
+        case OperandKind::ModRm:
+            if (IsMemory(insn))
+            {
+                uint16_t off = EffectiveAddress(insn, &seg);
+                op.size == 1 ? Write8(sregs[seg], off, v) : Write16(sregs[seg], off, v);
+                return;
+            }
+            break;
+        case OperandKind::Seg:
+            sregs[op.reg] = v;
+            return;
+        case OperandKind::Direct:
+            seg = segmentOf(insn, SegDS);
+            op.size == 1 ? Write8(sregs[seg], insn.disp, v) : Write16(sregs[seg], insn.disp, v);
+            return;
+        default:
+            return;
+        }
+        if (op.size == 1)
+        {
+            SetReg8(op.reg, v);
+        }
+        else
+        {
+            regs[op.reg] = v;
+        }
+    }
+
+    uint16_t Add(uint16_t a, uint16_t b, bool carry, uint8_t size)
+    {
+        uint32_t r = (uint32_t)a + b + carry;
+        SetFlag(CpuCarry, r > mask(size));
+        SetFlag(CpuAux, (a ^ b ^ r) & 0x10);
+        SetFlag(CpuOverflow, (r ^ a) & (r ^ b) & signBit(size));
+        SetSzp(r, size);
+        return r & mask(size);
+    }
+
+    uint16_t Sub(uint16_t a, uint16_t b, bool borrow, uint8_t size)
+    {
+        uint32_t r = (uint32_t)a - b - borrow;
+        SetFlag(CpuCarry, (uint32_t)a < (uint32_t)b + borrow);
+        SetFlag(CpuAux, (a ^ b ^ r) & 0x10);
+        SetFlag(CpuOverflow, (a ^ b) & (a ^ r) & signBit(size));
+        SetSzp(r, size);
+        return r & mask(size);
+    }
+
+    uint16_t Logic(uint16_t r, uint8_t size)
+    {
+        SetFlag(CpuCarry, false);
+        SetFlag(CpuOverflow, false);
+        SetFlag(CpuAux, false);
+        SetSzp(r, size);
+        return r & mask(size);
+    }
+
+    // ADD..CMP and TEST. Returns the result; the caller skips storing it
+    // for CMP and TEST.
+    uint16_t Alu(Mnemonic m, uint16_t a, uint16_t b, uint8_t size)
+    {
+        switch (m)
+        {
+        case Mnemonic::Add: return Add(a, b, false, size);
+        case Mnemonic::Adc: return Add(a, b, Flag(CpuCarry), size);
+        case Mnemonic::Sub:
+        case Mnemonic::Cmp: return Sub(a, b, false, size);
+        case Mnemonic::Sbb: return Sub(a, b, Flag(CpuCarry), size);
+        case Mnemonic::Or: return Logic(a | b, size);
+        case Mnemonic::And:
+        case Mnemonic::Test: return Logic(a & b, size);
+        case Mnemonic::Xor: return Logic(a ^ b, size);
+        default: return a;
+        }
+    }
+
+    uint16_t Shift(Mnemonic m, uint16_t v, uint8_t count, uint8_t size)
+    {
+        if (count == 0)
+        {
+            return v;
+        }
+        uint16_t top = signBit(size);
+        bool cf = Flag(CpuCarry);
+        uint16_t orig = v;
+        for (uint8_t i = 0; i < count; i++)
+        {
+            bool out;
+            switch (m)
+            {
+            case Mnemonic::Rol: out = v & top; v = (v << 1) | out; cf = out; break;
+            case Mnemonic::Ror: out = v & 1; v = (v >> 1) | (out ? top : 0); cf = out; break;
+            case Mnemonic::Rcl: out = v & top; v = (v << 1) | cf; cf = out; break;
+            case Mnemonic::Rcr: out = v & 1; v = (v >> 1) | (cf ? top : 0); cf = out; break;
+            case Mnemonic::Shl: cf = v & top; v <<= 1; break;
+            case Mnemonic::Shr: cf = v & 1; v >>= 1; break;
+            default: cf = v & 1; v = (v >> 1) | (v & top); break; // SAR
+            }
+            v &= mask(size);
+        }
+        SetFlag(CpuCarry, cf);
+        bool msb = v & top;
+        switch (m)
+        {
+        case Mnemonic::Rol:
+        case Mnemonic::Rcl:
+        case Mnemonic::Shl: SetFlag(CpuOverflow, msb != cf); break;
+        case Mnemonic::Ror:
+        case Mnemonic::Rcr: SetFlag(CpuOverflow, msb != (bool)(v & (top >> 1))); break;
+        case Mnemonic::Shr: SetFlag(CpuOverflow, orig & top); break;
+        default: SetFlag(CpuOverflow, false); break;
+        }
+        if (m == Mnemonic::Shl || m == Mnemonic::Shr || m == Mnemonic::Sar)
+        {
+            SetSzp(v, size);
+        }
+        return v;
+    }
+
+    bool Condition(Mnemonic m) const
+    {
+        int c = (int)m - (int)Mnemonic::Jo;
+        bool t = false;
+        switch (c >> 1)
+        {
+        case 0: t = Flag(CpuOverflow); break;
+        case 1: t = Flag(CpuCarry); break;
+        case 2: t = Flag(CpuZero); break;
+        case 3: t = Flag(CpuCarry) || Flag(CpuZero); break;
+        case 4: t = Flag(CpuSign); break;
+        case 5: t = Flag(CpuParity); break;
+        case 6: t = Flag(CpuSign) != Flag(CpuOverflow); break;
+        case 7: t = Flag(CpuZero) || Flag(CpuSign) != Flag(CpuOverflow); break;
+        }
+        return (c & 1) ? !t : t;
+    }
+
+    void FarJump(uint16_t seg, uint16_t off)
+    {
+        sregs[SegCS] = seg;
+        ip = off;
+    }
+
+    // Raises interrupt n through the vector table. Vectors nobody has set
+    // fall back to the few DOS and BIOS services test programs use.
+    void Interrupt(uint8_t n)
+    {
+        uint16_t off = Read16(0, n * 4);
+        uint16_t seg = Read16(0, n * 4 + 2);
+        if (off || seg)
+        {
+            Push(flags);
+            SetFlag(CpuInterrupt, false);
+            SetFlag(CpuTrap, false);
+            Push(sregs[SegCS]);
+            Push(ip);
+            FarJump(seg, off);
+            return;
+        }
+        uint8_t ah = regs[RegAX] >> 8;
+        if (n == 0x20 || (n == 0x21 && ah == 0x4C))
+        {
+            exitCode = n == 0x21 ? regs[RegAX] & 0xFF : 0;
+            stop = StopReason::Exit;
+        }
+        else if (n == 0x21 && ah == 0x02)
+        {
+            output += (char)(regs[RegDX] & 0xFF);
+        }
+        else if (n == 0x21 && ah == 0x09)
+        {
+            for (uint16_t off = regs[RegDX]; Read8(sregs[SegDS], off) != '$' && output.size() < (1u << 24); off++)
+            {
+                output += (char)Read8(sregs[SegDS], off);
+            }
+        }
+        else if (n == 0x10 && ah == 0x0E)
+        {
+            output += (char)(regs[RegAX] & 0xFF);
+        }
+        else
+        {
+            stop = n == 0 ? StopReason::DivideError : StopReason::Unsupported;
+        }
+    }
+
+    void MulDiv(const DecodedInsn &insn)
+    {
+        uint8_t size = insn.op[0].size;
+        uint16_t src = Get(insn, insn.op[0]);
+        uint16_t ax = regs[RegAX];
+        if (size == 1)
+        {
+            switch (insn.mnemonic)
+            {
+            case Mnemonic::Mul:
+                regs[RegAX] = (ax & 0xFF) * src;
+                SetFlag(CpuCarry, regs[RegAX] >> 8);
+                break;
+            case Mnemonic::Imul:
+                regs[RegAX] = (int8_t)ax * (int8_t)src;
+                SetFlag(CpuCarry, (int16_t)regs[RegAX] != (int8_t)regs[RegAX]);
+                break;
+            case Mnemonic::Div:
+                if (src == 0 || ax / src > 0xFF)
+                {
+                    Interrupt(0);
+                    return;
+                }
+                regs[RegAX] = ((ax % src) << 8) | (ax / src);
+                break;
+            default:
+            {
+                int q = src ? (int16_t)ax / (int8_t)src : 0;
+                if (src == 0 || q > 127 || q < -128)
+                {
+                    Interrupt(0);
+                    return;
+                }
+                regs[RegAX] = (((int16_t)ax % (int8_t)src) << 8) | (q & 0xFF);
+                break;
+            }
+            }
+        }
+        else
+        {
+            uint32_t dxax = ((uint32_t)regs[RegDX] << 16) | ax;
+            switch (insn.mnemonic)
+            {
+            case Mnemonic::Mul:
+                dxax = (uint32_t)ax * src;
+                SetFlag(CpuCarry, dxax >> 16);
+                break;
+            case Mnemonic::Imul:
+                dxax = (uint32_t)((int32_t)(int16_t)ax * (int16_t)src);
+                SetFlag(CpuCarry, (int32_t)dxax != (int16_t)dxax);
+                break;
+            case Mnemonic::Div:
+                if (src == 0 || dxax / src > 0xFFFF)
+                {
+                    Interrupt(0);
+                    return;
+                }
+                dxax = ((dxax % src) << 16) | (dxax / src);
+                break;
+            default:
+            {
+                int64_t q = src ? (int64_t)(int32_t)dxax / (int16_t)src : 0;
+                if (src == 0 || q > 32767 || q < -32768)
+                {
+                    Interrupt(0);
+                    return;
+                }
+                dxax = ((uint32_t)((int32_t)dxax % (int16_t)src) << 16) | (q & 0xFFFF);
+                break;
+            }
+            }
+            regs[RegAX] = dxax & 0xFFFF;
+            regs[RegDX] = dxax >> 16;
+        }
+        if (insn.mnemonic == Mnemonic::Mul || insn.mnemonic == Mnemonic::Imul)
+        {
+            SetFlag(CpuOverflow, Flag(CpuCarry));
+        }
+    }
+
+    // One iteration of a string instruction.
+    void StringOp(const DecodedInsn &insn)
+    {
+        uint8_t size = (insn.opcode & 1) ? 2 : 1;
+        int16_t step = Flag(CpuDirection) ? -size : size;
+        uint16_t src = sregs[segmentOf(insn, SegDS)];
+        uint16_t es = sregs[SegES];
+        uint16_t &si = regs[RegSI];
+        uint16_t &di = regs[RegDI];
+        auto read = [&](uint16_t seg, uint16_t off) { return size == 1 ? Read8(seg, off) : Read16(seg, off); };
+        auto write = [&](uint16_t seg, uint16_t off, uint16_t v)
+        {
+            size == 1 ? Write8(seg, off, v) : Write16(seg, off, v);
+        };
+        uint16_t acc = size == 1 ? regs[RegAX] & 0xFF : regs[RegAX];
+        switch (insn.mnemonic)
+        {
+        case Mnemonic::Movs:
+            write(es, di, read(src, si));
+            si += step;
+            di += step;
+            break;
+        case Mnemonic::Cmps:
+            Sub(read(src, si), read(es, di), false, size);
+            si += step;
+            di += step;
+            break;
+        case Mnemonic::Stos:
+            write(es, di, acc);
+            di += step;
+            break;
+        case Mnemonic::Lods:
+            size == 1 ? SetReg8(0, read(src, si)) : (void)(regs[RegAX] = read(src, si));
+            si += step;
+            break;
+        default: // SCAS
+            Sub(acc, read(es, di), false, size);
+            di += step;
+            break;
+        }
+    }
+
+    void Strings(const DecodedInsn &insn)
+    {
+        if (!(insn.prefixes & (PrefixRep | PrefixRepne)))
+        {
+            StringOp(insn);
+            return;
+        }
+        bool compares = insn.mnemonic == Mnemonic::Cmps || insn.mnemonic == Mnemonic::Scas;
+        while (regs[RegCX])
+        {
+            StringOp(insn);
+            regs[RegCX]--;
+            if (compares && Flag(CpuZero) != (bool)(insn.prefixes & PrefixRep))
+            {
+                break;
+            }
+        }
+    }
+
+    void Execute(const DecodedInsn &insn)
+    {
+        const Operand &a = insn.op[0];
+        const Operand &b = insn.op[1];
+        Mnemonic m = insn.mnemonic;
+        switch (m)
+        {
+        case Mnemonic::Add:
+        case Mnemonic::Or:
+        case Mnemonic::Adc:
+        case Mnemonic::Sbb:
+        case Mnemonic::And:
+        case Mnemonic::Sub:
+        case Mnemonic::Xor:
+        {
+            uint16_t r = Alu(m, Get(insn, a), Get(insn, b), a.size);
+            Set(insn, a, r);
+            break;
+        }
+        case Mnemonic::Cmp:
+        case Mnemonic::Test:
+            Alu(m, Get(insn, a), Get(insn, b), a.size);
+            break;
+        case Mnemonic::Inc:
+        case Mnemonic::Dec:
+        {
+            bool cf = Flag(CpuCarry);
+            uint16_t v = Get(insn, a);
+            Set(insn, a, m == Mnemonic::Inc ? Add(v, 1, false, a.size) : Sub(v, 1, false, a.size));
+            SetFlag(CpuCarry, cf);
+            break;
+        }
+        case Mnemonic::Not:
+            Set(insn, a, ~Get(insn, a));
+            break;
+        case Mnemonic::Neg:
+            Set(insn, a, Sub(0, Get(insn, a), false, a.size));
+            break;
+        case Mnemonic::Mul:
+        case Mnemonic::Imul:
+        case Mnemonic::Div:
+        case Mnemonic::Idiv:
+            MulDiv(insn);
+            break;
+        case Mnemonic::Rol:
+        case Mnemonic::Ror:
+        case Mnemonic::Rcl:
+        case Mnemonic::Rcr:
+        case Mnemonic::Shl:
+        case Mnemonic::Shr:
+        case Mnemonic::Sar:
+            Set(insn, a, Shift(m, Get(insn, a), Get(insn, b) & 0xFF, a.size));
+            break;
+        case Mnemonic::Mov:
+            Set(insn, a, Get(insn, b));
+            break;
+        case Mnemonic::Xchg:
+        {
+            uint16_t t = Get(insn, a);
+            Set(insn, a, Get(insn, b));
+            Set(insn, b, t);
+            break;
+        }
+        case Mnemonic::Lea:
+        case Mnemonic::Les:
+        case Mnemonic::Lds:
+        {
+            if (!IsMemory(insn))
+            {
+                stop = StopReason::Unsupported;
+                break;
+            }
+            uint8_t seg;
+            uint16_t off = EffectiveAddress(insn, &seg);
+            if (m == Mnemonic::Lea)
+            {
+                Set(insn, a, off);
+                break;
+            }
+            Set(insn, a, Read16(sregs[seg], off));
+            sregs[m == Mnemonic::Les ? SegES : SegDS] = Read16(sregs[seg], off + 2);
+            break;
+        }
+        case Mnemonic::Push:
+            Push(Get(insn, a));
+            break;
+        case Mnemonic::Pop:
+            Set(insn, a, Pop());
+            break;
+        case Mnemonic::Pushf:
+            Push(flags);
+            break;
+        case Mnemonic::Popf:
+            flags = (Pop() & 0x0FD5) | 0xF002;
+            break;
+        case Mnemonic::Sahf:
+            flags = (flags & 0xFF00) | ((regs[RegAX] >> 8) & 0xD5) | 0x02;
+            break;
+        case Mnemonic::Lahf:
+            SetReg8(4, flags & 0xFF);
+            break;
+        case Mnemonic::Cbw:
+            regs[RegAX] = (int8_t)(regs[RegAX] & 0xFF);
+            break;
+        case Mnemonic::Cwd:
+            regs[RegDX] = (regs[RegAX] & 0x8000) ? 0xFFFF : 0;
+            break;
+        case Mnemonic::Xlat:
+            SetReg8(0, Read8(sregs[segmentOf(insn, SegDS)], regs[RegBX] + (regs[RegAX] & 0xFF)));
+            break;
+        case Mnemonic::Daa:
+        case Mnemonic::Das:
+        {
+            uint8_t al = regs[RegAX] & 0xFF;
+            bool cf = Flag(CpuCarry);
+            int sign = m == Mnemonic::Daa ? 1 : -1;
+            uint8_t r = al;
+            bool af = (al & 0xF) > 9 || Flag(CpuAux);
+            if (af)
+            {
+                r += sign * 6;
+            }
+            bool carry = al > 0x99 || cf;
+            if (carry)
+            {
+                r += sign * 0x60;
+            }
+            SetReg8(0, r);
+            SetFlag(CpuAux, af);
+            SetFlag(CpuCarry, carry);
+            SetSzp(r, 1);
+            break;
+        }
+        case Mnemonic::Aaa:
+        case Mnemonic::Aas:
+        {
+            bool adjust = (regs[RegAX] & 0xF) > 9 || Flag(CpuAux);
+            if (adjust)
+            {
+                uint8_t al = (regs[RegAX] & 0xFF) + (m == Mnemonic::Aaa ? 6 : -6);
+                uint8_t ah = (regs[RegAX] >> 8) + (m == Mnemonic::Aaa ? 1 : -1);
+                regs[RegAX] = (ah << 8) | al;
+            }
+            SetReg8(0, regs[RegAX] & 0x0F);
+            SetFlag(CpuAux, adjust);
+            SetFlag(CpuCarry, adjust);
+            break;
+        }
+        case Mnemonic::Aam:
+        {
+            uint8_t base = insn.imm & 0xFF;
+            if (base == 0)
+            {
+                Interrupt(0);
+                break;
+            }
+            uint8_t al = regs[RegAX] & 0xFF;
+            regs[RegAX] = ((al / base) << 8) | (al % base);
+            SetSzp(regs[RegAX], 1);
+            break;
+        }
+        case Mnemonic::Aad:
+        {
+            uint8_t al = (regs[RegAX] & 0xFF) + (regs[RegAX] >> 8) * (insn.imm & 0xFF);
+            regs[RegAX] = al;
+            SetSzp(al, 1);
+            break;
+        }
+        case Mnemonic::Movs:
+        case Mnemonic::Cmps:
+        case Mnemonic::Stos:
+        case Mnemonic::Lods:
+        case Mnemonic::Scas:
+            Strings(insn);
+            break;
+        case Mnemonic::Jmp:
+            ip = a.kind == OperandKind::Rel ? ip + insn.imm : Get(insn, a);
+            break;
+        case Mnemonic::Call:
+        {
+            uint16_t target = a.kind == OperandKind::Rel ? ip + insn.imm : Get(insn, a);
+            Push(ip);
+            ip = target;
+            break;
+        }
+        case Mnemonic::JmpFar:
+        case Mnemonic::CallFar:
+        {
+            uint16_t seg = insn.seg;
+            uint16_t off = insn.imm;
+            if (a.kind == OperandKind::ModRm)
+            {
+                uint8_t s;
+                if (!IsMemory(insn))
+                {
+                    stop = StopReason::Unsupported;
+                    break;
+                }
+                uint16_t ea = EffectiveAddress(insn, &s);
+                off = Read16(sregs[s], ea);
+                seg = Read16(sregs[s], ea + 2);
+            }
+            if (m == Mnemonic::CallFar)
+            {
+                Push(sregs[SegCS]);
+                Push(ip);
+            }
+            FarJump(seg, off);
+            break;
+        }
+        case Mnemonic::Ret:
+            ip = Pop();
+            regs[RegSP] += a.kind == OperandKind::Imm ? insn.imm : 0;
+            break;
+        case Mnemonic::Retf:
+        {
+            uint16_t off = Pop();
+            FarJump(Pop(), off);
+            regs[RegSP] += a.kind == OperandKind::Imm ? insn.imm : 0;
+            break;
+        }
+        case Mnemonic::Iret:
+        {
+            uint16_t off = Pop();
+            FarJump(Pop(), off);
+            flags = (Pop() & 0x0FD5) | 0xF002;
+            break;
+        }
+        case Mnemonic::Int:
+            Interrupt(insn.imm & 0xFF);
+            break;
+        case Mnemonic::Into:
+            if (Flag(CpuOverflow))
+            {
+                Interrupt(4);
+            }
+            break;
+        case Mnemonic::Loop:
+        case Mnemonic::Loope:
+        case Mnemonic::Loopne:
+        {
+            bool go = --regs[RegCX] != 0;
+            if (m == Mnemonic::Loope)
+            {
+                go = go && Flag(CpuZero);
+            }
+            else if (m == Mnemonic::Loopne)
+            {
+                go = go && !Flag(CpuZero);
+            }
+            if (go)
+            {
+                ip += insn.imm;
+            }
+            break;
+        }
+        case Mnemonic::Jcxz:
+            if (regs[RegCX] == 0)
+            {
+                ip += insn.imm;
+            }
+            break;
+        case Mnemonic::In:
+            // No devices: the bus floats high.
+            Set(insn, a, 0xFFFF);
+            break;
+        case Mnemonic::Out:
+        case Mnemonic::Nop:
+        case Mnemonic::Wait:
+        case Mnemonic::Prefix: // superseded by the prefix of its kind after it
+            break;
+        case Mnemonic::Hlt:
+            stop = StopReason::Halt;
+            break;
+        case Mnemonic::Cmc:
+            SetFlag(CpuCarry, !Flag(CpuCarry));
+            break;
+        case Mnemonic::Clc:
+        case Mnemonic::Stc:
+            SetFlag(CpuCarry, m == Mnemonic::Stc);
+            break;
+        case Mnemonic::Cli:
+        case Mnemonic::Sti:
+            SetFlag(CpuInterrupt, m == Mnemonic::Sti);
+            break;
+        case Mnemonic::Cld:
+        case Mnemonic::Std:
+            SetFlag(CpuDirection, m == Mnemonic::Std);
+            break;
+        default:
+            if (m >= Mnemonic::Jo && m <= Mnemonic::Jnle)
+            {
+                if (Condition(m))
+                {
+                    ip += insn.imm;
+                }
+                break;
+            }
+            stop = StopReason::Invalid;
+            break;
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,529 @@
+// Binary form of decoded instructions, for tools that would otherwise parse
+// the text. Unlike disasm.h this header does file I/O: IrWriter streams a
+// file out sequentially and IrFile maps one back in without parsing.
+//
+// Layout (all integers little-endian):
+//   IrHeader                   magic "D86I", version, section count
+//   IrSection[MaxSections]     directory; unused slots have type None
+//   section data...            each section 8-byte aligned
+//
+// Sections hold fixed-size entries. Readers skip section types they do not
+// know, so new sections do not need a version bump; changing an existing
+// entry layout does.
+#ifndef IRFILE_H
+#define IRFILE_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <vector>
+#include "disasm.h"
+
+constexpr char irMagic[4] = {'D', '8', '6', 'I'};
+constexpr uint16_t IrVersion = 1;
+
+enum IrSectionType : uint32_t
+{
+    IrSectionNone,
+    IrSectionInsns,       // IrRecord per instruction, in decode order
+    IrSectionStrings,     // mnemonic names by Mnemonic value, NUL-terminated
+    IrSectionImage,       // the decoded bytes, for showing undecodable data
+    IrSectionSource,      // one IrSource: the input an index was built from
+    IrSectionBounds,      // uint32 instruction start offsets, ascending
+    IrSectionXrefTargets, // IrXrefTarget per referenced address, ascending
+    IrSectionXrefs,       // IrXref per reference, grouped by target
+    IrSectionLoad         // one IrLoad: where the image loads and starts
+};
+
+struct IrHeader
+{
+    char magic[4];
+    uint16_t version;
+    uint16_t sectionCount; // directory slots, used or not
+};
+
+struct IrSection
+{
+    uint32_t type;
+    uint32_t entrySize; // bytes per entry, 1 for byte data
+    uint64_t offset;    // from the start of the file
+    uint64_t size;      // in bytes
+};
+
+// One DecodedInsn with every field at a fixed position.
+struct IrRecord
+{
+    uint32_t offset;
+    uint8_t length;
+    uint8_t opcode;
+    uint8_t modrm;
+    uint8_t prefixes;
+    uint8_t mnemonic;
+    uint8_t flags;
+    uint8_t opKind[2];
+    uint8_t opSize[2];
+    uint8_t opReg[2];
+    int16_t disp;
+    uint16_t imm;
+    uint16_t seg;
+    uint8_t prefixOrder; // 0 in files written before it was kept
+    uint8_t reserved;
+};
+
+// Identifies the input and sweep settings behind an offset index, so a
+// stale index is rebuilt instead of used.
+struct IrSource
+{
+    uint64_t size;
+    int64_t mtime; // nanoseconds since the epoch
+    uint32_t step; // instructions between consecutive bounds
+    uint32_t resync;
+};
+
+// One row of the cross-reference index: the refs to target are
+// IrXref[first, next row's first), the last row running to the end.
+struct IrXrefTarget
+{
+    uint32_t target;
+    uint32_t first;
+};
+
+struct IrXref
+{
+    uint32_t from; // offset of the referencing instruction
+    uint8_t kind;  // XrefKind
+    uint8_t reserved[3];
+};
+
+// How the decoded image was loaded, so text printed from the file names
+// labels and notes the load the way the direct listing does.
+struct IrLoad
+{
+    uint8_t format;      // ImageFormat value
+    uint8_t reserved;
+    uint16_t origin;     // offset of the image's first byte in its segment
+    uint16_t cs, ip;     // entry point; cs relative to the load segment
+    uint16_t ss, sp;     // initial stack, likewise
+    uint32_t fileOffset; // of the image in the input file
+    uint32_t relocCount;
+};
+
+static_assert(sizeof(IrHeader) == 8, "IrHeader layout");
+static_assert(sizeof(IrSource) == 24, "IrSource layout");
+static_assert(sizeof(IrSection) == 24, "IrSection layout");
+static_assert(sizeof(IrRecord) == 24, "IrRecord layout");
+static_assert(sizeof(IrXrefTarget) == 8, "IrXrefTarget layout");
+static_assert(sizeof(IrXref) == 8, "IrXref layout");
+static_assert(sizeof(IrLoad) == 20, "IrLoad layout");
+
+inline IrRecord toIrRecord(const DecodedInsn &insn)
+{
+    IrRecord r;
+    r.offset = insn.offset;
+    r.length = insn.length;
+    r.opcode = insn.opcode;
+    r.modrm = insn.modrm;
+    r.prefixes = insn.prefixes;
+    r.mnemonic = (uint8_t)insn.mnemonic;
+    r.flags = insn.flags;
+    for (int i = 0; i < 2; i++)
+    {
+        r.opKind[i] = (uint8_t)insn.op[i].kind;
+        r.opSize[i] = insn.op[i].size;
+        r.opReg[i] = insn.op[i].reg;
+    }
+    r.disp = insn.disp;
+    r.imm = insn.imm;
+    r.seg = insn.seg;
+    r.prefixOrder = insn.prefixOrder;
+    r.reserved = 0;
+    return r;
+}
+
+inline DecodedInsn fromIrRecord(const IrRecord &r)
+{
+    DecodedInsn insn;
+    insn.offset = r.offset;
+    insn.length = r.length;
+    insn.opcode = r.opcode;
+    insn.modrm = r.modrm;
+    insn.prefixes = r.prefixes;
+    // Values this build does not know decode as Invalid rather than
+    // indexing past the name tables.
+    insn.mnemonic = r.mnemonic < (uint8_t)Mnemonic::Count ? (Mnemonic)r.mnemonic : Mnemonic::Invalid;
+    insn.flags = r.flags;
+    for (int i = 0; i < 2; i++)
+    {
+        insn.op[i].kind = r.opKind[i] <= (uint8_t)OperandKind::Far ? (OperandKind)r.opKind[i] : OperandKind::None;
+        insn.op[i].size = r.opSize[i];
+        insn.op[i].reg = r.opReg[i];
+    }
+    insn.disp = r.disp;
+    insn.imm = r.imm;
+    insn.seg = r.seg;
+    insn.prefixOrder = r.prefixOrder;
+    if (!insn.prefixOrder)
+    {
+        // Older files: LOCK, REP or REPNE, then the segment override.
+        int n = 0;
+        for (uint8_t prefix : {PrefixLock, PrefixRep, PrefixRepne, PrefixSegment})
+        {
+            if (insn.prefixes & prefix)
+            {
+                insn.prefixOrder |= prefixSlot(prefix) << 2 * n++;
+            }
+        }
+    }
+    return insn;
+}
+
+// Writes an IR file front to back through a small buffer, to a file or
+// into memory. Sections are written one at a time between Begin and End;
+// Close fills in the directory at the start.
+struct IrWriter
+{
+    static constexpr uint16_t MaxSections = 8;
+    static constexpr size_t BufferSize = 1 << 16;
+
+    int fd;
+    std::vector<uint8_t> *memory; // appended to instead of writing fd
+    size_t memoryLimit;           // most bytes *memory may grow to
+    uint64_t pos; // file offset of the next byte written
+    IrSection dir[MaxSections];
+    uint16_t used;
+    bool failed;
+    size_t len;
+    uint8_t buf[BufferSize];
+
+public:
+    explicit IrWriter(int fd) : fd(fd), memory(nullptr), memoryLimit(0), pos(0), used(0), failed(false), len(0)
+    {
+        memset(dir, 0, sizeof(dir));
+        IrHeader h = {{irMagic[0], irMagic[1], irMagic[2], irMagic[3]}, IrVersion, MaxSections};
+        Write(&h, sizeof(h));
+        Write(dir, sizeof(dir));
+    }
+
+    // Writes the file to the end of *memory, which must start out empty.
+    // A file larger than limit fails like a full disk would.
+    explicit IrWriter(std::vector<uint8_t> *memory, size_t limit = SIZE_MAX) : IrWriter(-1)
+    {
+        this->memory = memory;
+        memoryLimit = limit;
+    }
+
+    IrWriter(const IrWriter &) = delete;
+    IrWriter &operator=(const IrWriter &) = delete;
+
+    void Begin(IrSectionType type, uint32_t entrySize)
+    {
+        static const uint8_t zeros[8] = {};
+        Write(zeros, (8 - pos % 8) % 8);
+        if (used == MaxSections)
+        {
+            failed = true;
+            return;
+        }
+        dir[used] = IrSection{type, entrySize, pos, 0};
+    }
+
+    void Write(const void *data, size_t n)
+    {
+        const uint8_t *p = static_cast<const uint8_t *>(data);
+        pos += n;
+        while (n)
+        {
+            if (len == BufferSize)
+            {
+                Flush();
+            }
+            size_t k = std::min(n, BufferSize - len);
+            memcpy(buf + len, p, k);
+            len += k;
+            p += k;
+            n -= k;
+        }
+    }
+
+    void End()
+    {
+        if (used < MaxSections)
+        {
+            dir[used].size = pos - dir[used].offset;
+            used++;
+        }
+    }
+
+    // Writes out the buffer and then the directory; the file needs to be
+    // seekable for the latter. Returns false if any write failed.
+    bool Close()
+    {
+        Flush();
+        if (memory)
+        {
+            if (!failed)
+            {
+                memcpy(memory->data() + sizeof(IrHeader), dir, sizeof(dir));
+            }
+            return !failed;
+        }
+        if (!failed && pwrite(fd, dir, sizeof(dir), sizeof(IrHeader)) != (ssize_t)sizeof(dir))
+        {
+            failed = true;
+        }
+        return !failed;
+    }
+
+private:
+    void Flush()
+    {
+        DISASM_PROFILE_SCOPE(ProfileOutput);
+        if (memory)
+        {
+            if (memory->size() + len > memoryLimit)
+            {
+                failed = true;
+            }
+            else if (!failed)
+            {
+                memory->insert(memory->end(), buf, buf + len);
+            }
+            len = 0;
+            return;
+        }
+        const uint8_t *p = buf;
+        while (len && !failed)
+        {
+            ssize_t w = write(fd, p, len);
+            if (w < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (w <= 0)
+            {
+                failed = true;
+            }
+            else
+            {
+                p += w;
+                len -= w;
+            }
+        }
+        len = 0;
+    }
+};
+
+// A read-only mapping of an IR file, checked once on open. Records are
+// used in place; nothing is copied or parsed.
+struct IrFile
+{
+    const uint8_t *data;
+    size_t size;
+    const char *error;
+
+public:
+    explicit IrFile(const char *path) : data(nullptr), size(0), error(nullptr)
+    {
+        int fd = open(path, O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0)
+        {
+            error = "failed to open IR file";
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+            return;
+        }
+        size = st.st_size;
+        void *p = size ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+        close(fd);
+        if (p == MAP_FAILED)
+        {
+            error = "failed to map IR file";
+            size = 0;
+            return;
+        }
+        data = static_cast<const uint8_t *>(p);
+        error = Check();
+    }
+
+    IrFile(const IrFile &) = delete;
+    IrFile &operator=(const IrFile &) = delete;
+
+    const char *Error() const { return error; }
+
+    const IrHeader &Header() const
+    {
+        return *reinterpret_cast<const IrHeader *>(data);
+    }
+
+    // The first section of the given type, or nullptr.
+    const IrSection *Section(IrSectionType type) const
+    {
+        const IrSection *dir = reinterpret_cast<const IrSection *>(data + sizeof(IrHeader));
+        for (uint16_t i = 0; i < Header().sectionCount; i++)
+        {
+            if (dir[i].type == type)
+            {
+                return &dir[i];
+            }
+        }
+        return nullptr;
+    }
+
+    const IrRecord *Records() const
+    {
+        const IrSection *s = Section(IrSectionInsns);
+        return s ? reinterpret_cast<const IrRecord *>(data + s->offset) : nullptr;
+    }
+
+    size_t RecordCount() const
+    {
+        const IrSection *s = Section(IrSectionInsns);
+        return s ? s->size / sizeof(IrRecord) : 0;
+    }
+
+    // The decoded image, if the file carries one.
+    const uint8_t *Image(size_t *len) const
+    {
+        const IrSection *s = Section(IrSectionImage);
+        *len = s ? s->size : 0;
+        return s ? data + s->offset : nullptr;
+    }
+
+    const IrSource *Source() const
+    {
+        const IrSection *s = Section(IrSectionSource);
+        return s ? reinterpret_cast<const IrSource *>(data + s->offset) : nullptr;
+    }
+
+    const IrLoad *Load() const
+    {
+        const IrSection *s = Section(IrSectionLoad);
+        return s ? reinterpret_cast<const IrLoad *>(data + s->offset) : nullptr;
+    }
+
+    const uint32_t *Bounds(size_t *count) const
+    {
+        const IrSection *s = Section(IrSectionBounds);
+        *count = s ? s->size / sizeof(uint32_t) : 0;
+        return s ? reinterpret_cast<const uint32_t *>(data + s->offset) : nullptr;
+    }
+
+    // The refs to target from the file's cross-reference index, found by a
+    // binary search over its rows; nullptr and *count 0 if there are none.
+    const IrXref *XrefsTo(uint32_t target, size_t *count) const
+    {
+        const IrSection *rows = Section(IrSectionXrefTargets);
+        const IrSection *refs = Section(IrSectionXrefs);
+        *count = 0;
+        if (!rows || !refs)
+        {
+            return nullptr;
+        }
+        const IrXrefTarget *begin = reinterpret_cast<const IrXrefTarget *>(data + rows->offset);
+        const IrXrefTarget *end = begin + rows->size / sizeof(IrXrefTarget);
+        const IrXrefTarget *it = std::lower_bound(begin, end, target,
+                                                  [](const IrXrefTarget &r, uint32_t t) { return r.target < t; });
+        if (it == end || it->target != target)
+        {
+            return nullptr;
+        }
+        size_t refCount = refs->size / sizeof(IrXref);
+        size_t last = it + 1 < end ? it[1].first : refCount;
+        if (it->first > last || last > refCount)
+        {
+            return nullptr;
+        }
+        *count = last - it->first;
+        return reinterpret_cast<const IrXref *>(data + refs->offset) + it->first;
+    }
+
+    // Name of mnemonic m from the file's own string table, or nullptr if
+    // it has none or m is out of its range.
+    const char *MnemonicName(uint8_t m) const
+    {
+        const IrSection *s = Section(IrSectionStrings);
+        if (!s)
+        {
+            return nullptr;
+        }
+        const char *p = reinterpret_cast<const char *>(data + s->offset);
+        const char *end = p + s->size;
+        for (; p < end; p += strlen(p) + 1)
+        {
+            if (m-- == 0)
+            {
+                return p;
+            }
+        }
+        return nullptr;
+    }
+
+    ~IrFile()
+    {
+        if (data)
+        {
+            munmap(const_cast<uint8_t *>(data), size);
+        }
+    }
+
+private:
+    const char *Check() const
+    {
+        uint16_t one = 1;
+        if (*reinterpret_cast<const uint8_t *>(&one) != 1)
+        {
+            return "IR files can only be mapped on little-endian hosts";
+        }
+        if (size < sizeof(IrHeader) || memcmp(Header().magic, irMagic, sizeof(irMagic)))
+        {
+            return "not an IR file";
+        }
+        if (Header().version != IrVersion)
+        {
+            return "unsupported IR version";
+        }
+        if (size < sizeof(IrHeader) + Header().sectionCount * sizeof(IrSection))
+        {
+            return "truncated IR file";
+        }
+        const IrSection *dir = reinterpret_cast<const IrSection *>(data + sizeof(IrHeader));
+        for (uint16_t i = 0; i < Header().sectionCount; i++)
+        {
+            const IrSection &s = dir[i];
+            if (s.type == IrSectionNone)
+            {
+                continue;
+            }
+            if (s.offset % 8 || s.offset > size || s.size > size - s.offset)
+            {
+                return "truncated IR file";
+            }
+            if (s.type == IrSectionInsns && (s.entrySize != sizeof(IrRecord) || s.size % sizeof(IrRecord)))
+            {
+                return "IR record size mismatch";
+            }
+            if ((s.type == IrSectionSource && (s.entrySize != sizeof(IrSource) || s.size != sizeof(IrSource))) ||
+                (s.type == IrSectionLoad && (s.entrySize != sizeof(IrLoad) || s.size != sizeof(IrLoad))) ||
+                (s.type == IrSectionBounds && (s.entrySize != sizeof(uint32_t) || s.size % sizeof(uint32_t))) ||
+                (s.type == IrSectionXrefTargets && (s.entrySize != sizeof(IrXrefTarget) || s.size % sizeof(IrXrefTarget))) ||
+                (s.type == IrSectionXrefs && (s.entrySize != sizeof(IrXref) || s.size % sizeof(IrXref))))
+            {
+                return "IR entry size mismatch";
+            }
+            if (s.type == IrSectionStrings && s.size && data[s.offset + s.size - 1] != 0)
+            {
+                return "unterminated IR string table";
+            }
+        }
+        return nullptr;
+    }
+};
+
+#endif
@@ -0,0 +1,222 @@
+// DOS executable formats in front of the decoder. A .COM file is its own
+// load image and runs at offset 100h of its segment; an MZ .EXE has a
+// header and a relocation table before its load module, an entry point
+// and a stack given relative to the segment it is loaded at, and segment
+// words in the module that need that segment added.
+//
+// LoadImage finds all of this in bytes the caller provides. The load module
+// is a view into them, so a mapped file is decoded in place. Like disasm.h
+// this does no I/O; the loaders at the bottom put an image into the
+// emulator's memory.
+#ifndef LOADER_H
+#define LOADER_H
+
+#include <ctype.h>
+#include <algorithm>
+#include <vector>
+#include "disasm.h"
+#include "emu.h"
+
+enum class ImageFormat : uint8_t
+{
+    Auto, // MZ by its signature, .com by name, anything else raw
+    Raw,  // flat code from offset 0
+    Com,
+    Mz
+};
+
+// The fixed part of an MZ header; all fields are little-endian words.
+struct MzHeader
+{
+    uint16_t magic;         // "MZ" (or "ZM")
+    uint16_t lastPageBytes; // bytes used in the last 512-byte page, 0: all
+    uint16_t pages;         // 512-byte pages in the file, header included
+    uint16_t relocCount;
+    uint16_t headerParas;   // header size in 16-byte paragraphs
+    uint16_t minAlloc;
+    uint16_t maxAlloc;
+    uint16_t ss;            // initial SS, relative to the load segment
+    uint16_t sp;
+    uint16_t checksum;
+    uint16_t ip;
+    uint16_t cs;            // initial CS, relative to the load segment
+    uint16_t relocOffset;   // file offset of the relocation table
+    uint16_t overlay;
+};
+
+static_assert(sizeof(MzHeader) == 28, "MzHeader layout");
+
+// The format to load bytes as: requested, or with Auto picked from the
+// signature and then the file name.
+inline ImageFormat imageFormatOf(ImageFormat requested, const char *path, const uint8_t *data, size_t len)
+{
+    if (requested != ImageFormat::Auto)
+    {
+        return requested;
+    }
+    if (len >= 2 && ((data[0] == 'M' && data[1] == 'Z') || (data[0] == 'Z' && data[1] == 'M')))
+    {
+        return ImageFormat::Mz;
+    }
+    size_t n = strlen(path);
+    if (n >= 4 && path[n - 4] == '.' && tolower(path[n - 3]) == 'c' && tolower(path[n - 2]) == 'o' &&
+        tolower(path[n - 1]) == 'm')
+    {
+        return ImageFormat::Com;
+    }
+    return ImageFormat::Raw;
+}
+
+struct LoadImage
+{
+    static constexpr size_t MaxCom = 0x10000 - 0x100;
+
+    ImageFormat format;
+    const uint8_t *data; // the load module, inside the caller's bytes
+    size_t size;
+    size_t fileOffset;   // of data in the caller's bytes
+    uint16_t origin;     // offset of data[0] in its segment: 100h for .COM
+    uint16_t cs, ip;     // entry point; cs relative to the load segment
+    uint16_t ss, sp;     // initial stack, likewise
+    std::vector<uint32_t> relocs; // module offsets of segment words, ascending
+    size_t cutOff;       // bytes of a .COM past the end of its segment, not loaded
+    const char *error;
+
+public:
+    // format must not be Auto; see imageFormatOf.
+    LoadImage(const uint8_t *file, size_t len, ImageFormat format)
+        : format(format), data(file), size(len), fileOffset(0), origin(0), cs(0), ip(0), ss(0), sp(0),
+          cutOff(0), error(nullptr)
+    {
+        if (format == ImageFormat::Com)
+        {
+            size = std::min(len, MaxCom);
+            cutOff = len - size;
+            origin = ip = 0x100;
+            sp = 0xFFFE;
+        }
+        else if (format == ImageFormat::Mz)
+        {
+            error = LoadMz(file, len);
+        }
+    }
+
+    const char *Error() const { return error; }
+
+    // Offset in the module execution starts at.
+    size_t Entry() const
+    {
+        return (size_t)cs * 16 + ip - origin;
+    }
+
+private:
+    static uint16_t Word(const uint8_t *p)
+    {
+        return p[0] | p[1] << 8;
+    }
+
+    const char *LoadMz(const uint8_t *file, size_t len)
+    {
+        if (len < sizeof(MzHeader))
+        {
+            return "truncated MZ header";
+        }
+        uint16_t words[sizeof(MzHeader) / 2];
+        for (size_t i = 0; i < sizeof(MzHeader) / 2; i++)
+        {
+            words[i] = Word(file + 2 * i);
+        }
+        MzHeader h;
+        memcpy(&h, words, sizeof(h));
+        // The page counts only bound the module; linkers round them
+        // carelessly, so a short file is loaded as far as it goes.
+        size_t end = (size_t)h.pages * 512;
+        if (h.lastPageBytes && h.lastPageBytes < 512 && end >= 512)
+        {
+            end -= 512 - h.lastPageBytes;
+        }
+        end = std::min(end ? end : len, len);
+        size_t header = (size_t)h.headerParas * 16;
+        if (header > end)
+        {
+            return "MZ header runs past the end of the file";
+        }
+        if ((size_t)h.relocOffset + (size_t)h.relocCount * 4 > len)
+        {
+            return "truncated MZ relocation table";
+        }
+        data = file + header;
+        size = end - header;
+        fileOffset = header;
+        cs = h.cs;
+        ip = h.ip;
+        ss = h.ss;
+        sp = h.sp;
+        relocs.reserve(h.relocCount);
+        for (size_t i = 0; i < h.relocCount; i++)
+        {
+            const uint8_t *r = file + h.relocOffset + 4 * i;
+            uint32_t offset = (uint32_t)Word(r + 2) * 16 + Word(r);
+            if (offset + 2 <= size)
+            {
+                relocs.push_back(offset);
+            }
+        }
+        std::sort(relocs.begin(), relocs.end());
+        relocs.erase(std::unique(relocs.begin(), relocs.end()), relocs.end());
+        return nullptr;
+    }
+};
+
+// Loads a .COM image the way DOS does: PSP at seg:0 with INT 20h at its
+// start, code at seg:100h, all segment registers at seg and a zero word on
+// the stack so a final RET exits.
+inline void loadCom(Cpu &cpu, const uint8_t *image, size_t len, uint16_t seg = 0x1000)
+{
+    static const uint8_t int20[2] = {0xCD, 0x20};
+    cpu.Load(seg, 0, int20, sizeof(int20));
+    cpu.Load(seg, 0x100, image, std::min<size_t>(len, 0x10000 - 0x100));
+    for (uint16_t &s : cpu.sregs)
+    {
+        s = seg;
+    }
+    cpu.ip = 0x100;
+    cpu.regs[RegSP] = 0xFFFE;
+    cpu.Push(0);
+}
+
+// Loads an MZ image the way DOS does: PSP at psp:0, the module in the
+// paragraphs after it with the load segment added to every relocated word,
+// DS and ES at the PSP and CS:IP, SS:SP from the header.
+inline void loadMz(Cpu &cpu, const LoadImage &image, uint16_t psp = 0x1000)
+{
+    static const uint8_t int20[2] = {0xCD, 0x20};
+    uint16_t seg = psp + 0x10;
+    cpu.Load(psp, 0, int20, sizeof(int20));
+    cpu.Load(seg, 0, image.data, std::min<size_t>(image.size, Cpu::MemSize - Cpu::Linear(seg, 0)));
+    for (uint32_t r : image.relocs)
+    {
+        uint16_t at = seg + (r >> 4);
+        cpu.Write16(at, r & 15, cpu.Read16(at, r & 15) + seg);
+    }
+    cpu.sregs[SegES] = cpu.sregs[SegDS] = psp;
+    cpu.sregs[SegCS] = seg + image.cs;
+    cpu.sregs[SegSS] = seg + image.ss;
+    cpu.ip = image.ip;
+    cpu.regs[RegSP] = image.sp;
+}
+
+// Loads image as its format says; raw images run as .COM programs.
+inline void loadImage(Cpu &cpu, const LoadImage &image)
+{
+    if (image.format == ImageFormat::Mz)
+    {
+        loadMz(cpu, image);
+    }
+    else
+    {
+        loadCom(cpu, image.data, image.size);
+    }
+}
+
+#endif
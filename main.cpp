@@ -2,1969 +2,2816 @@
 #include <stdint.h>
 #include <assert.h>
 #include <string.h>
-enum Endianness
-{
-    Big,
-    Little
-};
-
-enum Mod
-{
-    Displacement0,
-    Displacement8,
-    Displacement16,
-    RegisterMode
-};
-
-enum class RegisterWset
-{
-    Ax,
-    Cx,
-    Dx,
-    Bx,
-    Sp,
-    Bp,
-    Si,
-    Di
-};
-enum class RegisterWclear
-{
-    Al,
-    Cl,
-    Dl,
-    Bl,
-    Ah,
-    Ch,
-    Dh,
-    Bh
-};
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "disasm.h"
+#include "analysis.h"
+#include "bench.h"
+#include "irfile.h"
+#include "emu.h"
+#include "stats.h"
+#include "loader.h"
+#include "serve.h"
 
-enum class RmWclear
+struct Reader
 {
-    Al,
-    Cl,
-    Dl,
-    Bl,
-    Ah,
-    Ch,
-    Dh,
-    Bh
-};
+    // The whole input is served from memory: a read-only mmap of the file
+    // when it is a regular file, otherwise an owned heap buffer filled with
+    // read() (pipes, character devices). InstrDecoder and the other passes
+    // walk the bytes with cursors of their own.
+    const uint8_t *data;
+    size_t size;
+    bool mapped;
+    bool owned;
+    const char *error; // why the input could not be loaded, or nullptr
 
-enum class RmWset
-{
-    Ax,
-    Cx,
-    Dx,
-    Bx,
-    Sp,
-    Bp,
-    Si,
-    Di
-};
+    // Where the bytes run, for a Reader over the module of a LoadImage.
+    uint32_t origin = 0; // address of data[0], which labels are named by
+    size_t entry = 0;    // where execution starts
+    const std::vector<uint32_t> *relocs = nullptr; // segment fixups, if any
 
-const char *getRegNameWclear(uint8_t r)
-{
-    switch (r)
-    {
-    case 0:
-        return "AL";
-    case 5:
-        return "CH";
-    case 1:
-        return "CL";
-    case 6:
-        return "DH";
-    case 2:
-        return "DL";
-    case 7:
-        return "BH";
-    case 3:
-        return "BL";
-    case 4:
-        return "AH";
-    default:
-        printf("invalid rgister\n");
-        abort();
+public:
+    Reader(std::FILE *f) : data(nullptr), size(0), mapped(false), owned(false), error(nullptr)
+    {
+        Load(fileno(f));
+        std::fclose(f);
     }
-}
 
-const char *getRegNameWset(uint8_t r)
-{
-    r &= 0b111;
-    switch (r)
-    {
-    case 0:
-        return "AX";
-    case 3:
-        return "BX";
-    case 2:
-        return "DX";
-    case 6:
-        return "SI";
-    case 4:
-        return "SP";
-    case 5:
-        return "Bp";
-    case 7:
-        return "Di";
-    case 1:
-        return "Cx";
-    default:
-        printf("invalid rgister %d\n", r);
-        abort();
+    Reader(const char *file_name) : data(nullptr), size(0), mapped(false), owned(false), error(nullptr)
+    {
+        int fd = open(file_name, O_RDONLY);
+        if (fd < 0)
+        {
+            error = "failed to open binary file";
+            return;
+        }
+        Load(fd);
+        close(fd);
     }
-}
 
-const char *getRegName(uint8_t r, int wset)
-{
-    if (wset)
+    // Reads all of fd after head[0..n), bytes already taken off it.
+    Reader(int fd, const uint8_t *head, size_t n)
+        : data(nullptr), size(0), mapped(false), owned(false), error(nullptr)
     {
-        return getRegNameWset(r);
+        ReadAll(fd, head, n);
     }
-    return getRegNameWclear(r);
-}
 
-const char *getEAregDisplacement0(uint8_t rm, int16_t imm, char *buf, int buflen)
-{
-    memset(buf, 0, buflen);
-    switch (rm)
-    {
-    case 0:
-        return "[BX + SI]";
-    case 1:
-        return "[BX + DI]";
-    case 2:
-        return "[BP + SI]";
-    case 3:
-        return "[BP + DI]";
-    case 4:
-        return "[SI]";
-    case 5:
-        return "[DI]";
-    case 6:
-    {
-        sprintf(buf, "[%d]", imm);
-        return buf;
-    }
-    case 7:
-        return "[BX]";
-    default:
-        printf("Invalid addressing mode: %d\n", rm);
-        abort();
-    }
-}
+    // Borrows a caller-owned image; nothing is freed on destruction.
+    Reader(const uint8_t *image, size_t len) : data(image), size(len), mapped(false), owned(false), error(nullptr) {}
 
-const char *getEAregDisplacement8(uint8_t rm, int16_t imm, char *buf, int buflen)
-{
-    memset(buf, 0, buflen);
-    switch (rm)
+    // Borrows the load module of image, which has to outlive the Reader.
+    explicit Reader(const LoadImage &image) : Reader(image.data, image.size)
     {
-    case 0:
-    {
-        sprintf(buf, "[BX + SI + %d]", imm);
-        return buf;
+        origin = image.origin;
+        entry = image.Entry() < image.size ? image.Entry() : 0;
+        relocs = &image.relocs;
     }
-    case 1:
-    {
-        sprintf(buf, "[BX + DI + %d]", imm);
 
-        return buf;
-    }
-    case 2:
-    {
-        sprintf(buf, "[BP + SI + %d]", imm);
+    Reader(const Reader &) = delete;
+    Reader &operator=(const Reader &) = delete;
 
-        return buf;
-    }
-    case 3:
-    {
-        sprintf(buf, "[BP + DI + %d]", imm);
-        return buf;
-    }
-    case 4:
-    {
-        sprintf(buf, "[SI + %d]", imm);
-        return buf;
-    }
-    case 5:
+    void Load(int fd)
     {
-        sprintf(buf, "[DI + %d]", imm);
-        return buf;
+        DISASM_PROFILE_SCOPE(ProfileRead);
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+        {
+            size = st.st_size;
+            if (size == 0)
+            {
+                return;
+            }
+            void *p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED)
+            {
+                madvise(p, size, MADV_SEQUENTIAL);
+                data = static_cast<const uint8_t *>(p);
+                mapped = true;
+                return;
+            }
+        }
+        ReadAll(fd);
     }
-    case 6:
+
+    void ReadAll(int fd, const uint8_t *head = nullptr, size_t n = 0)
     {
-        sprintf(buf, "[BX + %d]", imm);
-        return buf;
+        size_t cap = 1 << 16;
+        while (cap < n)
+        {
+            cap *= 2;
+        }
+        uint8_t *buf = static_cast<uint8_t *>(std::malloc(cap));
+        size = 0;
+        if (buf && n)
+        {
+            memcpy(buf, head, n);
+            size = n;
+        }
+        for (;;)
+        {
+            if (buf && size == cap)
+            {
+                cap *= 2;
+                uint8_t *grown = static_cast<uint8_t *>(std::realloc(buf, cap));
+                if (!grown)
+                {
+                    std::free(buf);
+                }
+                buf = grown;
+            }
+            if (!buf)
+            {
+                error = "out of memory";
+                size = 0;
+                return;
+            }
+            ssize_t n = read(fd, buf + size, cap - size);
+            if (n == 0)
+            {
+                break;
+            }
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                // Keep what arrived before the error and let the caller decide.
+                error = "failed to read byte";
+                break;
+            }
+            size += n;
+        }
+        data = buf;
+        owned = true;
     }
-    case 7:
+
+    const char *Error() const { return error; }
+    const uint8_t *Data() const { return data; }
+    size_t Size() const { return size; }
+
+    ~Reader()
     {
-        sprintf(buf, "[BX + %d]", imm);
-        return buf;
-    }
-    default:
-        printf("Invalid addressing mode: %d\n", rm);
-        abort();
+        if (mapped)
+        {
+            munmap(const_cast<uint8_t *>(data), size);
+        }
+        else if (owned)
+        {
+            std::free(const_cast<uint8_t *>(data));
+        }
     }
-}
-
-typedef struct
-{
-    uint32_t word : 1;
-    uint32_t reg_is_dest : 1;
-    uint32_t opcode : 6;
-} __attribute__((packed))
-Byte1;
+};
 
-typedef struct
+// Makes *insn, which decodeInsn left with status, the Mnemonic::Invalid
+// record a sweep reports for the skipped bytes that follow from it.
+static void markInvalid(DecodedInsn *insn, DecodeStatus status, uint64_t skipped)
 {
-    uint32_t rm : 3;
-    uint32_t reg : 3;
-    Mod mod : 2;
-} __attribute__((packed))
-Byte2;
+    insn->mnemonic = Mnemonic::Invalid;
+    insn->flags = status == DecodeStatus::Truncated ? FlagTruncated : 0;
+    insn->prefixes = 0;
+    insn->prefixOrder = 0;
+    insn->op[0] = insn->op[1] = Operand{OperandKind::None, 0, 0};
+    // length is a byte; a stopped sweep may skip more than it says.
+    insn->length = std::min<uint64_t>(skipped, 255);
+}
 
-struct Reader
+// Walks the instructions of a Reader's image in order. Bytes that do not
+// decode come back as Mnemonic::Invalid records covering the bytes skipped
+// to resynchronise, so a sweep never stops early on bad input.
+//
+// The decoder keeps its own position and only reads the image, so any
+// number of them can sweep one Reader at once, from as many threads.
+struct InstrDecoder
 {
-    FILE *file;
+    const uint8_t *data;
+    size_t size;
+    size_t pos;
+    size_t resync;   // bytes to skip after an invalid instruction; 0 stops the sweep
+    size_t badBytes; // bytes reported as Invalid so far
 
 public:
-    static bool IsLittleEndian()
+    explicit InstrDecoder(const Reader &reader, size_t resync = 1, size_t start = 0)
+        : data(reader.Data()), size(reader.Size()), pos(start), resync(resync), badBytes(0) {}
+
+    size_t Tell() const { return pos; }
+
+    void SeekTo(size_t offset)
+    {
+        assert(offset <= size);
+        pos = offset;
+    }
+
+    bool Next(DecodedInsn *insn)
     {
-        uint16_t x = 1;
-        if (reinterpret_cast<uint8_t *>(&x)[0] == 1)
+        if (pos == size)
+        {
+            return false;
+        }
+        DecodeStatus status = decodeInsn(data + pos, size - pos, insn);
+        insn->offset = pos;
+        if (status != DecodeStatus::Ok)
         {
+            // Report the skipped bytes; a cut-off instruction or a stopped
+            // sweep takes the rest of the input with it.
+            size_t skip = size - pos;
+            if (status == DecodeStatus::Invalid && resync)
+            {
+                skip = std::min(resync, skip);
+            }
+            markInvalid(insn, status, skip);
+            badBytes += skip;
+            pos += skip;
             return true;
         }
-        return false;
+        pos += insn->length;
+        return true;
     }
+};
 
-    template <typename T>
-    static T Swap(T val)
+// Decodes a stream that cannot be mapped or rewound (a pipe, stdin) in
+// constant memory. Input is read into a fixed ring; the first Window bytes
+// of the ring are mirrored past its end, so the Window bytes at any read
+// position are contiguous and an instruction that straddles the wrap point
+// decodes in place. The ring is refilled whenever fewer than Window bytes
+// are buffered, which is more than any instruction needs, so a decode
+// comes back Truncated only at the real end of the stream.
+struct StreamDecoder
+{
+    static constexpr size_t Capacity = 1 << 16;
+    static constexpr size_t Window = 64;
+    static_assert(Window >= MaxInsnLength, "an instruction must fit the window");
+
+    int fd;
+    uint8_t *ring;   // Capacity bytes plus the Window-byte mirror
+    uint64_t head;   // stream offset of the next byte to decode
+    uint64_t tail;   // stream offset one past the last byte read
+    bool eof;
+    const char *error;
+    size_t resync;
+    size_t badBytes;
+    uint8_t bad[InsnFormatter::MaxDbBytes]; // leading bytes of the last Invalid record
+
+public:
+    StreamDecoder(int fd, size_t resync = 1)
+        : fd(fd), ring(static_cast<uint8_t *>(std::malloc(Capacity + Window))), head(0), tail(0),
+          eof(false), error(nullptr), resync(resync), badBytes(0)
     {
-        uint8_t *buf = reinterpret_cast<uint8_t *>(&val);
-        int half = sizeof(T) / 2;
-        for (int i = 0; i < half; i++)
+        if (!ring)
         {
-            uint8_t a = buf[i];
-            buf[i] = buf[sizeof(T) - i - 1];
-            buf[sizeof(T) - i - 1] = a;
+            error = "out of memory";
+            eof = true;
         }
-        return val;
     }
 
-    Reader(std::FILE *f) : file(f) {}
+    StreamDecoder(const StreamDecoder &) = delete;
+    StreamDecoder &operator=(const StreamDecoder &) = delete;
 
-    Reader(const char *file_name)
+    const char *Error() const { return error; }
+
+    // Reads once into the free space up to the wrap point, mirroring
+    // anything that lands in the first Window bytes of the ring.
+    void Fill()
     {
-        std::FILE *file = std::fopen(file_name, "rb");
-        if (!file)
+        DISASM_PROFILE_SCOPE(ProfileRead);
+        size_t at = tail % Capacity;
+        size_t room = std::min(Capacity - (size_t)(tail - head), Capacity - at);
+        ssize_t n = read(fd, ring + at, room);
+        if (n < 0 && errno == EINTR)
         {
-            std::printf("failed to open binary file");
-            std::exit(1);
+            return;
+        }
+        if (n <= 0)
+        {
+            if (n < 0)
+            {
+                error = strerror(errno);
+            }
+            eof = true;
+            return;
+        }
+        if (at < Window)
+        {
+            memcpy(ring + Capacity + at, ring + at, std::min<size_t>(n, Window - at));
         }
+        tail += n;
+    }
 
-        this->file = file;
+    // Before the first Next: everything read so far, at least Window bytes
+    // unless the stream is shorter. For a look at the start of the stream.
+    const uint8_t *Buffered(size_t *n)
+    {
+        Available();
+        *n = tail;
+        return ring;
     }
 
-    uint8_t ReadByte()
+    // Contiguous bytes available at head, topping the ring up first.
+    size_t Available()
     {
-        uint8_t buf[1];
-        if (std::fread(buf, sizeof(uint8_t), 1, file) == 1)
+        while (!eof && tail - head < Window)
         {
-            return buf[0];
+            Fill();
         }
+        return std::min<uint64_t>(tail - head, Window);
+    }
 
-        if(feof(file)) {
-            exit(0);
-        } 
+    // Decodes the next instruction; *bytes points at its bytes until the
+    // following call. Returns false at the end of the stream. Offsets are
+    // stream offsets and wrap past 4 GB like DecodedInsn::offset does.
+    bool Next(DecodedInsn *insn, const uint8_t **bytes)
+    {
+        size_t avail = Available();
+        if (avail == 0)
+        {
+            return false;
+        }
+        const uint8_t *p = ring + head % Capacity;
+        DecodeStatus status = decodeInsn(p, avail, insn);
+        insn->offset = (uint32_t)head;
+        *bytes = p;
+        if (status == DecodeStatus::Ok)
+        {
+            head += insn->length;
+            return true;
+        }
 
-        std::printf("failed to read byte\n");
-        std::exit(1);
+        // Keep the bytes the record shows; skipping may refill over them.
+        memcpy(bad, p, std::min(avail, sizeof(bad)));
+        *bytes = bad;
+        uint64_t skip = status == DecodeStatus::Invalid && resync ? resync : UINT64_MAX;
+        uint64_t skipped = 0;
+        while (skipped < skip && Available())
+        {
+            uint64_t n = std::min<uint64_t>(skip - skipped, tail - head);
+            head += n;
+            skipped += n;
+        }
+        markInvalid(insn, status, skipped);
+        badBytes += skipped;
+        return true;
     }
 
-    uint16_t ReadWordLE()
+    ~StreamDecoder()
     {
-        return ReadInt<uint16_t>(Little);
+        std::free(ring);
     }
+};
 
-    int8_t ReadSignedByte()
+// Collects formatted text in one large buffer owned by a single thread and
+// hands it to the kernel in big write(2)/writev(2) calls instead of going
+// through stdio token by token.
+struct OutputSink
+{
+    enum FlushPolicy
     {
-        int8_t buf[1];
-        if (std::fread(buf, sizeof(uint8_t), 1, file) == 1)
-        {
-            return buf[0];
-        }
+        FlushWhenFull,  // write only when the buffer fills or on Flush()
+        FlushEveryInsn, // write after every instruction (interactive output)
+        FlushOnRequest  // grow the buffer and write only on Flush(), in one go
+    };
 
-        if(feof(file)) {
-            exit(0);
-        } 
+    static constexpr size_t DefaultCapacity = 1 << 20;
 
-        std::printf("failed to read byte\n");
-        std::exit(1);
+    int fd;
+    FlushPolicy policy;
+    char *buf;
+    size_t cap;
+    size_t len;
+    size_t limit;  // FlushOnRequest: the most bytes buffered; past it output is dropped
+    bool dropped;  // output passed limit and was thrown away
+    bool failed;   // a write to fd failed
+
+public:
+    OutputSink(int fd, FlushPolicy policy, size_t capacity = DefaultCapacity)
+        : fd(fd), policy(policy), buf(static_cast<char *>(std::malloc(capacity))), cap(capacity), len(0),
+          limit(SIZE_MAX), dropped(false), failed(false)
+    {
+        if (!buf)
+        {
+            std::printf("out of memory\n");
+            std::exit(1);
+        }
     }
 
-    template <typename T>
-    T ReadInt(Endianness e)
+    OutputSink(const OutputSink &) = delete;
+    OutputSink &operator=(const OutputSink &) = delete;
+
+    // Returns room for at least n bytes at the end of the buffer; the
+    // caller fills it and calls Commit with the number of bytes used.
+    char *Reserve(size_t n)
     {
-        uint8_t buf[sizeof(T)];
-        if (std::fread(buf, sizeof(uint8_t), sizeof(T), file) == sizeof(T))
+        if (cap - len < n)
         {
-            if (e == Endianness::Big)
+            if (policy == FlushOnRequest)
             {
-                if (!IsLittleEndian())
-                {
-                    return *(T *)buf;
-                }
-                else
+                if (len + n > limit)
                 {
-                    return Swap(*(T *)buf);
+                    // Only the caller can tell what to send instead.
+                    dropped = true;
+                    len = 0;
                 }
+                Grow(len + n);
             }
             else
             {
-                if (IsLittleEndian())
-                {
-                    return *(T *)buf;
-                }
-                else
-                {
-                    return Swap(*(T *)buf);
-                }
+                Flush();
             }
         }
-        if(feof(file)) {
-            exit(0);
-        } 
-        std::printf("failed to read int\n");
-        std::exit(1);
+        return buf + len;
     }
 
-    void SeekTo(long pos)
+    void Commit(size_t n)
     {
-        assert(!fseek(file, pos, SEEK_SET));
+        len += n;
     }
 
-    void SeekBy(long off)
+    // Marks the end of one instruction's text.
+    void EndInsn()
     {
-        assert(!fseek(file, off, SEEK_CUR));
+        if (policy == FlushEveryInsn)
+        {
+            Flush();
+        }
     }
 
-    ~Reader()
+    void Grow(size_t need)
+    {
+        size_t grown = cap;
+        while (grown < need)
+        {
+            grown *= 2;
+        }
+        if (grown > limit && need <= limit)
+        {
+            grown = limit;
+        }
+        char *p = static_cast<char *>(std::realloc(buf, grown));
+        if (!p)
+        {
+            std::printf("out of memory\n");
+            std::exit(1);
+        }
+        buf = p;
+        cap = grown;
+    }
+
+    void Write(const char *data, size_t n)
+    {
+        if (cap - len >= n || policy == FlushOnRequest)
+        {
+            memcpy(Reserve(n), data, n);
+            len += n;
+            return;
+        }
+        // Too big to buffer: send what we have and the new data together.
+        struct iovec iov[2] = {{buf, len}, {const_cast<char *>(data), n}};
+        WriteAll(iov, 2);
+        len = 0;
+    }
+
+    void Flush()
     {
-        std::fclose(file);
+        if (len)
+        {
+            struct iovec iov = {buf, len};
+            WriteAll(&iov, 1);
+            len = 0;
+        }
     }
-};
 
-enum Instruction
-{
-    AddRegMem,
-    AddAccImm,
-    OrRegMem,
-    OrAccImm,
-    AdcRegMem,
-    AdcAccImm,
-    SbbRegMem,
-    SbbAccImm,
-    AndRegMem,
-    AndAccImm,
-    SubRegMem,
-    SubAccImm,
-    XorRegMem,
-    XorAccImm,
-    CmpRegMem,
-    CmpAccImm,
-    Inc1,
-    Inc2,
-    Dec1,
-    Dec2,
-    Push1,
-    Push2,
-    Pop1,
-    Pop2,
-    J1 = 0b11100,
-    J2,
-    J3,
-    J4,
-    OpImm8,
-    TestXchg,
-    Mov,
-    Mov2,
-    Exchg1,
-    Exchg2,
-    Cbw,
-    FOp,
-    Mov3,
-    String,
-    TestStos,
-    LodsScas,
-    Mov4,
-    Mov5,
-    Mov6,
-    Mov7,
-    Ret,
-    LesLds,
-    Ret2,
-    Int,
-    Bits,
-    Aam,
-    Loop = 56,
-    IoImm,
-    Jmp,
-    IoReg,
-    Rep,
-    Hlt,
-    Clc,
-    Cld
+    void WriteAll(struct iovec *iov, int count)
+    {
+        DISASM_PROFILE_SCOPE(ProfileOutput);
+        while (count)
+        {
+            ssize_t n = writev(fd, iov, count);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                // Nothing sensible to do with a closed pipe or full disk but
+                // stop trying; the exit status is not ours to change here.
+                failed = true;
+                return;
+            }
+            while (count && (size_t)n >= iov->iov_len)
+            {
+                n -= iov->iov_len;
+                iov++;
+                count--;
+            }
+            if (count)
+            {
+                iov->iov_base = static_cast<char *>(iov->iov_base) + n;
+                iov->iov_len -= n;
+            }
+        }
+    }
+
+    ~OutputSink()
+    {
+        Flush();
+        std::free(buf);
+    }
 };
 
-const char *getSegReg(uint8_t s)
+// Linear sweep split across threads. The image is cut into chunks; each
+// worker starts decoding a little before its chunk so it is usually already
+// in step with the real instruction stream when it crosses the boundary.
+// Merging walks the chunks in order: the true stream coming out of the
+// previous chunk picks up the worker's results at the first boundary both
+// agree on (x86 code resynchronises within a few instructions), and any
+// bytes before that are re-decoded serially. The output is identical to a
+// single-threaded sweep.
+//
+// With labels the image is swept twice the same way: the first pass only
+// collects branch targets, the second formats with them.
+template <typename Formatter>
+struct ParallelSweep
 {
-    switch (s & 0b11)
-    {
-    case 0:
-        return "ES";
-        break;
-    case 1:
-        return "CS";
-        break;
-    case 2:
-        return "SS";
-        break;
-    case 3:
-        return "DS";
-        break;
-    }
-    printf("Unreachable seg reg\n");
-    abort();
-}
+    static constexpr size_t ChunkSize = 1 << 20;
+    static constexpr size_t Lookback = 32;
 
-struct InstrDecoder
-{
-    Reader *buffer;
-    char sprintfbuff[50];
+    struct ChunkInsn
+    {
+        uint32_t rel; // offset from the chunk's decode start
+        uint32_t end; // end of its output in Chunk::text (Chunk::targets when scanning)
+    };
+
+    struct Chunk
+    {
+        size_t start; // where decoding began (before the chunk boundary)
+        size_t end;   // chunk boundary; decoding ran past it to an insn end
+        size_t stop;  // where the worker stopped: >= end unless it hit bad bytes
+        std::vector<ChunkInsn> insns;
+        std::vector<char> text;
+        std::vector<uint32_t> targets;
+    };
+
+    const Reader *reader;
+    unsigned jobs;
+    size_t resync;
+    bool withLabels;
+    size_t badBytes;
+    TargetSet labels;
 
 public:
-    InstrDecoder(Reader *reader) : buffer(reader) {}
+    ParallelSweep(const Reader *reader, unsigned jobs, size_t resync, bool withLabels)
+        : reader(reader), jobs(jobs), resync(resync), withLabels(withLabels), badBytes(0) {}
 
-    void printMod(Byte1 *b1, Byte2 *b2)
+    // Decodes and formats from chunk.start until an instruction ends at or
+    // past chunk.end. Stops early, without failing, at bytes that do not
+    // decode; whether they are really reached is decided during the merge.
+    void DecodeChunk(Chunk &chunk, const Formatter &f)
     {
-        if (b2->mod == Mod::RegisterMode)
+        const uint8_t *p = reader->Data();
+        size_t size = reader->Size();
+        DecodedInsn insn;
+        chunk.insns.clear();
+        chunk.text.resize(ChunkSize * 4);
+        size_t used = 0;
+        size_t pos = chunk.start;
+        while (pos < chunk.end && decodeInsn(p + pos, size - pos, &insn) == DecodeStatus::Ok)
         {
-            printf("%s", getRegName(b2->rm, b1->word));
+            insn.offset = pos;
+            if (chunk.text.size() - used < f.Room())
+            {
+                chunk.text.resize(chunk.text.size() * 2);
+            }
+            used += f.Format(insn, chunk.text.data() + used);
+            chunk.insns.push_back(ChunkInsn{uint32_t(pos - chunk.start), uint32_t(used)});
+            pos += insn.length;
         }
-        else if (b2->mod == Mod::Displacement0)
+        chunk.stop = pos;
+    }
+
+    // The first pass over a chunk: instruction lengths and the in-image
+    // targets of relative branches, with the same stopping rule.
+    void ScanChunk(Chunk &chunk)
+    {
+        const uint8_t *p = reader->Data();
+        size_t size = reader->Size();
+        chunk.insns.clear();
+        chunk.targets.clear();
+        size_t pos = chunk.start;
+        DecodeStatus status;
+        long target;
+        size_t len;
+        while (pos < chunk.end && (len = scanInsn(p + pos, size - pos, pos, &target, &status), status == DecodeStatus::Ok))
         {
-            printf("%s", getEAregDisplacement0(b2->rm,
-                                               b2->rm == 6 ? buffer->ReadInt<uint16_t>(Little) : 0, sprintfbuff, 50));
+            if (target >= 0 && (size_t)target < size)
+            {
+                chunk.targets.push_back(target);
+            }
+            chunk.insns.push_back(ChunkInsn{uint32_t(pos - chunk.start), uint32_t(chunk.targets.size())});
+            pos += len;
         }
-        else if (b2->mod == Mod::Displacement8)
+        chunk.stop = pos;
+    }
+
+    // Takes the scan results of chunk from its i-th instruction on.
+    static void TakeLabels(const Chunk &chunk, size_t i, LabelPass &pass)
+    {
+        for (size_t k = i; k < chunk.insns.size(); k++)
         {
-            printf("%s", getEAregDisplacement8(b2->rm, buffer->ReadByte(), sprintfbuff, 50));
+            pass.Start(chunk.start + chunk.insns[k].rel);
         }
-        else if (b2->mod == Mod::Displacement16)
+        for (uint32_t k = i ? chunk.insns[i - 1].end : 0; k < chunk.insns.back().end; k++)
         {
-            printf("%s", getEAregDisplacement8(b2->rm, buffer->ReadInt<uint16_t>(Little), sprintfbuff, 50));
+            pass.Target(chunk.targets[k]);
         }
-        else
+    }
+
+    // Index of the instruction in chunk that starts at offset, or -1.
+    static long Find(const Chunk &chunk, size_t offset)
+    {
+        if (offset < chunk.start)
+        {
+            return -1;
+        }
+        uint32_t rel = offset - chunk.start;
+        auto it = std::lower_bound(chunk.insns.begin(), chunk.insns.end(), rel,
+                                   [](const ChunkInsn &a, uint32_t r) { return a.rel < r; });
+        if (it == chunk.insns.end() || it->rel != rel)
         {
-            printf("unhandled addressing mode\n");
-            abort();
+            return -1;
         }
+        return it - chunk.insns.begin();
     }
 
-    void doStuff() {}
-
-    bool Next()
+    // Takes everything from offset `next` up to the end of chunk, returning
+    // the offset where the following chunk has to pick up. tail(chunk, i)
+    // takes the worker's results from its i-th instruction on; one(insn)
+    // takes an instruction the serial decoder had to fill in.
+    template <typename Tail, typename One>
+    size_t Merge(Chunk &chunk, size_t next, InstrDecoder &serial, Tail &tail, One &one)
     {
+        DecodedInsn insn;
+        while (next < chunk.end)
+        {
+            long i = Find(chunk, next);
+            if (i >= 0)
+            {
+                tail(chunk, i);
+                // If the worker stopped on bytes it could not decode, the
+                // serial decoder picks up there and reports them.
+                next = chunk.stop;
+                continue;
+            }
+            serial.SeekTo(next);
+            serial.Next(&insn);
+            one(insn);
+            next = serial.Tell();
+        }
+        return next;
+    }
 
-        uint8_t byte = buffer->ReadByte();
-        Byte1 *b1 = reinterpret_cast<Byte1 *>(&byte);
-        uint8_t byte2;
-        Byte2 *b2;
-
-        switch (b1->opcode)
+    // One parallel sweep over the image; returns its bad byte count.
+    template <typename Work, typename Tail, typename One>
+    size_t Pass(Work work, Tail tail, One one)
+    {
+        size_t size = reader->Size();
+        std::vector<Chunk> chunks(jobs);
+        // Workers stop at bad bytes, so every Invalid record comes from here.
+        InstrDecoder serial(*reader, resync);
+        size_t next = 0;
+        for (size_t base = 0; base < size; base += ChunkSize * jobs)
         {
-        case Instruction::Cld:
-            byte2 = buffer->ReadByte();
-            b2 = reinterpret_cast<Byte2 *>(&byte2);
-            switch (byte & 0b11)
+            std::vector<std::thread> workers;
+            size_t count = 0;
+            for (unsigned k = 0; k < jobs && base + k * ChunkSize < size; k++, count++)
             {
-            case 0:
-                printf("CLD");
-                break;
-            case 1:
-                printf("STD");
-                break;
-            case 2:
-                switch (b2->reg)
-                {
-                case 0:
-                    printf("INC ");
-                    printMod(b1, b2);
-                    break;
-                case 1:
-                    printf("INC ");
-                    printMod(b1, b2);
-                    break;
-                default:
-                    printf("63 Not used\n");
-                    abort();
-                    break;
-                }
-                break;
-            case 3:
-                switch (b2->reg)
-                {
-                case 0:
-                    printf("INC ");
-                    printMod(b1, b2);
-                    break;
-                case 1:
-                    printf("INC ");
-                    printMod(b1, b2);
-                    break;
-                case 2:
-                case 3:
-                    printf("CALL ");
-                    printMod(b1, b2);
-                    break;
-                case 4:
-                case 5:
-                    printf("JMP ");
-                    printMod(b1, b2);
-                    break;
-                case 6:
-                    printf("PUSH ");
-                    printMod(b1, b2);
-                    break;
-                default:
-                    printf("63 Not used\n");
-                    abort();
-                    break;
-                }
-                break;
+                Chunk &c = chunks[k];
+                size_t boundary = base + k * ChunkSize;
+                c.start = boundary > Lookback ? boundary - Lookback : 0;
+                c.end = std::min(boundary + ChunkSize, size);
+                workers.emplace_back([&work, &c] { work(c); });
             }
-            break;
-        case Instruction::Clc:
-            switch (byte & 0b11)
+            for (std::thread &t : workers)
             {
-            case 0:
-                printf("CLC");
-                break;
-            case 1:
-                printf("STC");
-                break;
-            case 2:
-                printf("CLI");
-                break;
-            case 3:
-                printf("STI");
-                break;
+                t.join();
             }
-            break;
-        case Instruction::Hlt:
-            switch (byte & 0b11)
+            for (size_t k = 0; k < count && next < size; k++)
             {
-            case 0:
-                printf("HLT");
-                break;
-            case 1:
-                printf("CMC");
-                break;
-            case 3:
-                byte2 = buffer->ReadByte();
-                b2 = reinterpret_cast<Byte2 *>(&byte2);
-                switch (b2->reg)
-                {
-                case 0:
-                    printf("TEST ");
-                    printMod(b1, b2);
-                    printf(", %d", buffer->ReadByte());
-                    break;
-                case 1:
-                    printf("HLT Not used\n");
-                    abort();
-                    break;
-                case 2:
-                    printf("NOT word ");
-                    printMod(b1, b2);
-                    break;
-                case 3:
-                    printf("NEG word ");
-                    printMod(b1, b2);
-                    break;
-                case 4:
-                    printf("MUL word ");
-                    printMod(b1, b2);
-                    break;
-                case 5:
-                    printf("IMUL word ");
-                    printMod(b1, b2);
-                    break;
-                case 6:
-                    printf("DIV word ");
-                    printMod(b1, b2);
-                    break;
-                case 7:
-                    printf("IDIV word ");
-                    printMod(b1, b2);
-                    break;
-                }
-                break;
-            case 2:
-                byte2 = buffer->ReadByte();
-                b2 = reinterpret_cast<Byte2 *>(&byte2);
-                switch (b2->reg)
+                if (next < chunks[k].end)
                 {
-                case 0:
-                    printf("TEST ");
-                    printMod(b1, b2);
-                    printf(", %d", buffer->ReadByte());
-                    break;
-                case 1:
-                    printf("HLT Not used\n");
-                    abort();
-                    break;
-                case 2:
-                    printf("NOT byte ");
-                    printMod(b1, b2);
-                    break;
-                case 3:
-                    printf("NEG byte ");
-                    printMod(b1, b2);
-                    break;
-                case 4:
-                    printf("MUL byte ");
-                    printMod(b1, b2);
-                    break;
-                case 5:
-                    printf("IMUL byte ");
-                    printMod(b1, b2);
-                    break;
-                case 6:
-                    printf("DIV byte ");
-                    printMod(b1, b2);
-                    break;
-                case 7:
-                    printf("IDIV byte ");
-                    printMod(b1, b2);
-                    break;
+                    next = Merge(chunks[k], next, serial, tail, one);
                 }
-                break;
-            }
-            break;
-        case Instruction::Rep:
-            switch (byte & 0b11)
-            {
-            case 0:
-                printf("LOCK");
-                break;
-            case 1:
-                printf("REP Not used\n");
-                abort();
-                break;
-            case 2:
-                printf("REPNE");
-                break;
-            case 3:
-                printf("REP");
-                break;
-            }
-            break;
-        case Instruction::IoReg:
-            switch (byte & 0b11)
-            {
-            case 0:
-                printf("IN AL, DX");
-                break;
-            case 1:
-                printf("IN AX, DX");
-                break;
-            case 2:
-                printf("OUT AL, DX");
-                break;
-            case 3:
-                printf("OUT AX, DX");
-                break;
-            }
-            break;
-        case Instruction::Jmp:
-            switch (byte & 0b11)
-            {
-            case 0:
-                printf("CALL %d", buffer->ReadInt<int16_t>(Little));
-                break;
-            case 1:
-                printf("JMP %d", buffer->ReadInt<int16_t>(Little));
-                break;
-            case 2:
-                printf("JMP %d:%d", buffer->ReadInt<int16_t>(Little), buffer->ReadInt<int16_t>(Little));
-                break;
-            case 3:
-                printf("JMP %d", buffer->ReadSignedByte());
-                break;
-            }
-            break;
-        case Instruction::IoImm:
-            switch (byte & 0b11)
-            {
-            case 0:
-                printf("IN AL, %d", buffer->ReadByte());
-                break;
-            case 1:
-                printf("IN AX, %d", buffer->ReadByte());
-                break;
-            case 2:
-                printf("OUT AL, %d", buffer->ReadByte());
-                break;
-            case 3:
-                printf("OUT AX, %d", buffer->ReadByte());
-                break;
             }
-            break;
-        case Instruction::Loop:
-            switch (byte & 0b11)
-            {
-            case 0:
-                printf("LOOPNE %d", buffer->ReadSignedByte());
-                break;
-            case 1:
-                printf("LOOPE %d", buffer->ReadSignedByte());
-                break;
-            case 2:
-                printf("LOOP %d", buffer->ReadSignedByte());
-                break;
-            case 3:
-                printf("JCXZ %d", buffer->ReadSignedByte());
-                break;
-            }
-            break;
-        case Instruction::Aam:
-            switch (byte & 0b11)
-            {
-            case 0:
-                printf("AAM");
-                assert(buffer->ReadByte() == 0b1010);
-                break;
-            case 1:
-                printf("AAD");
-                assert(buffer->ReadByte() == 0b1010);
-                break;
-            case 2:
-                printf("AAD (Not used)");
-                abort();
-                break;
-            case 3:
-                printf("XLAT");
-                break;
-            }
-            break;
-        case Instruction::Bits:
-            byte2 = buffer->ReadByte();
-            b2 = reinterpret_cast<Byte2 *>(&byte2);
-            switch (byte & 0b11)
-            {
-            case 0:
-            case 1:
-                switch (b2->reg)
-                {
-                case 0:
-                    printf("ROL ");
-                    printMod(b1, b2);
-                    printf(", 1");
-                    break;
-                case 1:
-                    printf("ROR ");
-                    printMod(b1, b2);
-                    printf(", 1");
-                    break;
-                case 2:
-                    printf("RCL ");
-                    printMod(b1, b2);
-                    printf(", 1");
-                    break;
-                case 3:
-                    printf("RCR ");
-                    printMod(b1, b2);
-                    printf(", 1");
-                    break;
-                case 4:
-                    printf("SHL ");
-                    printMod(b1, b2);
-                    printf(", 1");
-                    break;
-                case 5:
-                    printf("SHR ");
-                    printMod(b1, b2);
-                    printf(", 1");
-                    break;
-                case 6:
-                    printf("Bits (Unused 7)\n");
-                    abort();
-                    break;
-                case 7:
-                    printf("SAR ");
-                    printMod(b1, b2);
-                    printf(", 1");
-                    break;
-                }
-                break;
-            case 2:
-            case 3:
-                switch (b2->reg)
-                {
-                case 0:
-                    printf("ROL ");
-                    printMod(b1, b2);
-                    printf(", CL");
-                    break;
-                case 1:
-                    printf("ROR ");
-                    printMod(b1, b2);
-                    printf(", CL");
-                    break;
-                case 2:
-                    printf("RCL ");
-                    printMod(b1, b2);
-                    printf(", CL");
-                    break;
-                case 3:
-                    printf("RCR ");
-                    printMod(b1, b2);
-                    printf(", CL");
-                    break;
-                case 4:
-                    printf("SHL ");
-                    printMod(b1, b2);
-                    printf(", CL");
-                    break;
-                case 5:
-                    printf("SHR ");
-                    printMod(b1, b2);
-                    printf(", CL");
-                    break;
-                case 6:
-                    printf("Bits CL (Unused 7)\n");
-                    abort();
-                    break;
-                case 7:
-                    printf("SAR ");
-                    printMod(b1, b2);
-                    printf(", CL");
-                    break;
-                }
-                break;
-            }
-            break;
-        case Instruction::LesLds:
-            byte2 = buffer->ReadByte();
-            b2 = reinterpret_cast<Byte2 *>(&byte2);
-            switch (byte & 0b11)
-            {
-            case 0:
-                printf("LES ");
-                printf("%s, ", getRegNameWset(b2->reg));
-                printMod(b1, b2);
-                break;
-            case 1:
-                printf("LDS ");
-                printf("%s, ", getRegNameWset(b2->reg));
-                printMod(b1, b2);
-                break;
-            case 2:
-                switch (b2->reg)
-                {
-                case 0:
-                    printf("MOV ");
-                    printf("%s, %d", getRegNameWclear(b2->reg), buffer->ReadByte());
-                    break;
-                default:
-                    printf("Mov8 (Unused)\n");
-                    abort;
-                    break;
-                }
-                break;
-            case 3:
-                switch (b2->reg)
-                {
-                case 0:
-                    printf("MOV ");
-                    printf("%s, %d", getRegNameWset(b2->reg), buffer->ReadWordLE());
-                    break;
-                default:
-                    printf("Mov8 (Unused)\n");
-                    abort;
-                    break;
-                }
-                break;
-            }
-            break;
-        case Instruction::Int:
-            switch (byte & 0b11)
-            {
-            case 0:
-                printf("INT 3");
-                break;
-            case 1:
-                printf("INT %d", buffer->ReadByte());
-                break;
-            case 2:
-                printf("INTO");
-                break;
-            case 3:
-                printf("IRET");
-                break;
-            }
-            break;
-        case Instruction::Ret2:
-        case Instruction::Ret:
-            switch (byte & 0b11)
-            {
-            case 0:
-            case 1:
-                printf("RET (Not used)\n");
-                abort();
-                break;
-            case 2:
-                printf("RET %d", buffer->ReadWordLE());
-                break;
-            case 3:
-                printf("RET");
-                break;
-            }
-            break;
-        case Instruction::Mov7:
-            switch (byte & 0b11)
-            {
-            case 0:
-                printf("MOV SP, %d", buffer->ReadWordLE());
-                break;
-            case 1:
-                printf("MOV BP, %d", buffer->ReadWordLE());
-                break;
-            case 2:
-                printf("MOV SI, %d", buffer->ReadWordLE());
-                break;
-            case 3:
-                printf("MOV DI, %d", buffer->ReadWordLE());
-                break;
-            }
-            break;
-        case Instruction::Mov6:
-            switch (byte & 0b11)
-            {
-            case 0:
-                printf("MOV AX, %d", buffer->ReadWordLE());
-                break;
-            case 1:
-                printf("MOV CX, %d", buffer->ReadWordLE());
-                break;
-            case 2:
-                printf("MOV DX, %d", buffer->ReadWordLE());
-                break;
-            case 3:
-                printf("MOV BX, %d", buffer->ReadWordLE());
-                break;
-            }
-            break;
-        case Instruction::Mov5:
-            switch (byte & 0b11)
-            {
-            case 0:
-                printf("MOV AH, %d", buffer->ReadByte());
-                break;
-            case 1:
-                printf("MOV CH, %d", buffer->ReadByte());
-                break;
-            case 2:
-                printf("MOV DH, %d", buffer->ReadByte());
-                break;
-            case 3:
-                printf("MOV BH, %d", buffer->ReadByte());
-                break;
-            }
-            break;
-        case Instruction::Mov4:
-            switch (byte & 0b11)
-            {
-            case 0:
-                printf("MOV AL, %d", buffer->ReadByte());
-                break;
-            case 1:
-                printf("MOV CL, %d", buffer->ReadByte());
-                break;
-            case 2:
-                printf("MOV DL, %d", buffer->ReadByte());
-                break;
-            case 3:
-                printf("MOV BL, %d", buffer->ReadByte());
-                break;
-            }
-            break;
-        case Instruction::LodsScas:
-            switch (byte & 0b11)
-            {
-            case 0:
-                printf("LODS byte");
-                break;
-            case 1:
-                printf("LODS word");
-                break;
-            case 2:
-                printf("SCARS byte");
-                break;
-            case 3:
-                printf("SCARS word");
-                break;
-            }
-            break;
-        case Instruction::TestStos:
-            switch (byte & 0b11)
-            {
-            case 0:
-                printf("TEST AL, %d", buffer->ReadByte());
-                break;
-            case 1:
-                printf("TEST AX, %d", buffer->ReadInt<uint16_t>(Little));
-                break;
-            case 2:
-                printf("STOS byte");
-                break;
-            case 3:
-                printf("STOS word");
-                break;
-            }
-            break;
-        case Instruction::String:
-            switch (byte & 0b11)
-            {
-            case 0:
-                printf("MOVS byte");
-                break;
-            case 1:
-                printf("MOVS word");
-                break;
-            case 2:
-                printf("CMPS byte");
-                break;
-            case 3:
-                printf("CMPS word");
-                break;
-            }
-            break;
-        case Mov3:
-            switch (byte & 0b11)
-            {
-            case 0:
-                printf("MOV AL, [%d]", buffer->ReadInt<uint16_t>(Little));
-                break;
-            case 1:
-                printf("MOV AX, [%d]", buffer->ReadInt<uint16_t>(Little));
-                break;
-            case 2:
-                printf("MOV [%d], AL", buffer->ReadInt<uint16_t>(Little));
-                break;
-            case 3:
-                printf("MOV [%d], AX", buffer->ReadInt<uint16_t>(Little));
-                break;
-            }
-            break;
-        case Instruction::FOp:
-            switch (byte & 0b11)
-            {
-            case 0:
-                printf("PUSHF");
-                break;
-            case 1:
-                printf("POPF");
-                break;
-            case 2:
-                printf("SAHF");
-                break;
-            case 3:
-                printf("LAHF");
-                break;
-            }
-            break;
-        case Instruction::Cbw:
-            switch (byte & 0b11)
-            {
-            case 0:
-                printf("CBW");
-                break;
-            case 1:
-                printf("CWD");
-                break;
-            case 2:
-                printf("CALL disp[%d] seg[%d]", buffer->ReadInt<int16_t>(Little), buffer->ReadInt<int16_t>(Little));
-                break;
-            case 3:
-                printf("WAIT");
-                break;
-            }
-            break;
-        case Instruction::Exchg2:
-            switch (byte & 0b11)
-            {
-            case 0:
-                printf("XCHG AX, SP");
-                break;
-            case 1:
-                printf("XCHG AX, BP");
-                break;
-            case 2:
-                printf("XCHG AX, SI");
-                break;
-            case 3:
-                printf("XCHG AX, DI");
-                break;
-            }
-            break;
-        case Instruction::Exchg1:
-            switch (byte & 0b11)
-            {
-            case 0:
-                printf("NOP");
-                break;
-            case 1:
-                printf("XCHG AX, CX");
-                break;
-            case 2:
-                printf("XCHG AX, DX");
-                break;
-            case 3:
-                printf("XCHG AX, BX");
-                break;
-            }
-            break;
-        case Instruction::Mov2:
-            byte2 = buffer->ReadByte();
-            b2 = reinterpret_cast<Byte2 *>(&byte2);
-            switch (byte & 0b11)
-            {
-            case 0:
-                if (b2->reg & 0b100)
-                {
-                    printf("MOV segreg (not used)\n");
-                    abort();
-                }
-                else
-                {
-                    printf("MOV ");
-                    b1->word = 1;
-                    printMod(b1, b2);
-                    printf(", %s", getSegReg(b2->reg));
-                }
-                break;
-            case 1:
-                printf("LEA %s, ", getRegNameWset(b2->reg));
-                printMod(b1, b2);
-                break;
-            case 2:
-                if (b2->reg & 0b100)
-                {
-                    printf("MOV segreg -> rg (not used)\n");
-                    abort();
-                }
-                else
-                {
-                    printf("MOV ");
-                    b1->word = 1;
-                    printf("%s, ", getSegReg(b2->reg));
-                    printMod(b1, b2);
-                }
-                break;
-            case 3:
-                switch (b2->reg)
-                {
-                case 0:
-                    printf("POP ");
-                    printMod(b1, b2);
-                    break;
-                default:
-                    printf("MOV2 (Not used)");
-                    abort();
-                }
-                break;
-            default:
-                printf("unhandled mov2\n");
-                abort();
-            }
-            break;
-        case Instruction::Mov:
-            printf("MOV ");
-            byte2 = buffer->ReadByte();
-            b2 = reinterpret_cast<Byte2 *>(&byte2);
-            if (b1->reg_is_dest)
-            {
-                printf("%s, ", b1->word ? getRegNameWset(b2->reg) : getRegNameWclear(b2->reg));
-                printMod(b1, b2);
-            }
-            else
-            {
-                printMod(b1, b2);
-                printf(", %s", b1->word ? getRegNameWset(b2->reg) : getRegNameWclear(b2->reg));
-            }
-            break;
-        case Instruction::TestXchg:
-            printf("TEST ");
-            byte2 = buffer->ReadByte();
-            b2 = reinterpret_cast<Byte2 *>(&byte2);
-            printMod(b1, b2);
-            if (b1->word)
-            {
-                printf(", %s", getRegNameWset(b2->reg));
-            }
-            else
-            {
-                printf(", %s", getRegNameWclear(b2->reg));
-            }
-            break;
-        case Instruction::OpImm8:
-            byte2 = buffer->ReadByte();
-            b2 = reinterpret_cast<Byte2 *>(&byte2);
+        }
+        return serial.badBytes;
+    }
 
-            switch (byte & 0b11)
-            {
-            case 0:
-                switch (b2->reg)
-                {
-                case 0:
-                    printf("ADD ");
-                    break;
-                case 1:
-                    printf("OR ");
-                    break;
-                case 2:
-                    printf("ADC ");
-                    break;
-                case 3:
-                    printf("SBB ");
-                    break;
-                case 4:
-                    printf("AND ");
-                    break;
-                case 5:
-                    printf("SUB ");
-                    break;
-                case 6:
-                    printf("XOR ");
-                    break;
-                case 7:
-                    printf("CMP ");
-                    break;
-                default:
-                    printf("Invalid immediate instr: %d\n", b2->reg);
-                    abort();
-                    break;
-                }
-                printMod(b1, b2);
-                printf("%d, ", buffer->ReadByte());
-                break;
-            case 1:
-                switch (b2->reg)
-                {
-                case 0:
-                    printf("ADD ");
-                    break;
-                case 1:
-                    printf("OR ");
-                    break;
-                case 2:
-                    printf("ADC ");
-                    break;
-                case 3:
-                    printf("SBB ");
-                    break;
-                case 4:
-                    printf("AND ");
-                    break;
-                case 5:
-                    printf("SUB ");
-                    break;
-                case 6:
-                    printf("XOR ");
-                    break;
-                case 7:
-                    printf("CMP ");
-                    break;
-                default:
-                    printf("Invalid immediate instr: %d\n", b2->reg);
-                    abort();
-                    break;
-                }
-                printMod(b1, b2);
-                printf(", %d", buffer->ReadInt<uint16_t>(Big));
-                break;
-            case 2:
-                switch (b2->reg)
-                {
-                case 0:
-                    printf("ADD ");
-                    break;
-                case 1:
-                    printf("OR (Not Used)");
-                    abort();
-                    break;
-                case 2:
-                    printf("ADC ");
-                    break;
-                case 3:
-                    printf("SBB ");
-                    break;
-                case 4:
-                    printf("AND  (Not used)");
-                    abort();
-                    break;
-                case 5:
-                    printf("SUB ");
-                    break;
-                case 6:
-                    printf("XOR (Not used)");
-                    abort();
-                    break;
-                case 7:
-                    printf("CMP ");
-                    break;
-                default:
-                    printf("Invalid immediate instr: %d\n", b2->reg);
-                    abort();
-                    break;
-                }
-                printMod(b1, b2);
-                printf(", %d", buffer->ReadByte());
-                break;
-            case 3:
-                switch (b2->reg)
-                {
-                case 0:
-                    printf("ADD ");
-                    break;
-                case 1:
-                    printf("OR (Not Used)");
-                    abort();
-                    break;
-                case 2:
-                    printf("ADC ");
-                    break;
-                case 3:
-                    printf("SBB ");
-                    break;
-                case 4:
-                    printf("AND  (Not used)");
-                    abort();
-                    break;
-                case 5:
-                    printf("SUB ");
-                    break;
-                case 6:
-                    printf("XOR (Not used)");
-                    abort();
-                    break;
-                case 7:
-                    printf("CMP ");
-                    break;
-                default:
-                    printf("Invalid immediate instr: %d\n", b2->reg);
-                    abort();
-                    break;
-                }
-                printMod(b1, b2);
-                printf(", %d", buffer->ReadByte());
-                break;
-            default:
-                printf("unhandled imm: %d\n", b2->reg);
-                abort();
-            }
-            break;
-        case Instruction::J4:
-            switch (byte & 0b11)
-            {
-            case 0:
-                printf("JL %d", (int8_t)buffer->ReadByte());
-                break;
-            case 1:
-                printf("JNL %d", (int8_t)buffer->ReadByte());
-                break;
-            case 2:
-                printf("JLE %d", (int8_t)buffer->ReadByte());
-                break;
-            case 3:
-                printf("JNLE %d", (int8_t)buffer->ReadByte());
-                break;
-            }
-            break;
-        case Instruction::J3:
-            switch (byte & 0b11)
-            {
-            case 0:
-                printf("JS %d", (int8_t)buffer->ReadByte());
-                break;
-            case 1:
-                printf("JNS %d", (int8_t)buffer->ReadByte());
-                break;
-            case 2:
-                printf("JP %d", (int8_t)buffer->ReadByte());
-                break;
-            case 3:
-                printf("JNP %d", (int8_t)buffer->ReadByte());
-                break;
-            }
-            break;
-        case Instruction::J2:
-            switch (byte & 0b11)
-            {
-            case 0:
-                printf("JE %d", (int8_t)buffer->ReadByte());
-                break;
-            case 1:
-                printf("JNE %d", (int8_t)buffer->ReadByte());
-                break;
-            case 2:
-                printf("JBE %d", (int8_t)buffer->ReadByte());
-                break;
-            case 3:
-                printf("JNBE %d", (int8_t)buffer->ReadByte());
-                break;
-            }
-            break;
-        case Instruction::J1:
-            switch (byte & 0b11)
-            {
-            case 0:
-                printf("JO %d", (int8_t)buffer->ReadByte());
-                break;
-            case 1:
-                printf("JNO %d", (int8_t)buffer->ReadByte());
-                break;
-            case 2:
-                printf("JB %d", (int8_t)buffer->ReadByte());
-                break;
-            case 3:
-                printf("JNB %d", (int8_t)buffer->ReadByte());
-                break;
-            }
-            break;
-        case Instruction::Pop1:
-            switch (byte & 0b11)
-            {
-            case 0:
-                printf("POP AX");
-                break;
-            case 1:
-                printf("POP CX");
-                break;
-            case 2:
-                printf("POP DX");
-                break;
-            case 3:
-                printf("POP BX");
-                break;
-            default:
-                printf("POP unexpected\n");
-                abort();
-            }
-            break;
-        case Instruction::Pop2:
-            switch (byte & 0b11)
-            {
-            case 0:
-                printf("POP SP");
-                break;
-            case 1:
-                printf("POP BP");
-                break;
-            case 2:
-                printf("POP SI");
-                break;
-            case 3:
-                printf("POP DI");
-                break;
-            default:
-                printf("POP unexpected\n");
-                abort();
-            }
-            break;
-        case Instruction::Push1:
-            switch (byte & 0b11)
-            {
-            case 0:
-                printf("PUSH AX");
-                break;
-            case 1:
-                printf("PUSH CX");
-                break;
-            case 2:
-                printf("PUSH DX");
-                break;
-            case 3:
-                printf("PUSH BX");
-                break;
-            default:
-                printf("PUSH unexpected\n");
-                abort();
-            }
-            break;
-        case Instruction::Push2:
-            switch (byte & 0b11)
-            {
-            case 0:
-                printf("PUSH SP");
-                break;
-            case 1:
-                printf("PUSH BP");
-                break;
-            case 2:
-                printf("PUSH SI");
-                break;
-            case 3:
-                printf("PUSH DI");
-                break;
-            default:
-                printf("PUSH unexpected\n");
-                abort();
-            }
-            break;
-        case Instruction::Dec1:
-            switch (byte & 0b11)
-            {
-            case 0:
-                printf("DEC AX");
-                break;
-            case 1:
-                printf("DEC CX");
-                break;
-            case 2:
-                printf("DEC DX");
-                break;
-            case 3:
-                printf("DEC BX");
-                break;
-            default:
-                printf("DEC unexpected\n");
-                abort();
-            }
-            break;
-        case Instruction::Dec2:
-            switch (byte & 0b11)
-            {
-            case 0:
-                printf("DEC SP");
-                break;
-            case 1:
-                printf("DEC BP");
-                break;
-            case 2:
-                printf("DEC SI");
-                break;
-            case 3:
-                printf("DEC DI");
-                break;
-            default:
-                printf("DEC unexpected\n");
-                abort();
-            }
-            break;
-        case Instruction::Inc1:
-            switch (byte & 0b11)
-            {
-            case 0:
-                printf("INC AX");
-                break;
-            case 1:
-                printf("INC CX");
-                break;
-            case 2:
-                printf("INC DX");
-                break;
-            case 3:
-                printf("INC BX");
-                break;
-            default:
-                printf("INC unexpected\n");
-                abort();
-            }
-            break;
-        case Instruction::Inc2:
-            switch (byte & 0b11)
+    void Run(OutputSink &out)
+    {
+        size_t size = reader->Size();
+        Formatter f;
+        f.origin = reader->origin;
+        if (withLabels)
+        {
+            LabelPass pass(0, size);
+            Pass([this](Chunk &c) { ScanChunk(c); },
+                 [&pass](Chunk &c, size_t i) { TakeLabels(c, i, pass); },
+                 [&pass](const DecodedInsn &insn) { pass.Add(insn); });
+            pass.Finish(labels);
+            f.labels = &labels;
+        }
+        badBytes = Pass([this, &f](Chunk &c) { DecodeChunk(c, f); },
+                        [&out](Chunk &c, size_t i)
+                        {
+                            uint32_t from = i ? c.insns[i - 1].end : 0;
+                            out.Write(c.text.data() + from, c.insns.back().end - from);
+                        },
+                        [this, &f, &out](const DecodedInsn &insn)
+                        {
+                            out.Commit(f.Format(insn, out.Reserve(f.Room()), reader->Data() + insn.offset));
+                        });
+    }
+};
+
+// Labels the branch targets among insns, the whole listing of an image.
+static void collectLabels(const std::vector<DecodedInsn> &insns, size_t size, TargetSet &labels)
+{
+    LabelPass pass(0, size);
+    for (const DecodedInsn &insn : insns)
+    {
+        pass.Add(insn);
+    }
+    pass.Finish(labels);
+}
+
+// Prints the instructions reachable from the entry points in offset order,
+// with a comment line standing in for each run of bytes never reached and
+// one before each instruction that starts inside the one above.
+template <typename Formatter>
+static void printRecursive(Reader &r, const std::vector<long> &entries, bool withLabels, OutputSink &out)
+{
+    RecursiveTraversal t(r.Data(), r.Size());
+    t.relocs = r.relocs;
+    for (long e : entries)
+    {
+        t.AddEntry(e);
+    }
+    t.Run();
+
+    Formatter f;
+    f.origin = r.origin;
+    TargetSet labels;
+    if (withLabels)
+    {
+        collectLabels(t.insns, r.Size(), labels);
+        f.labels = &labels;
+    }
+    size_t pos = 0;
+    for (const DecodedInsn &insn : t.insns)
+    {
+        if (insn.offset > pos)
+        {
+            char *line = out.Reserve(48);
+            out.Commit(snprintf(line, 48, "%s%zu bytes of data\n", Formatter::Policy::lineComment, insn.offset - pos));
+        }
+        else if (insn.offset < pos)
+        {
+            char *line = out.Reserve(48);
+            out.Commit(snprintf(line, 48, "%soverlaps the last %zu bytes above\n", Formatter::Policy::lineComment,
+                                pos - insn.offset));
+        }
+        out.Commit(f.Format(insn, out.Reserve(f.Room())));
+        out.EndInsn();
+        pos = std::max(pos, (size_t)insn.offset + insn.length);
+    }
+    if (pos < r.Size())
+    {
+        char *line = out.Reserve(48);
+        out.Commit(snprintf(line, 48, "%s%zu bytes of data\n", Formatter::Policy::lineComment, r.Size() - pos));
+    }
+}
+
+// Prints the basic blocks of the code reachable from the entry points,
+// each headed by its offset range and successor blocks.
+template <typename Formatter>
+static void printBlocks(Reader &r, const std::vector<long> &entries, bool withLabels, OutputSink &out)
+{
+    RecursiveTraversal t(r.Data(), r.Size());
+    t.relocs = r.relocs;
+    for (long e : entries)
+    {
+        t.AddEntry(e);
+    }
+    t.Run();
+    BlockStore store(std::move(t.insns));
+
+    Formatter f;
+    f.origin = r.origin;
+    TargetSet labels;
+    if (withLabels)
+    {
+        collectLabels(store.insns, r.Size(), labels);
+        f.labels = &labels;
+    }
+    for (size_t i = 0; i < store.blocks.size(); i++)
+    {
+        const BasicBlock &b = store.blocks[i];
+        char *line = out.Reserve(96);
+        int n = snprintf(line, 96, "%sblock %zu [%u, %u) ->", Formatter::Policy::lineComment, i, b.start, b.end);
+        for (int32_t s : b.succ)
+        {
+            if (s >= 0)
             {
-            case 0:
-                printf("INC SP");
-                break;
-            case 1:
-                printf("INC BP");
-                break;
-            case 2:
-                printf("INC SI");
-                break;
-            case 3:
-                printf("INC DI");
-                break;
-            default:
-                printf("INC unexpected\n");
-                abort();
+                n += snprintf(line + n, 96 - n, " %d", s);
             }
-            break;
-        case Instruction::CmpRegMem:
-            printf("CMP ");
+        }
+        line[n++] = '\n';
+        out.Commit(n);
+        for (uint32_t k = 0; k < b.insnCount; k++)
+        {
+            const DecodedInsn &insn = store.insns[b.firstInsn + k];
+            out.Commit(f.Format(insn, out.Reserve(f.Room())));
+        }
+        out.EndInsn();
+    }
+}
+
+// Prints "offset length" for each instruction without decoding operands.
+// Bytes that do not decode are skipped the same way the full decoder skips
+// them and marked "(bad)". Returns the number of bad bytes.
+static size_t printLengths(Reader &r, size_t resync, OutputSink &out)
+{
+    const uint8_t *p = r.Data();
+    size_t size = r.Size();
+    size_t pos = 0;
+    size_t bad = 0;
+    while (pos < size)
+    {
+        DecodeStatus status;
+        size_t len = insnLength(p + pos, size - pos, &status);
+        const char *mark = "";
+        if (status != DecodeStatus::Ok)
+        {
+            len = status == DecodeStatus::Invalid && resync ? std::min(resync, size - pos) : size - pos;
+            bad += len;
+            mark = " (bad)";
+        }
+        char *line = out.Reserve(64);
+        out.Commit(snprintf(line, 64, "%zu %zu%s\n", pos, len, mark));
+        out.EndInsn();
+        pos += len;
+    }
+    return bad;
+}
+
+// Sparse side index of instruction boundaries: the start offset of every
+// step-th instruction of a linear sweep. Decoding from the nearest bound
+// gives the same instructions as a sweep from the start, so --at/--range
+// only decode the window they print. Saved next to the input as an IR file
+// with a Source and a Bounds section.
+struct BoundaryIndex
+{
+    uint32_t step;
+    size_t resync;
+    IrLoad load; // which module of the input the offsets are in
+    size_t seen; // instructions passed to Add
+    std::vector<uint32_t> bounds;
+
+public:
+    BoundaryIndex(uint32_t step, size_t resync, const IrLoad &load)
+        : step(std::max(step, 1u)), resync(resync), load(load), seen(0) {}
+
+    void Add(uint32_t offset)
+    {
+        if (seen++ % step == 0)
+        {
+            bounds.push_back(offset);
+        }
+    }
+
+    // Start of the last indexed instruction at or before offset.
+    size_t StartFor(size_t offset) const
+    {
+        auto it = std::upper_bound(bounds.begin(), bounds.end(), offset);
+        return it == bounds.begin() ? 0 : *(it - 1);
+    }
+
+    static IrSource SourceOf(const struct stat &st, uint32_t step, size_t resync)
+    {
+        return IrSource{(uint64_t)st.st_size, (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec, step, (uint32_t)resync};
+    }
+
+    // Loads the index at path if it was built from this input, loaded the
+    // same way, with the same settings; returns false if it is missing,
+    // unreadable or stale.
+    bool Load(const std::string &path, const struct stat &input)
+    {
+        IrFile ir(path.c_str());
+        IrSource want = SourceOf(input, step, resync);
+        const IrSource *have = ir.Error() ? nullptr : ir.Source();
+        const IrLoad *haveLoad = ir.Error() ? nullptr : ir.Load();
+        if (!have || memcmp(have, &want, sizeof(want)) || !haveLoad || memcmp(haveLoad, &load, sizeof(load)))
+        {
+            return false;
+        }
+        size_t n;
+        const uint32_t *b = ir.Bounds(&n);
+        bounds.assign(b, b + n);
+        return true;
+    }
+
+    bool Save(const std::string &path, const struct stat &input) const
+    {
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+        {
+            return false;
+        }
+        IrWriter w(fd);
+        IrSource src = SourceOf(input, step, resync);
+        w.Begin(IrSectionSource, sizeof(src));
+        w.Write(&src, sizeof(src));
+        w.End();
+        w.Begin(IrSectionLoad, sizeof(load));
+        w.Write(&load, sizeof(load));
+        w.End();
+        w.Begin(IrSectionBounds, sizeof(uint32_t));
+        w.Write(bounds.data(), bounds.size() * sizeof(uint32_t));
+        w.End();
+        bool ok = w.Close();
+        return close(fd) == 0 && ok;
+    }
+};
+
+struct Options
+{
+    bool lengths = false;
+    bool recursive = false;
+    bool blocks = false;
+    unsigned jobs = 1;
+    size_t resync = 1;
+    std::vector<long> entries;
+    bool bench = false;
+    const char *corpusPath = nullptr;
+    uint64_t seed = 1;
+    size_t benchSize = 4 << 20;
+    const char *outDir = nullptr; // batch mode: one .asm file per input here
+    const char *irOut = nullptr;  // write the IR file here instead of text
+    const char *irIn = nullptr;   // print the text of this IR file
+    bool index = false;           // save a BoundaryIndex next to the input
+    uint32_t indexStep = 64;
+    bool range = false;           // print only [rangeStart, rangeEnd)
+    size_t rangeStart = 0;
+    size_t rangeEnd = 0;
+    Syntax syntax = Syntax::Intel;
+    bool labels = true;           // two passes: label branch targets
+    bool profile = false;         // phase times to stderr (DISASM_PROFILE builds)
+    bool stats = false;           // instruction statistics instead of a listing
+    bool json = false;            // ... as JSON
+    bool emulate = false;         // run the image instead of listing it
+    uint64_t maxSteps = 0;        // emulation step budget, 0: none
+    unsigned stress = 0;          // threads listing one image at once, 0: off
+    ImageFormat format = ImageFormat::Auto;
+    bool xref = false;            // list what references xrefTarget instead
+    uint32_t xrefTarget = 0;
+    const char *servePath = nullptr; // --serve: answer requests on this socket
+};
+
+// Calls f with a default-constructed formatter for the selected syntax.
+// Everything below f is instantiated once per syntax.
+template <typename F>
+static auto withSyntax(Syntax syntax, F f)
+{
+    switch (syntax)
+    {
+    case Syntax::Nasm:
+        return f(NasmFormatter());
+    case Syntax::Att:
+        return f(AttFormatter());
+    default:
+        return f(InsnFormatter());
+    }
+}
+
+static const char *preamble(Syntax syntax)
+{
+    return withSyntax(syntax, [](auto f) { return f.Preamble(); });
+}
+
+// The load image of file as opt.format asks, the format picked from its
+// signature and path unless given. Warns about the tail of a .COM that
+// does not fit its segment, which no mode will see.
+static LoadImage loadFile(const Reader &file, const char *path, const Options &opt)
+{
+    LoadImage image(file.Data(), file.Size(), imageFormatOf(opt.format, path, file.Data(), file.Size()));
+    if (image.cutOff)
+    {
+        fprintf(stderr, "%s: .COM image is %zu bytes, only the first %zu load; the last %zu are ignored "
+                "(--format raw lists them)\n", path, file.Size(), image.size, image.cutOff);
+    }
+    return image;
+}
+
+// What an IR file keeps of image.
+static IrLoad irLoadOf(const LoadImage &image)
+{
+    return IrLoad{(uint8_t)image.format, 0, image.origin, image.cs, image.ip, image.ss, image.sp,
+                  (uint32_t)image.fileOffset, (uint32_t)image.relocs.size()};
+}
+
+// A comment line at the top of the listing of a .COM or .EXE: where its
+// load module (size bytes) sits in the file and where it starts, as
+// segment:offset relative to the load segment, after the syntax's line
+// comment. Raw images get none.
+static void writeImageNote(const IrLoad &load, size_t size, const char *comment, OutputSink &out)
+{
+    char *line = out.Reserve(160);
+    if (load.format == (uint8_t)ImageFormat::Com)
+    {
+        out.Commit(snprintf(line, 160, "%scom: %zu bytes at 0000:%04X\n", comment, size, load.origin));
+    }
+    else if (load.format == (uint8_t)ImageFormat::Mz)
+    {
+        out.Commit(snprintf(line, 160, "%smz: %zu bytes at file offset %u, entry %04X:%04X, stack %04X:%04X, %u relocation%s\n",
+                            comment, size, load.fileOffset, load.cs, load.ip, load.ss, load.sp,
+                            load.relocCount, load.relocCount == 1 ? "" : "s"));
+    }
+}
+
+static void writeImageNote(const LoadImage &image, Syntax syntax, OutputSink &out)
+{
+    const char *comment = withSyntax(syntax, [](auto f) { return decltype(f)::Policy::lineComment; });
+    writeImageNote(irLoadOf(image), image.size, comment, out);
+}
+
+// First pass of a labelled sweep from start that lists the instructions
+// overlapping [from, to): labels their branch targets inside the listing.
+// Only lengths are decoded; bad bytes are skipped as InstrDecoder does.
+static void collectLabels(const Reader &r, size_t start, size_t from, size_t to, size_t resync, TargetSet &labels)
+{
+    const uint8_t *p = r.Data();
+    size_t size = r.Size();
+    LabelPass pass(0, 0);
+    bool listing = false;
+    for (size_t pos = start; pos < std::min(size, to);)
+    {
+        DecodeStatus status;
+        long target;
+        size_t len = scanInsn(p + pos, size - pos, pos, &target, &status);
+        if (status != DecodeStatus::Ok)
+        {
+            len = status == DecodeStatus::Invalid && resync ? std::min(resync, size - pos) : size - pos;
+        }
+        if (!listing && pos + len > from)
+        {
+            // The first listed instruction may start before from.
+            pass = LabelPass(pos, to);
+            listing = true;
+        }
+        if (listing)
+        {
+            pass.Start(pos);
+            pass.Target(target);
+        }
+        pos += len;
+    }
+    pass.Finish(labels);
+}
+
+// Disassembles one image in the mode the options select and returns the
+// number of bytes that did not decode. If index is given the sweep is
+// serial and records its instruction boundaries there.
+template <typename Formatter>
+static size_t disassembleWith(Reader &r, const Options &opt, OutputSink &out, BoundaryIndex *index, Formatter f)
+{
+    f.origin = r.origin;
+    if (opt.recursive || opt.blocks)
+    {
+        std::vector<long> entries = opt.entries;
+        if (entries.empty())
+        {
+            entries.push_back(r.entry);
+        }
+        if (opt.blocks)
+        {
+            printBlocks<Formatter>(r, entries, opt.labels, out);
+        }
+        else
+        {
+            printRecursive<Formatter>(r, entries, opt.labels, out);
+        }
+        return 0;
+    }
+    if (opt.jobs > 1 && !index)
+    {
+        ParallelSweep<Formatter> sweep(&r, opt.jobs, opt.resync, opt.labels);
+        sweep.Run(out);
+        return sweep.badBytes;
+    }
+
+    TargetSet labels;
+    if (opt.labels)
+    {
+        collectLabels(r, 0, 0, r.Size(), opt.resync, labels);
+        f.labels = &labels;
+    }
+    InstrDecoder d(r, opt.resync);
+    DecodedInsn insn;
+    while (d.Next(&insn))
+    {
+        if (index)
+        {
+            index->Add(insn.offset);
+        }
+        out.Commit(f.Format(insn, out.Reserve(f.Room()), r.Data() + insn.offset));
+        out.EndInsn();
+    }
+    return d.badBytes;
+}
+
+static size_t disassemble(Reader &r, const Options &opt, OutputSink &out, BoundaryIndex *index = nullptr)
+{
+    if (opt.lengths)
+    {
+        return printLengths(r, opt.resync, out);
+    }
+    return withSyntax(opt.syntax, [&](auto f) { return disassembleWith(r, opt, out, index, f); });
+}
+
+// Prints the instructions of the linear sweep that overlap [start, end),
+// decoding from the nearest indexed boundary instead of from offset 0.
+template <typename Formatter>
+static size_t printRange(Reader &r, const Options &opt, const BoundaryIndex &index, OutputSink &out, Formatter f)
+{
+    size_t start = index.StartFor(opt.rangeStart);
+    f.origin = r.origin;
+    TargetSet labels;
+    if (opt.labels)
+    {
+        collectLabels(r, start, opt.rangeStart, opt.rangeEnd, opt.resync, labels);
+        f.labels = &labels;
+    }
+    InstrDecoder d(r, opt.resync, start);
+    DecodedInsn insn;
+    while (d.Next(&insn) && insn.offset < opt.rangeEnd)
+    {
+        if (insn.offset + insn.length > opt.rangeStart)
+        {
+            out.Commit(f.Format(insn, out.Reserve(f.Room()), r.Data() + insn.offset));
+            out.EndInsn();
+        }
+    }
+    return d.badBytes;
+}
+
+// --index and --range/--at for the module of one input file. Uses
+// path.idx when it is fresh, and with --index rebuilds and saves it when it
+// is not.
+static size_t disassembleIndexed(Reader &r, const LoadImage &image, const char *path, const Options &opt,
+                                 OutputSink &out)
+{
+    std::string idxPath = std::string(path) + ".idx";
+    struct stat st;
+    bool haveStat = strcmp(path, "-") && stat(path, &st) == 0;
+    BoundaryIndex index(opt.indexStep, opt.resync, irLoadOf(image));
+    bool loaded = haveStat && index.Load(idxPath, st);
 
-            byte2 = buffer->ReadByte();
-            b2 = reinterpret_cast<Byte2 *>(&byte2);
-            if (b1->reg_is_dest)
+    size_t bad = 0;
+    if (opt.index && !loaded)
+    {
+        if (opt.range)
+        {
+            // Only the window is printed; the index still needs every insn.
+            InstrDecoder d(r, opt.resync);
+            DecodedInsn insn;
+            while (d.Next(&insn))
             {
-                printf("%s, ", getRegName(b2->reg, b1->word));
-                // reg field is the destination register
-                printMod(b1, b2);
+                index.Add(insn.offset);
             }
-            else
+        }
+        else
+        {
+            bad = disassemble(r, opt, out, &index);
+        }
+        if (haveStat && !index.Save(idxPath, st))
+        {
+            fprintf(stderr, "%s: %s\n", idxPath.c_str(), strerror(errno));
+        }
+    }
+    else if (!opt.range)
+    {
+        return disassemble(r, opt, out);
+    }
+    if (opt.range)
+    {
+        bad = withSyntax(opt.syntax, [&](auto f) { return printRange(r, opt, index, out, f); });
+    }
+    return bad;
+}
+
+
+// Linear sweep over a stream read from fd in constant memory. Returns the
+// number of bytes that did not decode. There is no second pass over a
+// stream, so it is listed without labels.
+template <typename Formatter>
+static size_t disassembleStream(StreamDecoder &d, OutputSink &out, const char **error, Formatter f)
+{
+    DecodedInsn insn;
+    const uint8_t *bytes;
+    while (d.Next(&insn, &bytes))
+    {
+        out.Commit(f.Format(insn, out.Reserve(f.Room()), bytes));
+        out.EndInsn();
+    }
+    *error = d.Error();
+    return d.badBytes;
+}
+
+// Writes the instructions the sweep (or, with --recursive, the traversal)
+// finds to w, with the mnemonic names, the image, where it loads and the
+// cross-references alongside. Returns the number of bad bytes; w is left
+// open.
+static size_t writeIr(IrWriter &w, const Reader &r, const IrLoad &load, const Options &opt)
+{
+    XrefIndex xrefs;
+    xrefs.relocs = r.relocs;
+    size_t bad = 0;
+    w.Begin(IrSectionInsns, sizeof(IrRecord));
+    if (opt.recursive)
+    {
+        RecursiveTraversal t(r.Data(), r.Size());
+        t.relocs = r.relocs;
+        for (long e : opt.entries)
+        {
+            t.AddEntry(e);
+        }
+        if (opt.entries.empty())
+        {
+            t.AddEntry(r.entry);
+        }
+        t.Run();
+        for (const DecodedInsn &insn : t.insns)
+        {
+            IrRecord rec = toIrRecord(insn);
+            w.Write(&rec, sizeof(rec));
+            xrefs.Add(insn);
+        }
+    }
+    else
+    {
+        InstrDecoder d(r, opt.resync);
+        DecodedInsn insn;
+        while (d.Next(&insn))
+        {
+            IrRecord rec = toIrRecord(insn);
+            w.Write(&rec, sizeof(rec));
+            xrefs.Add(insn);
+        }
+        bad = d.badBytes;
+    }
+    w.End();
+    xrefs.Finish();
+
+    w.Begin(IrSectionStrings, 1);
+    for (const char *name : mnemonicNames)
+    {
+        w.Write(name, strlen(name) + 1);
+    }
+    w.End();
+    w.Begin(IrSectionImage, 1);
+    w.Write(r.Data(), r.Size());
+    w.End();
+    w.Begin(IrSectionLoad, sizeof(IrLoad));
+    w.Write(&load, sizeof(load));
+    w.End();
+    w.Begin(IrSectionXrefTargets, sizeof(IrXrefTarget));
+    for (size_t i = 0; i < xrefs.targets.size(); i++)
+    {
+        IrXrefTarget row = {xrefs.targets[i], xrefs.first[i]};
+        w.Write(&row, sizeof(row));
+    }
+    w.End();
+    w.Begin(IrSectionXrefs, sizeof(IrXref));
+    for (const Xref &x : xrefs.refs)
+    {
+        IrXref rec = {x.from, (uint8_t)x.kind, {}};
+        w.Write(&rec, sizeof(rec));
+    }
+    w.End();
+    return bad;
+}
+
+// writeIr to the file --emit-ir names. Returns the number of bad bytes, or
+// -1 with *error set.
+static long emitIr(const Reader &r, const IrLoad &load, const Options &opt, const char **error)
+{
+    int fd = open(opt.irOut, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        *error = strerror(errno);
+        return -1;
+    }
+    IrWriter w(fd);
+    size_t bad = writeIr(w, r, load, opt);
+    bool ok = w.Close();
+    if (close(fd) != 0 || !ok)
+    {
+        *error = "failed to write IR file";
+        return -1;
+    }
+    return bad;
+}
+
+// Prints the text of an IR file, the same text the run that wrote it would
+// have printed. Returns nullptr or an error message.
+template <typename Formatter>
+static const char *printIr(const char *path, bool withLabels, OutputSink &out, Formatter f)
+{
+    IrFile ir(path);
+    if (ir.Error())
+    {
+        return ir.Error();
+    }
+    size_t imageLen;
+    const uint8_t *image = ir.Image(&imageLen);
+    const IrRecord *records = ir.Records();
+    size_t n = ir.RecordCount();
+    if (const IrLoad *load = ir.Load())
+    {
+        writeImageNote(*load, imageLen, Formatter::Policy::lineComment, out);
+        f.origin = load->origin;
+    }
+    TargetSet labels;
+    if (withLabels)
+    {
+        // The listing covers the image, or with no image what the records do.
+        size_t end = imageLen;
+        for (size_t i = 0; i < n; i++)
+        {
+            end = std::max<size_t>(end, records[i].offset + records[i].length);
+        }
+        LabelPass pass(0, end);
+        for (size_t i = 0; i < n; i++)
+        {
+            pass.Add(fromIrRecord(records[i]));
+        }
+        pass.Finish(labels);
+        f.labels = &labels;
+    }
+    size_t pos = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        DecodedInsn insn = fromIrRecord(records[i]);
+        if (insn.offset < pos)
+        {
+            char *line = out.Reserve(48);
+            out.Commit(snprintf(line, 48, "%soverlaps the last %zu bytes above\n", Formatter::Policy::lineComment,
+                                pos - insn.offset));
+        }
+        pos = std::max(pos, (size_t)insn.offset + insn.length);
+        size_t shown = std::min<size_t>(insn.length, Formatter::MaxDbBytes);
+        const uint8_t *bytes = image && insn.offset + shown <= imageLen ? image + insn.offset : nullptr;
+        out.Commit(f.Format(insn, out.Reserve(f.Room()), bytes));
+        out.EndInsn();
+    }
+    return nullptr;
+}
+
+// One --xref line: the referencing instruction's offset, the kind of
+// reference and the instruction.
+template <typename Formatter>
+static void printXref(const DecodedInsn &insn, uint8_t kind, OutputSink &out, const Formatter &f)
+{
+    char *p = out.Reserve(f.Room() + 32);
+    int n = snprintf(p, 32, "%u %s ", insn.offset, kind <= (uint8_t)XrefKind::Data ? xrefKindNames[kind] : "?");
+    out.Commit(n + f.Format(insn, p + n));
+    out.EndInsn();
+}
+
+// --xref on an image: indexes the sweep the options select (linear, or
+// recursive from the entries), then prints what references the target.
+// Returns the number of bytes the linear sweep could not decode.
+template <typename Formatter>
+static size_t printXrefs(const Reader &r, const Options &opt, OutputSink &out, Formatter f)
+{
+    XrefIndex xrefs;
+    xrefs.relocs = r.relocs;
+    size_t bad = 0;
+    if (opt.recursive)
+    {
+        RecursiveTraversal t(r.Data(), r.Size());
+        t.relocs = r.relocs;
+        for (long e : opt.entries)
+        {
+            t.AddEntry(e);
+        }
+        if (opt.entries.empty())
+        {
+            t.AddEntry(r.entry);
+        }
+        t.Run();
+        for (const DecodedInsn &insn : t.insns)
+        {
+            xrefs.Add(insn);
+        }
+    }
+    else
+    {
+        InstrDecoder d(r, opt.resync);
+        DecodedInsn insn;
+        while (d.Next(&insn))
+        {
+            xrefs.Add(insn);
+        }
+        bad = d.badBytes;
+    }
+    xrefs.Finish();
+
+    size_t n;
+    const Xref *refs = xrefs.Find(opt.xrefTarget, &n);
+    for (size_t i = 0; i < n; i++)
+    {
+        DecodedInsn insn;
+        decodeInsn(r.Data() + refs[i].from, r.Size() - refs[i].from, &insn);
+        insn.offset = refs[i].from;
+        printXref(insn, (uint8_t)refs[i].kind, out, f);
+    }
+    return bad;
+}
+
+// --xref on an IR file, from the index it carries: no decoding, a binary
+// search for the target and one per reference for its record.
+template <typename Formatter>
+static const char *printIrXrefs(const char *path, uint32_t target, OutputSink &out, Formatter f)
+{
+    IrFile ir(path);
+    if (ir.Error())
+    {
+        return ir.Error();
+    }
+    if (!ir.Section(IrSectionXrefTargets))
+    {
+        return "IR file has no cross-reference index";
+    }
+    const IrRecord *records = ir.Records();
+    const IrRecord *end = records + ir.RecordCount();
+    size_t n;
+    const IrXref *refs = ir.XrefsTo(target, &n);
+    for (size_t i = 0; i < n; i++)
+    {
+        const IrRecord *rec = std::lower_bound(records, end, refs[i].from,
+                                               [](const IrRecord &r, uint32_t off) { return r.offset < off; });
+        if (rec != end && rec->offset == refs[i].from)
+        {
+            printXref(fromIrRecord(*rec), refs[i].kind, out, f);
+        }
+    }
+    return nullptr;
+}
+
+// --stats over one image on several threads. Each chunk gets a sweep of its
+// own that starts a little before the chunk boundary and counts from its
+// first instruction at or past it. Merging in order keeps a chunk's counts
+// when the true sweep lands on one of the first instructions the chunk's
+// sweep saw, less what it counted before that point; otherwise the true
+// sweep is stepped serially, as ParallelSweep does.
+struct ParallelStats
+{
+    static constexpr size_t ChunkSize = 4 << 20;
+    static constexpr size_t Lookback = 32;
+    static constexpr size_t Window = 64; // starts kept per chunk for syncing
+
+    struct Chunk
+    {
+        size_t first; // first instruction the chunk counted
+        size_t end;   // the next chunk's boundary
+        size_t stop;  // where its sweep crossed end, or the end of the sweep
+        std::vector<uint32_t> starts; // its first Window starts, less first
+        InsnStats stats;
+    };
+
+    const uint8_t *p;
+    size_t size;
+    size_t resync;
+    unsigned jobs;
+
+public:
+    ParallelStats(const uint8_t *p, size_t size, size_t resync, unsigned jobs)
+        : p(p), size(size), resync(resync), jobs(jobs) {}
+
+    void Scan(Chunk &c, size_t boundary)
+    {
+        InsnStats lead; // the instructions before the boundary, not counted
+        size_t pos = boundary > Lookback ? boundary - Lookback : 0;
+        while (pos < boundary)
+        {
+            pos = lead.Step(p, size, pos, resync);
+        }
+        c.first = pos;
+        while (pos < c.end)
+        {
+            if (c.starts.size() < Window)
             {
-                // reg field is the source register
-                printMod(b1, b2);
-                printf(", ");
-                printf("%s", getRegName(b2->reg, b1->word));
+                c.starts.push_back(pos - c.first);
             }
-            break;
-        case Instruction::CmpAccImm:
-            if (b1->reg_is_dest)
+            pos = c.stats.Step(p, size, pos, resync);
+        }
+        c.stop = pos;
+    }
+
+    // Takes the counts from offset `next` up to the end of chunk c into
+    // total and returns the offset the following chunk has to pick up.
+    size_t Merge(const Chunk &c, size_t next, InsnStats &total)
+    {
+        while (next < c.end)
+        {
+            if (next >= c.first && next - c.first <= c.starts.back())
             {
-                if (b1->word)
-                {
-                    printf("AAS");
-                }
-                else
+                uint32_t rel = next - c.first;
+                if (std::binary_search(c.starts.begin(), c.starts.end(), rel))
                 {
-                    printf("DS:");
+                    InsnStats before;
+                    for (size_t pos = c.first; pos < next;)
+                    {
+                        pos = before.Step(p, size, pos, resync);
+                    }
+                    total.Add(c.stats);
+                    total.Add(before, -1);
+                    return c.stop;
                 }
             }
-            else
+            next = total.Step(p, size, next, resync);
+        }
+        return next;
+    }
+
+    InsnStats Run()
+    {
+        InsnStats total;
+        size_t count = (size + ChunkSize - 1) / ChunkSize;
+        if (jobs <= 1 || count <= 1)
+        {
+            for (size_t pos = 0; pos < size;)
+            {
+                pos = total.Step(p, size, pos, resync);
+            }
+            return total;
+        }
+        std::vector<Chunk> chunks(count);
+        std::atomic<size_t> claimed(0);
+        std::vector<std::thread> workers;
+        for (unsigned k = 0; k < std::min<size_t>(jobs, count); k++)
+        {
+            workers.emplace_back([&]
             {
-                if (b1->word)
+                for (size_t i; (i = claimed.fetch_add(1)) < count;)
                 {
-                    printf("CMP AX, %d", buffer->ReadInt<uint16_t>(Little));
+                    chunks[i].end = std::min((i + 1) * ChunkSize, size);
+                    Scan(chunks[i], i * ChunkSize);
                 }
-                else
+            });
+        }
+        for (std::thread &t : workers)
+        {
+            t.join();
+        }
+        size_t next = 0;
+        for (const Chunk &c : chunks)
+        {
+            // A chunk's sweep that ran off its end without a start counted
+            // nothing and cannot be synced with.
+            if (c.starts.empty())
+            {
+                while (next < c.end)
                 {
-                    printf("CMP AL, %d", buffer->ReadByte());
+                    next = total.Step(p, size, next, resync);
                 }
+                continue;
             }
-            break;
-        case AddRegMem:
-            printf("ADD ");
+            next = Merge(c, next, total);
+        }
+        return total;
+    }
+};
 
-            byte2 = buffer->ReadByte();
-            b2 = reinterpret_cast<Byte2 *>(&byte2);
-            if (b1->reg_is_dest)
-            {
-                printf("%s, ", getRegName(b2->reg, b1->word));
-                // reg field is the destination register
-                printMod(b1, b2);
-            }
-            else
+// Writes the --stats report for s, gathered over `files` inputs, as text
+// or JSON. Tables are sorted by count and leave out what never occurred.
+static void printStats(const InsnStats &s, size_t files, bool json, FILE *to)
+{
+    auto order = [](const uint64_t *counts, size_t n)
+    {
+        std::vector<size_t> idx;
+        for (size_t i = 0; i < n; i++)
+        {
+            if (counts[i])
             {
-                // reg field is the source register
-                printMod(b1, b2);
-                printf(", ");
-                printf("%s", getRegName(b2->reg, b1->word));
+                idx.push_back(i);
             }
-            break;
-        case Instruction::AddAccImm:
-            if (b1->reg_is_dest)
+        }
+        std::stable_sort(idx.begin(), idx.end(), [&](size_t a, size_t b) { return counts[a] > counts[b]; });
+        return idx;
+    };
+    auto share = [&](uint64_t n) { return s.insns ? 100.0 * n / s.insns : 0.0; };
+    static const char *modNames[] = {"0", "1", "2", "3", "none"};
+    double average = s.insns ? (double)s.bytes / s.insns : 0.0;
+    std::vector<size_t> mnemonics = order(s.mnemonics, (size_t)Mnemonic::Count);
+    std::vector<size_t> opcodes = order(s.opcodes, 256);
+
+    if (json)
+    {
+        fprintf(to, "{\n  \"files\": %zu,\n  \"instructions\": %llu,\n  \"bytes\": %llu,\n", files,
+                (unsigned long long)s.insns, (unsigned long long)s.bytes);
+        fprintf(to, "  \"average_length\": %.4f,\n  \"bad_bytes\": %llu,\n  \"bad_runs\": %llu,\n", average,
+                (unsigned long long)s.badBytes, (unsigned long long)s.badRecords);
+        fprintf(to, "  \"prefixed\": %llu,\n  \"prefixes\": {", (unsigned long long)s.prefixed);
+        for (int i = 0; i < InsnStats::PrefixKinds; i++)
+        {
+            fprintf(to, "%s\"%s\": %llu", i ? ", " : "", statsPrefixNames[i], (unsigned long long)s.prefixes[i]);
+        }
+        fprintf(to, "},\n  \"modrm_mod\": {");
+        for (int i = 0; i <= InsnStats::NoModRm; i++)
+        {
+            fprintf(to, "%s\"%s\": %llu", i ? ", " : "", modNames[i], (unsigned long long)s.mods[i]);
+        }
+        fprintf(to, "},\n  \"mnemonics\": {");
+        for (size_t i = 0; i < mnemonics.size(); i++)
+        {
+            fprintf(to, "%s\"%s\": %llu", i ? ", " : "", statsMnemonicName((Mnemonic)mnemonics[i]),
+                    (unsigned long long)s.mnemonics[mnemonics[i]]);
+        }
+        fprintf(to, "},\n  \"opcodes\": {");
+        for (size_t i = 0; i < opcodes.size(); i++)
+        {
+            fprintf(to, "%s\"0x%02x\": %llu", i ? ", " : "", (unsigned)opcodes[i],
+                    (unsigned long long)s.opcodes[opcodes[i]]);
+        }
+        fprintf(to, "}\n}\n");
+        return;
+    }
+
+    fprintf(to, "files %zu, instructions %llu, bytes %llu, average length %.2f, bad bytes %llu in %llu runs\n", files,
+            (unsigned long long)s.insns, (unsigned long long)s.bytes, average, (unsigned long long)s.badBytes,
+            (unsigned long long)s.badRecords);
+    fprintf(to, "prefixed %llu (%.1f%%):", (unsigned long long)s.prefixed, share(s.prefixed));
+    for (int i = 0; i < InsnStats::PrefixKinds; i++)
+    {
+        fprintf(to, " %s %llu", statsPrefixNames[i], (unsigned long long)s.prefixes[i]);
+    }
+    fprintf(to, "\nmodrm mod:");
+    for (int i = 0; i <= InsnStats::NoModRm; i++)
+    {
+        fprintf(to, " %s %llu (%.1f%%)", modNames[i], (unsigned long long)s.mods[i], share(s.mods[i]));
+    }
+    fprintf(to, "\nmnemonics:\n");
+    for (size_t m : mnemonics)
+    {
+        fprintf(to, "  %-10s %12llu %6.2f%%\n", statsMnemonicName((Mnemonic)m), (unsigned long long)s.mnemonics[m],
+                share(s.mnemonics[m]));
+    }
+    fprintf(to, "opcodes:\n");
+    for (size_t op : opcodes)
+    {
+        fprintf(to, "  %02X         %12llu %6.2f%%\n", (unsigned)op, (unsigned long long)s.opcodes[op], share(s.opcodes[op]));
+    }
+}
+
+// --stats: one report over all the inputs.
+static int runStats(const std::vector<const char *> &paths, const Options &opt)
+{
+    InsnStats total;
+    for (const char *path : paths)
+    {
+        Reader file = strcmp(path, "-") ? Reader(path) : Reader(stdin);
+        LoadImage image = loadFile(file, path, opt);
+        const char *error = file.Error() ? file.Error() : image.Error();
+        if (error)
+        {
+            printf("%s: %s\n", path, error);
+            return 1;
+        }
+        total.Add(ParallelStats(image.data, image.size, opt.resync, opt.jobs).Run());
+    }
+    printStats(total, paths.size(), opt.json, stdout);
+    return 0;
+}
+
+// Runs the image as a DOS program: an .EXE if it is one, otherwise as a
+// .COM. What it prints goes to out; how it stopped and how fast it ran go
+// to stderr. Returns the exit status.
+static int emulate(const LoadImage &image, const Options &opt, OutputSink &out)
+{
+    Cpu cpu;
+    loadImage(cpu, image);
+    auto t0 = std::chrono::steady_clock::now();
+    StopReason why = cpu.Run(opt.maxSteps);
+    std::chrono::duration<double> t = std::chrono::steady_clock::now() - t0;
+    out.Write(cpu.output.data(), cpu.output.size());
+    out.Flush();
+
+    double s = std::max(t.count(), 1e-9);
+    fprintf(stderr, "%s at %04X:%04X after %llu instructions, %.3f s, %.2f MIPS\n",
+            stopReasonName(why), cpu.sregs[SegCS], cpu.ip, (unsigned long long)cpu.executed, s, cpu.executed / s / 1e6);
+    fprintf(stderr, "decode cache: %llu hits, %llu misses, %llu invalidations\n",
+            (unsigned long long)cpu.cacheHits, (unsigned long long)cpu.cacheMisses, (unsigned long long)cpu.invalidations);
+    if (why == StopReason::Exit || why == StopReason::Halt)
+    {
+        return cpu.exitCode;
+    }
+    return why == StopReason::StepLimit ? 0 : 1;
+}
+
+// Runs tasks 0..count-1 on a fixed set of threads. Each worker starts with
+// an even share in its own deque and takes from the front; when it runs
+// dry it steals from the back of the others', so a few large inputs do not
+// leave the rest of the pool idle.
+struct WorkStealingPool
+{
+    struct Queue
+    {
+        std::mutex lock;
+        std::deque<size_t> tasks;
+    };
+
+    std::vector<Queue> queues;
+
+public:
+    explicit WorkStealingPool(unsigned workers) : queues(std::max(workers, 1u)) {}
+
+    template <typename F>
+    void Run(size_t count, F task)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            queues[i % queues.size()].tasks.push_back(i);
+        }
+        std::vector<std::thread> threads;
+        for (size_t w = 0; w < queues.size(); w++)
+        {
+            threads.emplace_back([this, w, &task]
             {
-                if (b1->word)
+                size_t i;
+                while (Take(w, &i))
                 {
-                    printf("POP ES");
-                }
-                else
-                {
-                    printf("PUSH ES");
+                    task(i);
                 }
+            });
+        }
+        for (std::thread &t : threads)
+        {
+            t.join();
+        }
+    }
+
+private:
+    bool Take(size_t w, size_t *task)
+    {
+        {
+            std::lock_guard<std::mutex> g(queues[w].lock);
+            if (!queues[w].tasks.empty())
+            {
+                *task = queues[w].tasks.front();
+                queues[w].tasks.pop_front();
+                return true;
             }
-            else
+        }
+        for (size_t k = 1; k < queues.size(); k++)
+        {
+            Queue &victim = queues[(w + k) % queues.size()];
+            std::lock_guard<std::mutex> g(victim.lock);
+            if (!victim.tasks.empty())
             {
-                if (b1->word)
-                {
-                    printf("ADD AX, %d", buffer->ReadInt<uint16_t>(Little));
-                }
-                else
-                {
-                    printf("ADD AL, %d", buffer->ReadByte());
-                }
+                *task = victim.tasks.back();
+                victim.tasks.pop_back();
+                return true;
             }
-            break;
-        case Instruction::OrRegMem:
-            printf("OR ");
-            byte2 = buffer->ReadByte();
-            b2 = reinterpret_cast<Byte2 *>(&byte2);
+        }
+        // Tasks are never added once Run starts, so empty queues stay empty.
+        return false;
+    }
+};
+
+// Name of path's output file in dir: the path with its separators
+// flattened, so inputs with the same base name in different directories
+// do not overwrite each other.
+static std::string outputPath(const char *dir, const char *path)
+{
+    while (path[0] == '.' && path[1] == '/')
+    {
+        path += 2;
+    }
+    std::string name(path);
+    std::replace(name.begin(), name.end(), '/', '_');
+    return std::string(dir) + "/" + name + ".asm";
+}
+
+// Disassembles many files on a work-stealing pool. Every file gets its own
+// Reader and decoder; its text goes to its own file in --out-dir or, under
+// a "; file: path" tag, to stdout in one piece. Returns the exit status.
+static int runBatch(const std::vector<const char *> &paths, const Options &opt)
+{
+    Options single = opt;
+    single.jobs = 1;
+    std::mutex stdoutLock;
+    bool failed = false;
+
+    WorkStealingPool pool(std::min<size_t>(opt.jobs, paths.size()));
+    pool.Run(paths.size(), [&](size_t i)
+    {
+        const char *path = paths[i];
+        Reader file(path);
+        LoadImage image = loadFile(file, path, opt);
+        const char *error = file.Error() ? file.Error() : image.Error();
+        Reader r(image);
+        int fd = STDOUT_FILENO;
+        if (!error && opt.outDir)
+        {
+            fd = open(outputPath(opt.outDir, path).c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        }
+        if (error || fd < 0)
+        {
+            fprintf(stderr, "%s: %s\n", path, error ? error : strerror(errno));
+            std::lock_guard<std::mutex> g(stdoutLock);
+            failed = true;
+            return;
+        }
 
-            if (b1->reg_is_dest)
+        size_t bad;
+        if (opt.outDir)
+        {
+            OutputSink out(fd, OutputSink::FlushWhenFull);
+            if (!opt.lengths)
             {
-                printf("%s, ", b1->word ? getRegNameWset(b2->reg) : getRegNameWclear(b2->reg));
-                printMod(b1, b2);
+                out.Write(preamble(opt.syntax), strlen(preamble(opt.syntax)));
+                writeImageNote(image, opt.syntax, out);
             }
-            else
+            bad = opt.index || opt.range ? disassembleIndexed(r, image, path, single, out) : disassemble(r, single, out);
+            out.Flush();
+            close(fd);
+        }
+        else
+        {
+            OutputSink out(fd, OutputSink::FlushOnRequest);
+            const char *comment = withSyntax(opt.syntax, [](auto f) { return decltype(f)::Policy::lineComment; });
+            out.Write(comment, strlen(comment));
+            out.Write("file: ", 6);
+            out.Write(path, strlen(path));
+            out.Write("\n", 1);
+            if (!opt.lengths)
+            {
+                out.Write(preamble(opt.syntax), strlen(preamble(opt.syntax)));
+                writeImageNote(image, opt.syntax, out);
+            }
+            bad = opt.index || opt.range ? disassembleIndexed(r, image, path, single, out) : disassemble(r, single, out);
+            std::lock_guard<std::mutex> g(stdoutLock);
+            out.Flush();
+        }
+        if (bad)
+        {
+            fprintf(stderr, "%s: %zu bad bytes\n", path, bad);
+        }
+    });
+    return failed ? 1 : 0;
+}
+
+// Appends the paths listed one per line in listPath. Returns false if the
+// list cannot be read.
+static bool readList(const char *listPath, std::vector<std::string> &lines)
+{
+    FILE *f = fopen(listPath, "r");
+    if (!f)
+    {
+        return false;
+    }
+    char line[4096];
+    while (fgets(line, sizeof(line), f))
+    {
+        size_t n = strcspn(line, "\r\n");
+        if (n)
+        {
+            lines.emplace_back(line, n);
+        }
+    }
+    fclose(f);
+    return true;
+}
+
+// Writes all of data to fd, retrying short writes. Returns false on error.
+static bool writeFully(int fd, const uint8_t *data, size_t n)
+{
+    while (n)
+    {
+        ssize_t w = write(fd, data, n);
+        if (w < 0 && errno != EINTR)
+        {
+            return false;
+        }
+        if (w > 0)
+        {
+            data += w;
+            n -= w;
+        }
+    }
+    return true;
+}
+
+// Runs f rounds times and returns the fastest run in seconds.
+template <typename F>
+static double bestOf(int rounds, F f)
+{
+    double best = 0;
+    for (int i = 0; i < rounds; i++)
+    {
+        auto t0 = std::chrono::steady_clock::now();
+        f();
+        std::chrono::duration<double> t = std::chrono::steady_clock::now() - t0;
+        if (i == 0 || t.count() < best)
+        {
+            best = t.count();
+        }
+    }
+    return best;
+}
+
+static void benchReport(const char *name, size_t insns, size_t bytes, double seconds)
+{
+    printf("%-14s %10zu insn %9.2f Minsn/s %9.2f MB/s %7.2f ns/insn\n", name, insns,
+           insns / seconds / 1e6, bytes / seconds / 1e6, seconds * 1e9 / insns);
+}
+
+// Times the decoder over a synthetic corpus: decoding alone, decoding plus
+// formatting, and a whole run from a file on disk to /dev/null.
+static int runBench(const Options &opt)
+{
+    const int Rounds = 5;
+    std::vector<uint8_t> corpus;
+    CorpusGenerator(opt.seed).Generate(opt.benchSize, corpus);
+
+    char path[] = "/tmp/disasm-bench-XXXXXX";
+    int fd = mkstemp(path);
+    bool written = fd >= 0 && writeFully(fd, corpus.data(), corpus.size());
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    int null = open("/dev/null", O_WRONLY);
+    if (!written || null < 0)
+    {
+        printf("bench: cannot set up %s: %s\n", written ? "/dev/null" : path, strerror(errno));
+        unlink(path);
+        return 1;
+    }
+
+    size_t insns = 0;
+    double decode = bestOf(Rounds, [&]
+    {
+        Reader r(corpus.data(), corpus.size());
+        InstrDecoder d(r);
+        DecodedInsn insn;
+        insns = 0;
+        while (d.Next(&insn))
+        {
+            insns++;
+        }
+    });
+    double format = bestOf(Rounds, [&]
+    {
+        Reader r(corpus.data(), corpus.size());
+        InstrDecoder d(r);
+        InsnFormatter f;
+        DecodedInsn insn;
+        char line[InsnFormatter::MaxLine];
+        while (d.Next(&insn))
+        {
+            f.Format(insn, line, corpus.data() + insn.offset);
+        }
+    });
+    double file = bestOf(Rounds, [&]
+    {
+        Reader r(path);
+        OutputSink out(null, OutputSink::FlushWhenFull);
+        disassemble(r, Options(), out);
+    });
+    unlink(path);
+    close(null);
+
+    printf("corpus: %zu bytes, %zu instructions, seed %llu, best of %d\n", corpus.size(), insns,
+           (unsigned long long)opt.seed, Rounds);
+    benchReport("decode", insns, corpus.size(), decode);
+    benchReport("decode+format", insns, corpus.size(), format);
+    benchReport("file", insns, corpus.size(), file);
+    return 0;
+}
+
+// Writes the benchmark corpus to a file so other builds and tools can be
+// measured on exactly the same bytes.
+static int writeCorpus(const Options &opt)
+{
+    std::vector<uint8_t> corpus;
+    CorpusGenerator(opt.seed).Generate(opt.benchSize, corpus);
+    int fd = open(opt.corpusPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || !writeFully(fd, corpus.data(), corpus.size()))
+    {
+        printf("%s: %s\n", opt.corpusPath, strerror(errno));
+        return 1;
+    }
+    close(fd);
+    return 0;
+}
+
+// One serial sweep of the whole image into text, as the listing prints it.
+template <typename Formatter>
+static std::vector<char> listImage(const Reader &r, size_t resync, const Formatter &f)
+{
+    std::vector<char> text(1 << 16);
+    size_t used = 0;
+    InstrDecoder d(r, resync);
+    DecodedInsn insn;
+    while (d.Next(&insn))
+    {
+        if (text.size() - used < f.Room())
+        {
+            text.resize(text.size() * 2);
+        }
+        used += f.Format(insn, text.data() + used, r.Data() + insn.offset);
+    }
+    text.resize(used);
+    return text;
+}
+
+// Lists one image from opt.stress threads at once, all sharing the Reader,
+// the formatter and its labels, and checks each listing against a serial
+// one. Under ThreadSanitizer (make stress) this also checks that decoding
+// and formatting touch no shared mutable state.
+template <typename Formatter>
+static int stressWith(const Reader &r, const Options &opt, Formatter f)
+{
+    f.origin = r.origin;
+    TargetSet labels;
+    if (opt.labels)
+    {
+        collectLabels(r, 0, 0, r.Size(), opt.resync, labels);
+        f.labels = &labels;
+    }
+    std::vector<char> expected = listImage(r, opt.resync, f);
+    std::vector<std::vector<char>> listings(opt.stress);
+    std::atomic<unsigned> ready(0);
+    std::vector<std::thread> workers;
+    for (unsigned k = 0; k < opt.stress; k++)
+    {
+        workers.emplace_back([&, k]
+        {
+            // Start together so the sweeps overlap.
+            ready++;
+            while (ready.load() < opt.stress)
             {
-                printMod(b1, b2);
-                printf(", ");
-                printf("%s", b1->word ? getRegNameWset(b2->reg) : getRegNameWclear(b2->reg));
+                std::this_thread::yield();
             }
+            listings[k] = listImage(r, opt.resync, f);
+        });
+    }
+    for (std::thread &t : workers)
+    {
+        t.join();
+    }
+    unsigned failed = 0;
+    for (unsigned k = 0; k < opt.stress; k++)
+    {
+        if (listings[k] != expected)
+        {
+            printf("stress: thread %u listed the image differently\n", k);
+            failed++;
+        }
+    }
+    printf("stress: %u threads, %zu bytes listed by each, %s\n", opt.stress, expected.size(),
+           failed ? "mismatch" : "all identical");
+    return failed ? 1 : 0;
+}
+
+// --stress on file.bin, or on the --seed/--size corpus without one.
+static int runStress(const std::vector<const char *> &paths, const Options &opt)
+{
+    std::vector<uint8_t> corpus;
+    if (paths.empty())
+    {
+        CorpusGenerator(opt.seed).Generate(opt.benchSize, corpus);
+    }
+    Reader file = paths.empty() ? Reader(corpus.data(), corpus.size()) : Reader(paths[0]);
+    // The generated corpus is raw code, whatever its first bytes look like.
+    LoadImage image = paths.empty() ? LoadImage(file.Data(), file.Size(), ImageFormat::Raw) : loadFile(file, paths[0], opt);
+    const char *error = file.Error() ? file.Error() : image.Error();
+    if (error)
+    {
+        printf("%s: %s\n", paths.empty() ? "<corpus>" : paths[0], error);
+        return 1;
+    }
+    Reader r(image);
+    return withSyntax(opt.syntax, [&](auto f) { return stressWith(r, opt, f); });
+}
+
+// Reads up to n bytes from fd, retrying short reads. Returns the number
+// read, less than n at end of file or on error.
+static size_t readFully(int fd, void *data, size_t n)
+{
+    size_t done = 0;
+    while (done < n)
+    {
+        ssize_t got = read(fd, static_cast<uint8_t *>(data) + done, n - done);
+        if (got < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (got <= 0)
+        {
+            break;
+        }
+        done += got;
+    }
+    return done;
+}
+
+// One request on a --serve connection: the image as read off the socket
+// and, once a worker is done with it, the whole response in out, which
+// writes to the socket only when the connection's writer flushes it.
+struct ServeJob
+{
+    ServeRequest request;
+    std::vector<uint8_t> image;
+    OutputSink out;
+    bool done = false; // guarded by the connection's lock
+
+public:
+    ServeJob(int fd, const ServeRequest &request)
+        : request(request), out(fd, OutputSink::FlushOnRequest, 1 << 12)
+    {
+        out.limit = sizeof(ServeResponse) + ServeMaxResponse;
+        // Room for the header, filled in once the payload length is known.
+        out.Reserve(sizeof(ServeResponse));
+        out.Commit(sizeof(ServeResponse));
+    }
+
+    void Respond(ServeStatus status, size_t badBytes)
+    {
+        ServeResponse h = {{serveResponseMagic[0], serveResponseMagic[1], serveResponseMagic[2], serveResponseMagic[3]},
+                           request.id, (uint32_t)(out.len - sizeof(h)), (uint32_t)badBytes, status, {}};
+        memcpy(out.buf, &h, sizeof(h));
+    }
+
+    // Replaces any payload with an error message.
+    void Fail(ServeStatus status, const char *message)
+    {
+        out.len = sizeof(ServeResponse);
+        out.Write(message, strlen(message));
+        Respond(status, 0);
+    }
+};
+
+// A client connection. Its reader thread queues jobs here in request order
+// and hands them to the workers; its writer thread sends each response as
+// soon as it and all those before it are done, so requests can be
+// pipelined without waiting for answers.
+struct ServeConnection
+{
+    static constexpr size_t MaxPipelined = 64; // jobs in flight before reading stops
+    static constexpr int IdleSeconds = 30;     // longest wait for a client to send or receive
+
+    int fd;
+    std::mutex lock;
+    std::condition_variable changed; // a job finished or left, or reading ended
+    std::deque<std::shared_ptr<ServeJob>> jobs;
+    bool reading = true;
+
+public:
+    explicit ServeConnection(int fd) : fd(fd) {}
+};
+
+// Open connections, each with a reader and a writer thread. Accepting
+// waits while there are Max of them, so clients wait in the listen backlog
+// rather than costing threads.
+struct ServeConnections
+{
+    static constexpr unsigned Max = 128;
+
+    std::mutex lock;
+    std::condition_variable closed;
+    unsigned open = 0;
+
+public:
+    void Acquire()
+    {
+        std::unique_lock<std::mutex> g(lock);
+        closed.wait(g, [&] { return open < Max; });
+        open++;
+    }
+
+    void Release()
+    {
+        std::lock_guard<std::mutex> g(lock);
+        open--;
+        closed.notify_one();
+    }
+};
+
+// Jobs waiting for a worker, from all connections. Push blocks while it is
+// full, so a busy daemon stops reading requests rather than buffering them.
+struct ServeQueue
+{
+    struct Item
+    {
+        std::shared_ptr<ServeConnection> connection;
+        std::shared_ptr<ServeJob> job;
+    };
+
+    std::mutex lock;
+    std::condition_variable notEmpty, notFull;
+    std::deque<Item> items;
+    size_t capacity;
+
+public:
+    explicit ServeQueue(size_t capacity) : capacity(capacity) {}
+
+    void Push(Item item)
+    {
+        std::unique_lock<std::mutex> g(lock);
+        notFull.wait(g, [&] { return items.size() < capacity; });
+        items.push_back(std::move(item));
+        notEmpty.notify_one();
+    }
+
+    Item Pop()
+    {
+        std::unique_lock<std::mutex> g(lock);
+        notEmpty.wait(g, [&] { return !items.empty(); });
+        Item item = std::move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return item;
+    }
+};
+
+// Decodes one request's image into its response.
+static void serveRequest(ServeJob &job)
+{
+    const ServeRequest &q = job.request;
+    if (q.syntax > (uint8_t)Syntax::Att || (q.flags & ~(ServeLabels | ServeRecursive | ServeIr)))
+    {
+        job.Fail(ServeBadOption, "unknown syntax or flags");
+        return;
+    }
+    Options opt;
+    opt.syntax = (Syntax)q.syntax;
+    opt.labels = q.flags & ServeLabels;
+    opt.recursive = q.flags & ServeRecursive;
+    opt.resync = q.resync;
+    LoadImage image(job.image.data(), job.image.size(), ImageFormat::Raw);
+    Reader r(image);
+    size_t bad;
+    bool fits;
+    if (q.flags & ServeIr)
+    {
+        std::vector<uint8_t> ir;
+        IrWriter w(&ir, ServeMaxResponse);
+        bad = writeIr(w, r, irLoadOf(image), opt);
+        fits = w.Close();
+        job.out.Write(reinterpret_cast<const char *>(ir.data()), ir.size());
+    }
+    else
+    {
+        job.out.Write(preamble(opt.syntax), strlen(preamble(opt.syntax)));
+        bad = disassemble(r, opt, job.out);
+        fits = !job.out.dropped;
+    }
+    if (!fits)
+    {
+        job.Fail(ServeTooLarge, "response too large");
+        return;
+    }
+    job.Respond(ServeOk, bad);
+}
+
+static void serveReader(std::shared_ptr<ServeConnection> c, ServeQueue &queue)
+{
+    for (;;)
+    {
+        ServeRequest request;
+        memset(&request, 0, sizeof(request));
+        size_t n = readFully(c->fd, &request, sizeof(request));
+        if (n == 0)
+        {
             break;
-        case OrAccImm:
-            if (b1->reg_is_dest)
-            {
-                if (b1->word)
-                {
-                    printf("Unused Intruction (pop CS): %d\n", byte >> 2);
-                    abort();
-                }
-                else
-                {
-                    printf("PUSH CS");
-                }
-            }
-            else
-            {
-                if (b1->word)
-                {
-                    printf("OR AX, %d", buffer->ReadInt<uint16_t>(Little));
-                }
-                else
-                {
-                    printf("OR AL, %d", buffer->ReadByte());
-                }
-            }
+        }
+        auto job = std::make_shared<ServeJob>(c->fd, request);
+        bool malformed = n < sizeof(request) || memcmp(request.magic, serveRequestMagic, 4) ||
+                         request.length > ServeMaxImage;
+        if (!malformed)
+        {
+            job->image.resize(request.length);
+            malformed = readFully(c->fd, job->image.data(), request.length) < request.length;
+        }
+        if (malformed)
+        {
+            job->Fail(ServeMalformed, "malformed request");
+            job->done = true;
+        }
+        {
+            std::unique_lock<std::mutex> g(c->lock);
+            c->changed.wait(g, [&] { return c->jobs.size() < ServeConnection::MaxPipelined; });
+            c->jobs.push_back(job);
+        }
+        if (malformed)
+        {
+            // The next request cannot be found; answer and hang up.
+            c->changed.notify_all();
             break;
-        case Instruction::AdcRegMem:
-            printf("ADC ");
-            byte2 = buffer->ReadByte();
-            b2 = reinterpret_cast<Byte2 *>(&byte2);
-            if (b1->reg_is_dest)
-            {
-                printf("%s, ", getRegName(b2->reg, b1->word));
-                // reg field is the destination register
-                printMod(b1, b2);
-            }
-            else
+        }
+        queue.Push({c, job});
+    }
+    std::lock_guard<std::mutex> g(c->lock);
+    c->reading = false;
+    c->changed.notify_all();
+}
+
+static void serveWriter(std::shared_ptr<ServeConnection> c, ServeConnections &connections)
+{
+    for (;;)
+    {
+        std::shared_ptr<ServeJob> job;
+        {
+            std::unique_lock<std::mutex> g(c->lock);
+            c->changed.wait(g, [&] { return c->jobs.empty() ? !c->reading : c->jobs.front()->done; });
+            if (c->jobs.empty())
             {
-                // reg field is the source register
-                printMod(b1, b2);
-                printf(", ");
-                printf("%s", getRegName(b2->reg, b1->word));
+                break;
             }
-            break;
-        case Instruction::AdcAccImm:
-            if (b1->reg_is_dest)
+            job = std::move(c->jobs.front());
+            c->jobs.pop_front();
+        }
+        c->changed.notify_all();
+        job->out.Flush();
+        if (job->out.failed)
+        {
+            // The client is gone or stopped reading: wake the reader and
+            // fail the rest of the responses fast.
+            shutdown(c->fd, SHUT_RDWR);
+        }
+    }
+    close(c->fd);
+    connections.Release();
+}
+
+// --serve: a daemon answering ServeRequests on a Unix stream socket, decoded
+// by opt.jobs resident workers. Runs until killed.
+static int runServe(const Options &opt)
+{
+    // A client that hangs up early must not take the daemon with it.
+    signal(SIGPIPE, SIG_IGN);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(opt.servePath) >= sizeof(addr.sun_path))
+    {
+        printf("%s: socket path too long\n", opt.servePath);
+        return 1;
+    }
+    strcpy(addr.sun_path, opt.servePath);
+    struct stat st;
+    if (lstat(opt.servePath, &st) == 0 && S_ISSOCK(st.st_mode))
+    {
+        // Left over from an earlier daemon; bind fails on it otherwise.
+        unlink(opt.servePath);
+    }
+    int s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (s < 0 || bind(s, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0 || listen(s, SOMAXCONN) != 0)
+    {
+        printf("%s: %s\n", opt.servePath, strerror(errno));
+        return 1;
+    }
+
+    unsigned workers = std::max(opt.jobs, 1u);
+    static ServeQueue queue(4 * workers);
+    static ServeConnections connections;
+    for (unsigned k = 0; k < workers; k++)
+    {
+        std::thread([]
+        {
+            for (;;)
             {
-                if (b1->word)
-                {
-                    printf("POP SS");
-                }
-                else
+                ServeQueue::Item item = queue.Pop();
+                serveRequest(*item.job);
                 {
-                    printf("PUSH SS");
+                    std::lock_guard<std::mutex> g(item.connection->lock);
+                    item.job->done = true;
                 }
+                item.connection->changed.notify_all();
             }
-            else
+        }).detach();
+    }
+    fprintf(stderr, "serve: %s, %u worker%s\n", opt.servePath, workers, workers == 1 ? "" : "s");
+    for (;;)
+    {
+        connections.Acquire();
+        int fd = accept4(s, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            connections.Release();
+            if (errno == EINTR || errno == ECONNABORTED)
             {
-                if (b1->word)
-                {
-                    printf("ADC AX, %d", buffer->ReadInt<uint16_t>(Little));
-                }
-                else
-                {
-                    printf("ADC AL, %d", buffer->ReadByte());
-                }
+                continue;
             }
-            break;
-        case Instruction::SbbRegMem:
-            printf("SBB ");
-            byte2 = buffer->ReadByte();
-            b2 = reinterpret_cast<Byte2 *>(&byte2);
-            if (b1->reg_is_dest)
+            printf("%s: %s\n", opt.servePath, strerror(errno));
+            exit(1);
+        }
+        // A client that neither sends nor reads gives up its slot.
+        struct timeval idle = {ServeConnection::IdleSeconds, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &idle, sizeof(idle));
+        auto c = std::make_shared<ServeConnection>(fd);
+        std::thread(serveReader, c, std::ref(queue)).detach();
+        std::thread(serveWriter, c, std::ref(connections)).detach();
+    }
+}
+
+static void usage()
+{
+    printf("Usage: ./[app] [--lengths] [--jobs N] [--resync N] [--recursive | --blocks] [--entry OFFSET]... file.bin\n"
+           "       ./[app] [options] [--out-dir DIR] [--list FILE] file.bin...\n"
+           "       ./[app] [--recursive] [--entry OFFSET]... --emit-ir OUT file.bin | --from-ir FILE\n"
+           "       ./[app] [--index] [--index-step N] [--at OFFSET | --range A:B] file.bin\n"
+           "       ./[app] --emulate [--max-steps N] file.com\n"
+           "       ./[app] --stats [--json] [--jobs N] [--resync N] file.bin...\n"
+           "       ./[app] --xref ADDR [--recursive] [--entry OFFSET]... file.bin | --from-ir FILE\n"
+           "       --syntax intel|nasm|att selects the listing syntax (default intel)\n"
+           "       --no-labels prints branch displacements instead of label_XXXX targets\n"
+           "       --format auto|raw|com|exe picks the input format (default: by MZ signature, then .com name)\n"
+           "       --profile reports time per phase on stderr (disasm-profile builds)\n"
+           "       ./[app] --bench | --gen-corpus FILE [--seed N] [--size BYTES]\n"
+           "       ./[app] --stress THREADS [--syntax S] [--no-labels] [--seed N] [--size BYTES] [file.bin]\n"
+           "       ./[app] --serve SOCKET [--jobs N]\n");
+    exit(1);
+}
+
+// Everything after option parsing. Returns the exit status.
+static int run(const std::vector<const char *> &paths, const Options &opt)
+{
+    if (opt.bench)
+    {
+        return runBench(opt);
+    }
+    if (opt.corpusPath)
+    {
+        return writeCorpus(opt);
+    }
+    if (opt.stress)
+    {
+        return runStress(paths, opt);
+    }
+    if (opt.servePath)
+    {
+        return runServe(opt);
+    }
+    if (opt.irIn)
+    {
+        OutputSink out(STDOUT_FILENO, isatty(STDOUT_FILENO) ? OutputSink::FlushEveryInsn : OutputSink::FlushWhenFull);
+        const char *error;
+        if (opt.xref)
+        {
+            error = withSyntax(opt.syntax, [&](auto f) { return printIrXrefs(opt.irIn, opt.xrefTarget, out, f); });
+        }
+        else
+        {
+            out.Write(preamble(opt.syntax), strlen(preamble(opt.syntax)));
+            error = withSyntax(opt.syntax, [&](auto f) { return printIr(opt.irIn, opt.labels, out, f); });
+        }
+        out.Flush();
+        if (error)
+        {
+            printf("%s: %s\n", opt.irIn, error);
+            return 1;
+        }
+        return 0;
+    }
+    if (paths.empty())
+    {
+        usage();
+    }
+    if (opt.stats)
+    {
+        return runStats(paths, opt);
+    }
+    if (paths.size() > 1 || opt.outDir)
+    {
+        return runBatch(paths, opt);
+    }
+
+    const char *path = paths[0];
+    OutputSink out(STDOUT_FILENO, isatty(STDOUT_FILENO) ? OutputSink::FlushEveryInsn : OutputSink::FlushWhenFull);
+    if (!opt.lengths && !opt.emulate && !opt.irOut && !opt.xref)
+    {
+        out.Write(preamble(opt.syntax), strlen(preamble(opt.syntax)));
+    }
+    size_t bad;
+    bool stream = !strcmp(path, "-");
+    std::unique_ptr<StreamDecoder> streamed;
+    if (stream && !opt.labels && !opt.lengths && !opt.recursive && !opt.blocks && opt.jobs <= 1 && !opt.irOut &&
+        !opt.range && !opt.emulate && !opt.xref && (opt.format == ImageFormat::Auto || opt.format == ImageFormat::Raw))
+    {
+        streamed.reset(new StreamDecoder(STDIN_FILENO, opt.resync));
+    }
+    size_t peeked = 0;
+    const uint8_t *head = streamed ? streamed->Buffered(&peeked) : nullptr;
+    if (streamed && !streamed->Error() && imageFormatOf(opt.format, path, head, peeked) == ImageFormat::Raw)
+    {
+        // A plain sweep of stdin never needs more than the ring buffer.
+        const char *error;
+        bad = withSyntax(opt.syntax, [&](auto f) { return disassembleStream(*streamed, out, &error, f); });
+        out.Flush();
+        if (error)
+        {
+            fprintf(stderr, "-: %s\n", error);
+            return 1;
+        }
+    }
+    else
+    {
+        // Modes that jump around the image or take two passes over it, IR
+        // files, which carry a copy of it, and MZ images read all of stdin
+        // first, starting with anything the stream has already buffered.
+        Reader file = !stream ? Reader(path) : streamed ? Reader(STDIN_FILENO, head, peeked) : Reader(stdin);
+        if (file.Error())
+        {
+            printf("%s\n", file.Error());
+            return 1;
+        }
+        LoadImage image = loadFile(file, path, opt);
+        if (image.Error())
+        {
+            printf("%s: %s\n", path, image.Error());
+            return 1;
+        }
+        if (opt.emulate)
+        {
+            return emulate(image, opt, out);
+        }
+        Reader r(image);
+        if (!opt.lengths && !opt.irOut && !opt.xref)
+        {
+            writeImageNote(image, opt.syntax, out);
+        }
+        if (opt.irOut)
+        {
+            const char *error;
+            long n = emitIr(r, irLoadOf(image), opt, &error);
+            if (n < 0)
             {
-                printf("%s, ", getRegName(b2->reg, b1->word));
-                // reg field is the destination register
-                printMod(b1, b2);
+                printf("%s: %s\n", opt.irOut, error);
+                return 1;
             }
-            else
+            bad = n;
+        }
+        else if (opt.xref)
+        {
+            bad = withSyntax(opt.syntax, [&](auto f) { return printXrefs(r, opt, out, f); });
+        }
+        else if (opt.index || opt.range)
+        {
+            bad = disassembleIndexed(r, image, path, opt, out);
+        }
+        else
+        {
+            bad = disassemble(r, opt, out);
+        }
+        out.Flush();
+    }
+    if (bad)
+    {
+        fprintf(stderr, "%s: %zu bad bytes\n", path, bad);
+    }
+    return 0;
+}
+
+int main(int argc, char const *argv[])
+{
+    std::vector<const char *> paths;
+    std::vector<std::string> listed;
+    Options opt;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--lengths"))
+        {
+            opt.lengths = true;
+        }
+        else if (!strcmp(argv[i], "--jobs") && i + 1 < argc)
+        {
+            opt.jobs = atoi(argv[++i]);
+            if (opt.jobs == 0)
             {
-                // reg field is the source register
-                printMod(b1, b2);
-                printf(", ");
-                printf("%s", getRegName(b2->reg, b1->word));
+                opt.jobs = std::thread::hardware_concurrency();
             }
-            break;
-        case Instruction::SbbAccImm:
-            if (b1->reg_is_dest)
+        }
+        else if (!strcmp(argv[i], "--resync") && i + 1 < argc)
+        {
+            opt.resync = strtoul(argv[++i], nullptr, 0);
+        }
+        else if (!strcmp(argv[i], "--recursive"))
+        {
+            opt.recursive = true;
+        }
+        else if (!strcmp(argv[i], "--blocks"))
+        {
+            opt.blocks = true;
+        }
+        else if (!strcmp(argv[i], "--entry") && i + 1 < argc)
+        {
+            opt.entries.push_back(strtol(argv[++i], nullptr, 0));
+        }
+        else if (!strcmp(argv[i], "--bench"))
+        {
+            opt.bench = true;
+        }
+        else if (!strcmp(argv[i], "--gen-corpus") && i + 1 < argc)
+        {
+            opt.corpusPath = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--seed") && i + 1 < argc)
+        {
+            opt.seed = strtoull(argv[++i], nullptr, 0);
+        }
+        else if (!strcmp(argv[i], "--size") && i + 1 < argc)
+        {
+            opt.benchSize = strtoul(argv[++i], nullptr, 0);
+        }
+        else if (!strcmp(argv[i], "--out-dir") && i + 1 < argc)
+        {
+            opt.outDir = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--list") && i + 1 < argc)
+        {
+            if (!readList(argv[++i], listed))
             {
-                if (b1->word)
-                {
-                    printf("POP DS");
-                }
-                else
-                {
-                    printf("PUSH DS");
-                }
+                printf("%s: %s\n", argv[i], strerror(errno));
+                return 1;
             }
-            else
+        }
+        else if (!strcmp(argv[i], "--emit-ir") && i + 1 < argc)
+        {
+            opt.irOut = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--from-ir") && i + 1 < argc)
+        {
+            opt.irIn = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--index"))
+        {
+            opt.index = true;
+        }
+        else if (!strcmp(argv[i], "--index-step") && i + 1 < argc)
+        {
+            opt.indexStep = strtoul(argv[++i], nullptr, 0);
+        }
+        else if (!strcmp(argv[i], "--at") && i + 1 < argc)
+        {
+            opt.range = true;
+            opt.rangeStart = strtoul(argv[++i], nullptr, 0);
+            opt.rangeEnd = opt.rangeStart + 1;
+        }
+        else if (!strcmp(argv[i], "--range") && i + 1 < argc)
+        {
+            char *end;
+            opt.range = true;
+            opt.rangeStart = strtoul(argv[++i], &end, 0);
+            if (*end != ':')
             {
-                if (b1->word)
-                {
-                    printf("SBB AX, %d", buffer->ReadInt<uint16_t>(Little));
-                }
-                else
-                {
-                    printf("SBB AL, %d", buffer->ReadByte());
-                }
+                usage();
             }
-            break;
-        case Instruction::AndRegMem:
-            printf("AND ");
-            byte2 = buffer->ReadByte();
-            b2 = reinterpret_cast<Byte2 *>(&byte2);
-            if (b1->reg_is_dest)
+            opt.rangeEnd = strtoul(end + 1, nullptr, 0);
+        }
+        else if (!strcmp(argv[i], "--syntax") && i + 1 < argc)
+        {
+            i++;
+            if (!strcmp(argv[i], "intel"))
             {
-                printf("%s, ", getRegName(b2->reg, b1->word));
-                // reg field is the destination register
-                printMod(b1, b2);
+                opt.syntax = Syntax::Intel;
             }
-            else
+            else if (!strcmp(argv[i], "nasm"))
             {
-                // reg field is the source register
-                printMod(b1, b2);
-                printf(", ");
-                printf("%s", getRegName(b2->reg, b1->word));
+                opt.syntax = Syntax::Nasm;
             }
-            break;
-        case Instruction::AndAccImm:
-            if (b1->reg_is_dest)
+            else if (!strcmp(argv[i], "att"))
             {
-                if (b1->word)
-                {
-                    printf("DAA");
-                }
-                else
-                {
-                    printf("ES:");
-                }
+                opt.syntax = Syntax::Att;
             }
             else
             {
-                if (b1->word)
-                {
-                    printf("AND AX, %d", buffer->ReadInt<uint16_t>(Little));
-                }
-                else
-                {
-                    printf("AND AL, %d", buffer->ReadByte());
-                }
-            }
-            break;
-        case Instruction::SubRegMem:
-            printf("SUB ");
-            byte2 = buffer->ReadByte();
-            b2 = reinterpret_cast<Byte2 *>(&byte2);
-            if (b1->reg_is_dest)
-            {
-                printf("%s, ", getRegName(b2->reg, b1->word));
-                // reg field is the destination register
-                printMod(b1, b2);
+                usage();
             }
-            else
+        }
+        else if (!strcmp(argv[i], "--stats"))
+        {
+            opt.stats = true;
+        }
+        else if (!strcmp(argv[i], "--json"))
+        {
+            opt.json = true;
+        }
+        else if (!strcmp(argv[i], "--profile"))
+        {
+            opt.profile = true;
+        }
+        else if (!strcmp(argv[i], "--no-labels"))
+        {
+            opt.labels = false;
+        }
+        else if (!strcmp(argv[i], "--emulate"))
+        {
+            opt.emulate = true;
+        }
+        else if (!strcmp(argv[i], "--max-steps") && i + 1 < argc)
+        {
+            opt.maxSteps = strtoull(argv[++i], nullptr, 0);
+        }
+        else if (!strcmp(argv[i], "--format") && i + 1 < argc)
+        {
+            i++;
+            if (!strcmp(argv[i], "auto"))
             {
-                // reg field is the source register
-                printMod(b1, b2);
-                printf(", ");
-                printf("%s", getRegName(b2->reg, b1->word));
+                opt.format = ImageFormat::Auto;
             }
-            break;
-        case Instruction::SubAccImm:
-            if (b1->reg_is_dest)
+            else if (!strcmp(argv[i], "raw"))
             {
-                if (b1->word)
-                {
-                    printf("DAS");
-                }
-                else
-                {
-                    printf("CS:");
-                }
+                opt.format = ImageFormat::Raw;
             }
-            else
+            else if (!strcmp(argv[i], "com"))
             {
-                if (b1->word)
-                {
-                    printf("SUB AX, %d", buffer->ReadInt<uint16_t>(Little));
-                }
-                else
-                {
-                    printf("SUB AL, %d", buffer->ReadByte());
-                }
+                opt.format = ImageFormat::Com;
             }
-            break;
-        case Instruction::XorRegMem:
-            printf("XOR ");
-            byte2 = buffer->ReadByte();
-            b2 = reinterpret_cast<Byte2 *>(&byte2);
-            if (b1->reg_is_dest)
+            else if (!strcmp(argv[i], "exe"))
             {
-                printf("%s, ", getRegName(b2->reg, b1->word));
-                // reg field is the destination register
-                printMod(b1, b2);
+                opt.format = ImageFormat::Mz;
             }
             else
             {
-                // reg field is the source register
-                printMod(b1, b2);
-                printf(", ");
-                printf("%s", getRegName(b2->reg, b1->word));
-            }
-            break;
-        case Instruction::XorAccImm:
-            if (b1->reg_is_dest)
-            {
-                if (b1->word)
-                {
-                    printf("AAA");
-                }
-                else
-                {
-                    printf("SS:");
-                }
+                usage();
             }
-            else
+        }
+        else if (!strcmp(argv[i], "--xref") && i + 1 < argc)
+        {
+            opt.xref = true;
+            opt.xrefTarget = strtoul(argv[++i], nullptr, 0);
+        }
+        else if (!strcmp(argv[i], "--serve") && i + 1 < argc)
+        {
+            opt.servePath = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--stress") && i + 1 < argc)
+        {
+            opt.stress = strtoul(argv[++i], nullptr, 0);
+            if (opt.stress == 0)
             {
-                if (b1->word)
-                {
-                    printf("SUB AX, %d", buffer->ReadInt<uint16_t>(Little));
-                }
-                else
-                {
-                    printf("SUB AL, %d", buffer->ReadByte());
-                }
+                usage();
             }
-            break;
-        default:
-            printf("unhandled instruction: %d\n", b1->opcode);
-            // fflush(stdout);
-            abort();
-            break;
         }
-        printf("\n");
-        return true;
+        else if (argv[i][0] == '-' && argv[i][1])
+        {
+            usage();
+        }
+        else
+        {
+            paths.push_back(argv[i]);
+        }
     }
-
-    ~InstrDecoder() {}
-};
-// const xx = 0b100000;
-int main(int argc, char const *argv[])
-{
-    if(argc != 2) {
-        printf("Usage: ./[app] file.bin\n");
-        exit(1);
+    for (const std::string &s : listed)
+    {
+        paths.push_back(s.c_str());
     }
-    Reader r(argv[1]);
-    InstrDecoder d(&r);
-    while (d.Next());
-    return 0;
+#ifdef DISASM_PROFILE
+    if (opt.profile)
+    {
+        // Reported after run() returns, when its output has been flushed
+        // and its worker threads joined.
+        ProfileRun profile;
+        int status = run(paths, opt);
+        profile.Report(stderr);
+        return status;
+    }
+#else
+    if (opt.profile)
+    {
+        fprintf(stderr, "--profile needs a build with -DDISASM_PROFILE (make profile)\n");
+        return 1;
+    }
+#endif
+    return run(paths, opt);
 }
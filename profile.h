@@ -0,0 +1,282 @@
+// Phase timing for the hot paths: where a run spends its time between
+// reading input, decoding, formatting and writing output.
+//
+// Instrumentation is a DISASM_PROFILE_SCOPE(phase) at the top of each
+// phase's functions. Unless the build defines DISASM_PROFILE the macro
+// expands to nothing and nothing below it is compiled in, so the scopes
+// stay in production builds at no cost (`make profile` builds
+// disasm-profile with them).
+//
+// Time is counted in TSC ticks, exclusively: entering a nested scope
+// pauses the enclosing one, so every tick of a thread belongs to exactly
+// one phase and the phases add up to the total. Each thread counts into its
+// own thread_local totals, folded into the process totals when it exits.
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+
+enum ProfilePhase : uint8_t
+{
+    ProfileOther,    // outside any scope: setup, merging, control flow
+    ProfileRead,     // Reader loading and stream refills
+    ProfileDecode,   // decodeInsn / insnLength
+    ProfileFormat,   // BasicFormatter::Format, less its operands
+    ProfileOperands, // operand text: registers, ModRM memory, immediates
+    ProfileOutput,   // OutputSink and IrWriter writes
+    ProfilePhaseCount
+};
+
+#ifdef DISASM_PROFILE
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <mutex>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#define DISASM_PROFILE_JOIN2(a, b) a##b
+#define DISASM_PROFILE_JOIN(a, b) DISASM_PROFILE_JOIN2(a, b)
+#define DISASM_PROFILE_SCOPE(phase) ProfileScope DISASM_PROFILE_JOIN(profileScope, __LINE__)(phase)
+
+inline uint64_t profileTicks()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+inline uint64_t profileNanoseconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct ProfileTotals
+{
+    uint64_t ticks[ProfilePhaseCount] = {};
+    uint64_t calls[ProfilePhaseCount] = {};
+
+    void Add(const ProfileTotals &t)
+    {
+        for (int i = 0; i < ProfilePhaseCount; i++)
+        {
+            ticks[i] += t.ticks[i];
+            calls[i] += t.calls[i];
+        }
+    }
+};
+
+// Totals of the threads that have exited.
+struct ProfileProcess
+{
+    std::mutex lock;
+    ProfileTotals totals;
+};
+
+inline ProfileProcess profileProcess;
+
+struct ProfileThread
+{
+    ProfileTotals totals;
+    ProfilePhase current;
+    uint64_t mark; // tick the current phase was last charged up to
+
+public:
+    ProfileThread() : current(ProfileOther), mark(profileTicks()) {}
+
+    void Switch(ProfilePhase to)
+    {
+        uint64_t now = profileTicks();
+        totals.ticks[current] += now - mark;
+        mark = now;
+        current = to;
+    }
+
+    ~ProfileThread()
+    {
+        Switch(ProfileOther);
+        std::lock_guard<std::mutex> g(profileProcess.lock);
+        profileProcess.totals.Add(totals);
+    }
+};
+
+inline thread_local ProfileThread profileThread;
+
+struct ProfileScope
+{
+    ProfilePhase outer;
+
+public:
+    explicit ProfileScope(ProfilePhase phase) : outer(profileThread.current)
+    {
+        profileThread.Switch(phase);
+        profileThread.totals.calls[phase]++;
+    }
+
+    ProfileScope(const ProfileScope &) = delete;
+    ProfileScope &operator=(const ProfileScope &) = delete;
+
+    ~ProfileScope()
+    {
+        profileThread.Switch(outer);
+    }
+};
+
+// Hardware counters for the whole run, this thread and the threads it
+// starts: cycles, instructions and branch misses, where perf_event_open is
+// allowed (perf_event_paranoid, containers). Without them the report has
+// the TSC phase times only.
+struct ProfileCounters
+{
+    static constexpr int Count = 3;
+
+    int fds[Count];
+    const char *error; // why the counters are unavailable, or nullptr
+
+public:
+    ProfileCounters() : error(nullptr)
+    {
+        for (int &fd : fds)
+        {
+            fd = -1;
+        }
+#ifdef __linux__
+        static const uint64_t configs[Count] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                                PERF_COUNT_HW_BRANCH_MISSES};
+        for (int i = 0; i < Count; i++)
+        {
+            struct perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = configs[i];
+            attr.disabled = 1;
+            attr.inherit = 1; // count the worker threads too
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+            if (fds[i] < 0)
+            {
+                error = strerror(errno);
+                Close();
+                return;
+            }
+        }
+        for (int fd : fds)
+        {
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#else
+        error = "not supported on this platform";
+#endif
+    }
+
+    ProfileCounters(const ProfileCounters &) = delete;
+    ProfileCounters &operator=(const ProfileCounters &) = delete;
+
+    // Current values, or false if the counters are unavailable.
+    bool Read(uint64_t values[Count]) const
+    {
+        for (int i = 0; i < Count; i++)
+        {
+            if (fds[i] < 0 || read(fds[i], &values[i], sizeof(values[i])) != sizeof(values[i]))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void Close()
+    {
+        for (int &fd : fds)
+        {
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+            fd = -1;
+        }
+    }
+
+    ~ProfileCounters()
+    {
+        Close();
+    }
+};
+
+// One --profile run: started before the input is opened, Report()ed once
+// all worker threads have been joined.
+struct ProfileRun
+{
+    uint64_t startTicks;
+    uint64_t startNs;
+    ProfileCounters counters;
+
+public:
+    ProfileRun() : startTicks(profileTicks()), startNs(profileNanoseconds()) {}
+
+    void Report(FILE *to)
+    {
+        static const char *names[ProfilePhaseCount] = {"other", "read", "decode", "format", "operands", "output"};
+        uint64_t values[ProfileCounters::Count];
+        bool haveCounters = counters.Read(values);
+        double ns = (double)(profileNanoseconds() - startNs);
+        double ticksPerNs = (double)(profileTicks() - startTicks) / (ns > 0 ? ns : 1);
+
+        ProfileTotals t;
+        profileThread.Switch(profileThread.current);
+        {
+            std::lock_guard<std::mutex> g(profileProcess.lock);
+            t = profileProcess.totals;
+        }
+        t.Add(profileThread.totals);
+        uint64_t all = 0;
+        for (uint64_t ticks : t.ticks)
+        {
+            all += ticks;
+        }
+
+        fprintf(to, "profile: %.3f ms wall, phase times summed over threads\n", ns / 1e6);
+        fprintf(to, "  %-9s %12s %10s %7s %12s\n", "phase", "calls", "ms", "share", "ticks/call");
+        for (int i = 0; i < ProfilePhaseCount; i++)
+        {
+            fprintf(to, "  %-9s %12llu %10.3f %6.1f%% %12.1f\n", names[i], (unsigned long long)t.calls[i],
+                    t.ticks[i] / ticksPerNs / 1e6, all ? 100.0 * t.ticks[i] / all : 0.0,
+                    t.calls[i] ? (double)t.ticks[i] / t.calls[i] : 0.0);
+        }
+        if (haveCounters)
+        {
+            fprintf(to, "  cycles %llu, instructions %llu (IPC %.2f), branch misses %llu\n",
+                    (unsigned long long)values[0], (unsigned long long)values[1],
+                    values[0] ? (double)values[1] / values[0] : 0.0, (unsigned long long)values[2]);
+        }
+        else
+        {
+            fprintf(to, "  hardware counters unavailable: %s\n", counters.error ? counters.error : "read failed");
+        }
+    }
+};
+
+#else
+
+#define DISASM_PROFILE_SCOPE(phase)
+
+#endif
+
+#endif
@@ -0,0 +1,61 @@
+// Wire protocol of --serve, for clients that keep one daemon busy instead
+// of starting the program per image. A client connects to the daemon's Unix
+// stream socket and sends requests back to back without waiting; responses
+// come back on the same connection in request order.
+//
+// Request:  ServeRequest, then length bytes of raw image
+// Response: ServeResponse, then length bytes of payload: the listing text
+//           (what a plain run prints on stdout), an IR file, or with a
+//           failure status an error message
+//
+// All integers are little-endian. After a response with ServeMalformed the
+// daemon closes the connection, since it cannot find the next request.
+#ifndef SERVE_H
+#define SERVE_H
+
+#include <stdint.h>
+
+constexpr char serveRequestMagic[4] = {'D', '8', '6', 'Q'};
+constexpr char serveResponseMagic[4] = {'D', '8', '6', 'R'};
+constexpr uint32_t ServeMaxImage = 16 << 20;
+constexpr uint32_t ServeMaxResponse = 64 << 20; // payload bytes
+
+enum ServeFlags : uint8_t
+{
+    ServeLabels = 1,    // label branch targets, as without --no-labels
+    ServeRecursive = 2, // follow control flow from offset 0 (--recursive)
+    ServeIr = 4         // reply with an IR file instead of text (--emit-ir)
+};
+
+enum ServeStatus : uint8_t
+{
+    ServeOk,
+    ServeBadOption, // unknown syntax or flags; the connection stays usable
+    ServeMalformed, // bad magic or an image over ServeMaxImage
+    ServeTooLarge   // the payload would pass ServeMaxResponse
+};
+
+struct ServeRequest
+{
+    char magic[4];   // "D86Q"
+    uint32_t id;     // echoed in the response
+    uint32_t length; // image bytes that follow
+    uint8_t syntax;  // Syntax value: 0 intel, 1 nasm, 2 att
+    uint8_t flags;   // ServeFlags
+    uint16_t resync; // as --resync; 0 stops at the first bad byte
+};
+
+struct ServeResponse
+{
+    char magic[4];     // "D86R"
+    uint32_t id;
+    uint32_t length;   // payload bytes that follow
+    uint32_t badBytes; // bytes that did not decode
+    uint8_t status;    // ServeStatus
+    uint8_t reserved[3];
+};
+
+static_assert(sizeof(ServeRequest) == 16, "ServeRequest layout");
+static_assert(sizeof(ServeResponse) == 20, "ServeResponse layout");
+
+#endif
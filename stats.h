@@ -0,0 +1,122 @@
+// Instruction statistics for a linear sweep: how often each mnemonic,
+// opcode byte, ModRM mod and prefix occurs, gathered with the length
+// decoder and the opcode tables alone, so nothing is formatted and no
+// operands are decoded. Like disasm.h this only reads memory the caller
+// provides.
+#ifndef STATS_H
+#define STATS_H
+
+#include <algorithm>
+#include "disasm.h"
+
+struct InsnStats
+{
+    static constexpr int NoModRm = 4; // mods[] slot for instructions without one
+    static constexpr int PrefixKinds = 7; // one per Prefix bit
+
+    uint64_t insns = 0;
+    uint64_t bytes = 0;      // in decoded instructions, prefixes included
+    uint64_t badBytes = 0;   // skipped as undecodable or cut off
+    uint64_t badRecords = 0; // runs of bad bytes, as the sweep reports them
+    uint64_t prefixed = 0;   // instructions with at least one prefix
+    uint64_t mnemonics[(size_t)Mnemonic::Count] = {};
+    uint64_t opcodes[256] = {}; // by the first byte after any prefixes
+    uint64_t mods[5] = {};
+    uint64_t prefixes[PrefixKinds] = {}; // prefix bytes by Prefix bit
+
+public:
+    // Counts what a sweep finds at p[pos..size) and returns where it goes
+    // next: past the instruction, or past the bad bytes it skips (resync as
+    // for InstrDecoder; size when the sweep stops).
+    size_t Step(const uint8_t *p, size_t size, size_t pos, size_t resync)
+    {
+        const uint8_t *q = p + pos;
+        DecodeStatus status;
+        size_t len = insnLength(q, size - pos, &status);
+        if (status != DecodeStatus::Ok)
+        {
+            size_t skip = status == DecodeStatus::Invalid && resync ? std::min(resync, size - pos) : size - pos;
+            badBytes += skip;
+            badRecords++;
+            return pos + skip;
+        }
+        size_t i = 0;
+        for (; i < len && (lengthTable.flags[q[i]] & LenPrefix); i++)
+        {
+            prefixes[__builtin_ctz(opcodeTable.spec[q[i]].group)]++;
+        }
+        prefixed += i != 0;
+        insns++;
+        bytes += len;
+        if (i == len)
+        {
+            // Prefixes cut off by a repeat of their kind.
+            mnemonics[(size_t)Mnemonic::Prefix]++;
+            mods[NoModRm]++;
+            return pos + len;
+        }
+        const OpcodeSpec &spec = opcodeTable.spec[q[i]];
+        Mnemonic m = spec.mnemonic;
+        if (spec.flags & SpecModRm)
+        {
+            uint8_t modrm = q[i + 1];
+            mods[modrm >> 6]++;
+            if (spec.flags & SpecGroup)
+            {
+                m = groupTable[spec.group][(modrm >> 3) & 0b111].mnemonic;
+            }
+        }
+        else
+        {
+            mods[NoModRm]++;
+        }
+        mnemonics[(size_t)m]++;
+        opcodes[q[i]]++;
+        return pos + len;
+    }
+
+    // Adds (sign 1) or takes away (sign -1) the counts of another sweep.
+    void Add(const InsnStats &s, int64_t sign = 1)
+    {
+        insns += sign * s.insns;
+        bytes += sign * s.bytes;
+        badBytes += sign * s.badBytes;
+        badRecords += sign * s.badRecords;
+        prefixed += sign * s.prefixed;
+        for (size_t i = 0; i < (size_t)Mnemonic::Count; i++)
+        {
+            mnemonics[i] += sign * s.mnemonics[i];
+        }
+        for (int i = 0; i < 256; i++)
+        {
+            opcodes[i] += sign * s.opcodes[i];
+        }
+        for (int i = 0; i <= NoModRm; i++)
+        {
+            mods[i] += sign * s.mods[i];
+        }
+        for (int i = 0; i < PrefixKinds; i++)
+        {
+            prefixes[i] += sign * s.prefixes[i];
+        }
+    }
+};
+
+// Stable names for report keys: asmMnemonicNames, with the far forms of
+// CALL and JMP told apart.
+inline const char *statsMnemonicName(Mnemonic m)
+{
+    switch (m)
+    {
+    case Mnemonic::CallFar:
+        return "call far";
+    case Mnemonic::JmpFar:
+        return "jmp far";
+    default:
+        return asmMnemonicNames[(size_t)m];
+    }
+}
+
+constexpr const char *statsPrefixNames[InsnStats::PrefixKinds] = {"es", "cs", "ss", "ds", "lock", "repne", "rep"};
+
+#endif